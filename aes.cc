@@ -1,11 +1,15 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 
 #include <cstdlib>
 #include <cstdio>
 #include <cstdint>
 
 #include "aes.h"
+#include "arena.h"
+#include "vperm.h"
+#include "drbg.h"
 
 using namespace std;
 
@@ -180,9 +184,13 @@ static const uint8_t GMUL_E[] = {
 };
 
 
-AESEngine::AESEngine (const AESMode m, const vector<uint8_t>& k)
-	: mode(m), key(k)
+AESEngine::AESEngine (const AESMode m, const vector<uint8_t>& k, Backend b)
+	: mode(m), backend(b), key(k)
 {
+	if (backend == AES_BACKEND_AUTO || !backendAvailable(backend)) {
+		backend = backendAvailable(AES_BACKEND_VPERM) ? AES_BACKEND_VPERM : AES_BACKEND_TABLE;
+	}
+
 	while (key.size() < keySize()) {
 		key.push_back(0);
 	}
@@ -190,13 +198,22 @@ AESEngine::AESEngine (const AESMode m, const vector<uint8_t>& k)
 		key.resize(keySize());
 	}
 
-	key = vector<uint8_t>(k.size());
-	copy(k.begin(), k.end(), key.begin());
-
 	nrounds = key.size() / 4 + 6;
 	schedule = keyExpansion();
 
+	roundkeys = vector<uint8_t>(schedule.size() * AES_BLOCK_SIZE);
+	for (unsigned int r = 0; r < schedule.size(); ++r) {
+		copy(schedule[r].begin(), schedule[r].end(), roundkeys.begin() + r * AES_BLOCK_SIZE);
+	}
+
 	prev = vector<uint8_t>(AES_BLOCK_SIZE);
+
+	cmacK1 = vector<uint8_t>(AES_BLOCK_SIZE);
+	cmacK2 = vector<uint8_t>(AES_BLOCK_SIZE);
+	cmacSubkeys(&cmacK1[0], &cmacK2[0]);
+	cmacState = vector<uint8_t>(AES_BLOCK_SIZE);
+	cmacBuffer = vector<uint8_t>(AES_BLOCK_SIZE);
+	cmacCount = 0;
 }
 
 
@@ -204,6 +221,11 @@ AESEngine::~AESEngine ()
 {
 	fill(key.begin(), key.end(), 0);
 	fill(prev.begin(), prev.end(), 0);
+	fill(roundkeys.begin(), roundkeys.end(), 0);
+	fill(cmacK1.begin(), cmacK1.end(), 0);
+	fill(cmacK2.begin(), cmacK2.end(), 0);
+	fill(cmacState.begin(), cmacState.end(), 0);
+	fill(cmacBuffer.begin(), cmacBuffer.end(), 0);
 	for (unsigned int b = 0; b < schedule.size(); ++b) {
 		for (int k = 0; k < AES_BLOCK_SIZE; ++k) {
 			schedule[b][k] = 0;
@@ -229,11 +251,11 @@ vector<vector<uint8_t>> AESEngine::keyExpansion ()
 			}
 		} else if (nk > 6 && (c % nk) == 4) {
 			for (int r = 0; r < 4; ++r) {
-				w[c][r] = w[c][r - nk] ^ SBOX[w[c - 1][r]];
+				w[c][r] = w[c - nk][r] ^ SBOX[w[c - 1][r]];
 			}
 		} else {
 			for (int r = 0; r < 4; ++r) {
-				w[c][r] = w[c][r - nk] ^ w[c - 1][r];
+				w[c][r] = w[c - nk][r] ^ w[c - 1][r];
 			}
 		}
 	}
@@ -250,6 +272,18 @@ vector<vector<uint8_t>> AESEngine::keyExpansion ()
 }
 
 
+void AESEngine::setIV (const uint8_t *iv)
+{
+	copy(iv, iv + AES_BLOCK_SIZE, prev.begin());
+}
+
+
+void AESEngine::getIV (uint8_t *iv)
+{
+	copy(prev.begin(), prev.end(), iv);
+}
+
+
 //                                               m   
 //    mmm   m mm    mmm    m mm  m   m  mmmm   mm#mm 
 //   #"  #  #"  #  #"  "   #"  " "m m"  #" "#    #   
@@ -261,10 +295,24 @@ vector<vector<uint8_t>> AESEngine::keyExpansion ()
 
 void AESEngine::encryptBlock (uint8_t *block)
 {
-	if (isModeCBC())
+	if (isModeCBC()) {
 		encryptCBC(block, &prev[0]);
+		cipherBlock(block);
+		memcpy(&prev[0], block, AES_BLOCK_SIZE);
+	} else {
+		cipherBlock(block);
+	}
+}
+
+
+void AESEngine::cipherBlock (uint8_t *block)
+{
+	if (backend == AES_BACKEND_VPERM) {
+		vpermEncryptBlock(block, &roundkeys[0], nrounds);
+		return;
+	}
 	encryptAddRoundKey(block, &schedule[0][0]);
-	for (int r = 0; r < nrounds; ++r) {
+	for (int r = 1; r < nrounds; ++r) {
 		encryptSubBytes(block);
 		encryptShiftRows(block);
 		encryptMixColumns(block);
@@ -276,33 +324,163 @@ void AESEngine::encryptBlock (uint8_t *block)
 }
 
 
-void AESEngine::encryptFile (FILE *infile, FILE *outfile)
+/*
+**  Reads until buf holds len bytes or the stream is exhausted.
+*/
+
+size_t readChunk (uint8_t *buf, size_t len, FILE *infile)
 {
-	vector<uint8_t> bufferA(AES_BLOCK_SIZE);
-	uint8_t *buf = (uint8_t *)&bufferA[0];
+	size_t total = 0;
 	size_t count = 0;
-	bool stopped_at_bounds = true;
-	while ((count = fread(buf, 1, AES_BLOCK_SIZE, infile)) > 0) {
-
-		if (count < AES_BLOCK_SIZE) {
-			stopped_at_bounds = false;
-			uint8_t val = (uint8_t)(AES_BLOCK_SIZE - count);
-			while (count < AES_BLOCK_SIZE) {
-				bufferA[count] = val;
-				++count;
-			}
-		}
+	while (total < len && (count = fread(buf + total, 1, len - total, infile)) > 0) {
+		total += count;
+	}
+	return total;
+}
 
-		encryptBlock(buf);
-		fwrite(buf, 1, AES_BLOCK_SIZE, outfile);
+
+void AESEngine::encryptFile (FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	AESBuffer inbuffer(AES_CHUNK_SIZE);
+	AESBuffer outbuffer(AES_CHUNK_SIZE + AES_BLOCK_SIZE);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+	AESStream stream(*this, AESStream::ENCRYPT);
+	size_t count = 0;
+	while ((count = readChunk(inbuf, AES_CHUNK_SIZE, infile)) > 0) {
+		if (mac != NULL)
+			mac->cmacUpdate(inbuf, count);
+		fwrite(outbuf, 1, stream.update(inbuf, count, outbuf), outfile);
 	}
-	if (stopped_at_bounds) {
-		for (int k = 0; k < AES_BLOCK_SIZE; ++k) {
-			buf[k] = 0x10;
-		}
-		encryptBlock(buf);
-		fwrite(buf, 1, AES_BLOCK_SIZE, outfile);
+	fwrite(outbuf, 1, stream.final(outbuf), outfile);
+}
+
+
+//            m                                 
+//    mmm   mm#mm   m mm   mmm    mmm   mmmmm 
+//   #   "    #     #"  " #"  #  "   #  # # # 
+//    """m    #     #     #""""  m"""#  # # # 
+//   "mmm"    "mm   #     "#mm"  "mm"#  # # # 
+//
+
+
+AESStream::AESStream (AESEngine& e, const Direction d)
+	: engine(e), direction(d), count(0)
+{}
+
+
+AESStream::~AESStream ()
+{
+	fill(buffer, buffer + AES_BLOCK_SIZE, 0);
+	count = 0;
+}
+
+
+size_t AESStream::update (const uint8_t *in, size_t len, uint8_t *out)
+{
+	// decryption keeps the last full block back, since only final()
+	// knows whether it is the one carrying the padding
+	const size_t limit = (direction == DECRYPT) ? AES_BLOCK_SIZE : AES_BLOCK_SIZE - 1;
+	size_t nbytes = 0;
+
+	if (count > 0 && count < AES_BLOCK_SIZE) {
+		size_t n = min(len, (size_t)(AES_BLOCK_SIZE - count));
+		memcpy(buffer + count, in, n);
+		count += n;
+		in += n;
+		len -= n;
+	}
+
+	if (count == AES_BLOCK_SIZE && (direction == ENCRYPT || len > 0)) {
+		memcpy(out, buffer, AES_BLOCK_SIZE);
+		if (direction == ENCRYPT)
+			engine.encryptBlock(out);
+		else
+			engine.decryptBlock(out);
+		out += AES_BLOCK_SIZE;
+		nbytes += AES_BLOCK_SIZE;
+		count = 0;
+	}
+
+	while (count == 0 && len > limit) {
+		memcpy(out, in, AES_BLOCK_SIZE);
+		if (direction == ENCRYPT)
+			engine.encryptBlock(out);
+		else
+			engine.decryptBlock(out);
+		in += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+		nbytes += AES_BLOCK_SIZE;
+	}
+
+	if (len > 0) {
+		memcpy(buffer, in, len);
+		count = len;
+	}
+	return nbytes;
+}
+
+
+size_t AESStream::final (uint8_t *out)
+{
+	if (direction == ENCRYPT) {
+		AESEngine::pad(buffer, count);
+		memcpy(out, buffer, AES_BLOCK_SIZE);
+		engine.encryptBlock(out);
+		count = 0;
+		return AES_BLOCK_SIZE;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+	if (count != AES_BLOCK_SIZE) {
+		count = 0;
+		throw IllegalAESBlockSize();
+	}
+	count = 0;
+	engine.decryptBlock(buffer);
+	try {
+		size_t nbytes = AESEngine::unpad(buffer);
+		memcpy(out, buffer, nbytes);
+		fill(buffer, buffer + AES_BLOCK_SIZE, 0);
+		return nbytes;
+	} catch (IllegalAESPadding& e) {
+		fill(buffer, buffer + AES_BLOCK_SIZE, 0);
+		throw;
+	}
+}
+
+
+/*
+**  PKCS#7 padding of the final block
+*/
+
+size_t AESEngine::pad (uint8_t *block, size_t count)
+{
+	uint8_t val = (uint8_t)(AES_BLOCK_SIZE - count);
+	while (count < AES_BLOCK_SIZE) {
+		block[count] = val;
+		++count;
 	}
+	return AES_BLOCK_SIZE;
+}
+
+
+size_t AESEngine::unpad (const uint8_t *block)
+{
+	// every padding byte is checked, without exiting early on a mismatch
+	uint8_t padding = block[AES_BLOCK_SIZE - 1];
+	uint8_t bad = (padding == 0) | (padding > AES_BLOCK_SIZE);
+	for (int k = 0; k < AES_BLOCK_SIZE; ++k) {
+		uint8_t inpad = (uint8_t)(AES_BLOCK_SIZE - k <= padding);
+		bad |= inpad & (block[k] != padding);
+	}
+	if (bad) {
+		throw IllegalAESPadding();
+	}
+	return AES_BLOCK_SIZE - padding;
 }
 
 
@@ -317,56 +495,86 @@ void AESEngine::encryptFile (FILE *infile, FILE *outfile)
 
 void AESEngine::decryptBlock (uint8_t *block)
 {
+	if (isModeCBC()) {
+		uint8_t ciphertext[AES_BLOCK_SIZE];
+		memcpy(ciphertext, block, AES_BLOCK_SIZE);
+		invCipherBlock(block);
+		decryptCBC(block, &prev[0]);
+		memcpy(&prev[0], ciphertext, AES_BLOCK_SIZE);
+	} else {
+		invCipherBlock(block);
+	}
+}
+
+
+void AESEngine::invCipherBlock (uint8_t *block)
+{
+	if (backend == AES_BACKEND_VPERM) {
+		vpermDecryptBlock(block, &roundkeys[0], nrounds);
+		return;
+	}
 	decryptAddRoundKey(block, &schedule[nrounds][0]);
 	decryptShiftRows(block);
 	decryptSubBytes(block);
-	for (int r = nrounds - 1; r >= 0; --r) {
+	for (int r = nrounds - 1; r >= 1; --r) {
 		decryptAddRoundKey(block, &schedule[r][0]);
 		decryptMixColumns(block);
 		decryptShiftRows(block);
 		decryptSubBytes(block);
 	}
 	decryptAddRoundKey(block, &schedule[0][0]);
-	if (isModeCBC())
-		decryptCBC(block, &prev[0]);
 }
 
 
-void AESEngine::decryptFile (FILE *infile, FILE *outfile)
-{
-	vector<uint8_t> bufferA(AES_BLOCK_SIZE);
-	vector<uint8_t> bufferB(AES_BLOCK_SIZE);
-	vector<uint8_t> bufferC(AES_BLOCK_SIZE);
-	uint8_t *newest = (uint8_t *)&bufferA[0];
-	uint8_t *next   = (uint8_t *)&bufferB[0];
-	uint8_t *oldest = (uint8_t *)&bufferC[0];
-	size_t nblocks = 0;
-	size_t count = 0;
-	while ((count = fread(newest, 1, AES_BLOCK_SIZE, infile)) > 0) {
-		if (count != AES_BLOCK_SIZE) {
-			throw IllegalAESBlockSize();
-		}
+/*
+**  n consecutive independent blocks, for callers that have several to
+**  hand: the vperm backend interleaves them.
+*/
 
-		++nblocks;
+void AESEngine::cipherBlocks (uint8_t *blocks, size_t n)
+{
+	if (backend == AES_BACKEND_VPERM) {
+		vpermEncryptBlocks(blocks, n, &roundkeys[0], nrounds);
+		return;
+	}
+	for (size_t k = 0; k < n; ++k)
+		cipherBlock(blocks + k * AES_BLOCK_SIZE);
+}
 
-		if (nblocks >= 2) {
-			decryptBlock(oldest);
-			fwrite(oldest, 1, AES_BLOCK_SIZE, outfile);
-		}
 
-		uint8_t *temp = next;
-		next = newest;
-		oldest = next;
-		newest = temp;
+void AESEngine::invCipherBlocks (uint8_t *blocks, size_t n)
+{
+	if (backend == AES_BACKEND_VPERM) {
+		vpermDecryptBlocks(blocks, n, &roundkeys[0], nrounds);
+		return;
 	}
+	for (size_t k = 0; k < n; ++k)
+		invCipherBlock(blocks + k * AES_BLOCK_SIZE);
+}
+
 
-	decryptBlock(next);
-	uint8_t padding = next[AES_BLOCK_SIZE - 1];
-	if (padding < 0x10) {
-		fwrite(next, 1, AES_BLOCK_SIZE - padding, outfile);
+void AESEngine::decryptFile (FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	AESBuffer inbuffer(AES_CHUNK_SIZE);
+	AESBuffer outbuffer(AES_CHUNK_SIZE + AES_BLOCK_SIZE);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+	AESStream stream(*this, AESStream::DECRYPT);
+	size_t count = 0;
+	size_t nbytes = 0;
+	while ((count = readChunk(inbuf, AES_CHUNK_SIZE, infile)) > 0) {
+		nbytes = stream.update(inbuf, count, outbuf);
+		if (mac != NULL)
+			mac->cmacUpdate(outbuf, nbytes);
+		fwrite(outbuf, 1, nbytes, outfile);
 	}
+	nbytes = stream.final(outbuf);
+	if (mac != NULL)
+		mac->cmacUpdate(outbuf, nbytes);
+	fwrite(outbuf, 1, nbytes, outfile);
 }
 
+
 //                 #      mmmmm           m                 
 //    mmm   m   m  #mmm   #    # m   m  mm#mm   mmm    mmm  
 //   #   "  #   #  #" "#  #mmmm" "m m"    #    #"  #  #   " 
@@ -405,7 +613,7 @@ void AESEngine::encryptShiftRows (uint8_t *block)
 	transpose(block);
 	for (int col = 1; col < 4; ++col) {
 		uint32_t *t = (uint32_t *)(block + (4 * col));
-		*t = rotl(*t, col << 3);
+		*t = rotr(*t, col << 3);
 	}
 	transpose(block);
 }
@@ -416,7 +624,7 @@ void AESEngine::decryptShiftRows (uint8_t *block)
 	transpose(block);
 	for (int col = 1; col < 4; ++col) {
 		uint32_t *t = (uint32_t *)(block + (4 * col));
-		*t = rotr(*t, col << 3);
+		*t = rotl(*t, col << 3);
 	}
 	transpose(block);
 }
@@ -506,26 +714,136 @@ void AESEngine::encryptCBC (uint8_t *block, uint8_t *prev)
 	uint_fast32_t *blk = (uint_fast32_t *)block;
 	uint_fast32_t *pr  = (uint_fast32_t *)prev;
 	while ((uint8_t *)blk < (block + AES_BLOCK_SIZE)) {
-		*blk ^= *pr;
-		*pr = *blk;
-		++blk;
-		++pr;
+		*(blk++) ^= *(pr++);
 	}
 }
 
 
 void AESEngine::decryptCBC (uint8_t *block, uint8_t *prev)
 {
-	uint_fast32_t temp;
-	uint_fast32_t *blk = (uint_fast32_t *)block;
-	uint_fast32_t *pr = (uint_fast32_t *)prev;
-	while ((uint8_t *)blk < (block + AES_BLOCK_SIZE)) {
-		temp = *blk;
-		*blk ^= *pr;
-		*pr = temp;
-		++blk;
-		++pr;
+	encryptCBC(block, prev);
+}
+
+
+//     mmm  m    m   mm     mmm 
+//   m"   " ##  ##   ##   m"   "
+//   #      # ## #  #  #  #     
+//   #      # "" #  #mm#  #     
+//    "mmm" #    # #    #  "mmm"
+//
+
+
+/*
+**  Subkey derivation (SP 800-38B, 6.1)
+*/
+
+static void cmacDouble (uint8_t *out, const uint8_t *in)
+{
+	uint8_t carry = in[0] >> 7;
+	for (int k = 0; k < AES_BLOCK_SIZE - 1; ++k) {
+		out[k] = (uint8_t)((in[k] << 1) | (in[k + 1] >> 7));
+	}
+	out[AES_BLOCK_SIZE - 1] = (uint8_t)(in[AES_BLOCK_SIZE - 1] << 1);
+	out[AES_BLOCK_SIZE - 1] ^= (uint8_t)(0x87 & (0 - carry));
+}
+
+
+void AESEngine::cmacSubkeys (uint8_t *k1, uint8_t *k2)
+{
+	uint8_t l[AES_BLOCK_SIZE] = {0};
+	cipherBlock(l);
+	cmacDouble(k1, l);
+	cmacDouble(k2, k1);
+	fill(l, l + AES_BLOCK_SIZE, 0);
+}
+
+
+void AESEngine::cmacInit ()
+{
+	fill(cmacState.begin(), cmacState.end(), 0);
+	fill(cmacBuffer.begin(), cmacBuffer.end(), 0);
+	cmacCount = 0;
+}
+
+
+void AESEngine::cmacUpdate (const uint8_t *data, size_t len)
+{
+	uint8_t *state = &cmacState[0];
+	uint8_t *buffer = &cmacBuffer[0];
+
+	// a full buffered block is only absorbed once more data shows up,
+	// since the final block is treated differently
+	if (cmacCount == AES_BLOCK_SIZE && len > 0) {
+		for (int k = 0; k < AES_BLOCK_SIZE; ++k)
+			state[k] ^= buffer[k];
+		cipherBlock(state);
+		cmacCount = 0;
+	}
+
+	if (cmacCount == 0) {
+		while (len > AES_BLOCK_SIZE) {
+			for (int k = 0; k < AES_BLOCK_SIZE; ++k)
+				state[k] ^= data[k];
+			cipherBlock(state);
+			data += AES_BLOCK_SIZE;
+			len -= AES_BLOCK_SIZE;
+		}
 	}
+
+	while (len > 0) {
+		if (cmacCount == AES_BLOCK_SIZE) {
+			for (int k = 0; k < AES_BLOCK_SIZE; ++k)
+				state[k] ^= buffer[k];
+			cipherBlock(state);
+			cmacCount = 0;
+		}
+		size_t n = min(len, (size_t)(AES_BLOCK_SIZE - cmacCount));
+		memcpy(buffer + cmacCount, data, n);
+		cmacCount += n;
+		data += n;
+		len -= n;
+	}
+}
+
+
+void AESEngine::cmacFinal (uint8_t *tag)
+{
+	uint8_t *state = &cmacState[0];
+	uint8_t *buffer = &cmacBuffer[0];
+	const uint8_t *subkey = &cmacK1[0];
+	if (cmacCount < AES_BLOCK_SIZE) {
+		buffer[cmacCount] = 0x80;
+		for (int k = cmacCount + 1; k < AES_BLOCK_SIZE; ++k)
+			buffer[k] = 0;
+		subkey = &cmacK2[0];
+	}
+	for (int k = 0; k < AES_BLOCK_SIZE; ++k)
+		state[k] ^= buffer[k] ^ subkey[k];
+	cipherBlock(state);
+	memcpy(tag, state, AES_BLOCK_SIZE);
+	cmacInit();
+}
+
+
+void AESEngine::cmacFile (FILE *infile, uint8_t *tag)
+{
+	AESBuffer buffer(AES_CHUNK_SIZE);
+	uint8_t *buf = buffer.get();
+	size_t count = 0;
+	cmacInit();
+	while ((count = readChunk(buf, AES_CHUNK_SIZE, infile)) > 0) {
+		cmacUpdate(buf, count);
+	}
+	cmacFinal(tag);
+}
+
+
+bool AESEngine::cmacVerify (const uint8_t *tag, const uint8_t *expected)
+{
+	uint8_t diff = 0;
+	for (int k = 0; k < AES_BLOCK_SIZE; ++k)
+		diff |= tag[k] ^ expected[k];
+	return diff == 0;
 }
 
 
@@ -550,13 +868,15 @@ void AESEngine::transpose (uint8_t *block)
 vector<uint8_t> AESEngine::loadKey (const char* filename, AESMode m)
 {
 	FILE *kf = fopen(filename, "rb");
+	if (kf == NULL)
+		throw KeyLoadException(string("unable to open key file: ") + filename);
 	vector<uint8_t> key(keySize(m));
-	if (kf != NULL) {
-		size_t count = fread(&key[0], 1, key.size(), kf);
-		if (count < key.size()) {
-
-		}
-		fclose(kf);
+	size_t count = fread(&key[0], 1, key.size(), kf);
+	fclose(kf);
+	if (count < key.size()) {
+		fill(key.begin(), key.end(), 0);
+		throw KeyLoadException(string("key file too short for a ") + to_string(8 * key.size())
+			+ "-bit key: " + filename);
 	}
 	return key;
 }
@@ -571,18 +891,46 @@ vector<uint8_t> AESEngine::generateKey ()
 vector<uint8_t> AESEngine::generateKey (AESMode m)
 {
 	vector<uint8_t> key(keySize(m));
-	FILE *random = fopen("/dev/urandom", "rb");
-	if (random == NULL)
-		throw KeyGenerationException("unable to open /dev/urandom");
-	if (random != NULL) {
-		size_t count = fread(&key[0], 1, key.size(), random);
-		if (count != key.size())
-			throw KeyGenerationException("unable to create enough entropy");
-	}
+	AESRandom::fill(&key[0], key.size());
 	return key;
 }
 
 
+AESEngine::Backend AESEngine::getBackend ()
+{
+	return backend;
+}
+
+
+bool AESEngine::backendAvailable (Backend b)
+{
+	switch (b) {
+		case AES_BACKEND_AUTO:
+		case AES_BACKEND_TABLE:
+			return true;
+		case AES_BACKEND_VPERM:
+			return vpermAvailable();
+		default:
+			return false;
+	}
+}
+
+
+const char *AESEngine::backendName (Backend b)
+{
+	switch (b) {
+		case AES_BACKEND_AUTO:
+			return "auto";
+		case AES_BACKEND_TABLE:
+			return "table";
+		case AES_BACKEND_VPERM:
+			return "vperm";
+		default:
+			throw IllegalAESMode();
+	}
+}
+
+
 bool AESEngine::isModeECB ()
 {
 	return isModeECB(mode);
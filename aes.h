@@ -5,6 +5,7 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
 #include <exception>
 
 #include <cstdio>
@@ -15,6 +16,7 @@ using namespace std;
 
 
 #define AES_BLOCK_SIZE 16
+#define AES_CHUNK_SIZE (64 * 1024)
 
 
 class AESEngine
@@ -29,29 +31,65 @@ public:
 		AES_256_CBC
 	};
 
+	enum Backend {
+		AES_BACKEND_AUTO,
+		AES_BACKEND_TABLE,
+		AES_BACKEND_VPERM
+	};
+
 private:
 
 	const AESMode mode;
+	Backend backend;
 
 	vector<uint8_t> key;
 	vector<vector<uint8_t>> schedule;
+	vector<uint8_t> roundkeys;
 
 	vector<uint8_t> prev;
 
 	int nrounds;
 
+	vector<uint8_t> cmacK1;
+	vector<uint8_t> cmacK2;
+	vector<uint8_t> cmacState;
+	vector<uint8_t> cmacBuffer;
+	size_t cmacCount;
+
 public:
 
-	AESEngine (const AESMode m, const vector<uint8_t>& k);
+	AESEngine (const AESMode m, const vector<uint8_t>& k, Backend b = AES_BACKEND_AUTO);
 	~AESEngine ();
 
+	Backend getBackend ();
+	static bool backendAvailable (Backend b);
+	static const char *backendName (Backend b);
+
 	vector<vector<uint8_t>> keyExpansion ();
 
+	void setIV (const uint8_t *iv);
+	void getIV (uint8_t *iv);
+
 	void encryptBlock (uint8_t *block);
 	void decryptBlock (uint8_t *block);
 
-	void encryptFile (FILE *in, FILE *out);
-	void decryptFile (FILE *in, FILE *out);
+	void cipherBlock (uint8_t *block);
+	void invCipherBlock (uint8_t *block);
+	void cipherBlocks (uint8_t *blocks, size_t n);
+	void invCipherBlocks (uint8_t *blocks, size_t n);
+
+	void encryptFile (FILE *in, FILE *out, AESEngine *mac = NULL);
+	void decryptFile (FILE *in, FILE *out, AESEngine *mac = NULL);
+
+	void cmacSubkeys (uint8_t *k1, uint8_t *k2);
+	void cmacInit ();
+	void cmacUpdate (const uint8_t *data, size_t len);
+	void cmacFinal (uint8_t *tag);
+	void cmacFile (FILE *in, uint8_t *tag);
+	static bool cmacVerify (const uint8_t *tag, const uint8_t *expected);
+
+	static size_t pad (uint8_t *block, size_t count);
+	static size_t unpad (const uint8_t *block);
 
 	static void encryptSubBytes (uint8_t *block);
 	static void decryptSubBytes (uint8_t *block);
@@ -88,6 +126,43 @@ public:
 };
 
 
+size_t readChunk (uint8_t *buf, size_t len, FILE *infile);
+
+
+/*
+**  Incremental encryption or decryption over an engine. Input may arrive
+**  in fragments of any size; partial blocks are buffered internally and
+**  the padding is added or checked by final(). update() writes at most
+**  len + AES_BLOCK_SIZE bytes, final() at most AES_BLOCK_SIZE, and in and
+**  out must not overlap.
+*/
+
+class AESStream
+{
+public:
+	enum Direction {
+		ENCRYPT,
+		DECRYPT
+	};
+
+private:
+
+	AESEngine& engine;
+	const Direction direction;
+
+	uint8_t buffer[AES_BLOCK_SIZE];
+	size_t count;
+
+public:
+
+	AESStream (AESEngine& e, const Direction d);
+	~AESStream ();
+
+	size_t update (const uint8_t *in, size_t len, uint8_t *out);
+	size_t final (uint8_t *out);
+};
+
+
 class IllegalAESBlockSize : public exception
 {
 
@@ -108,6 +183,17 @@ public:
 };
 
 
+class IllegalAESPadding : public exception
+{
+public:
+
+	virtual const char* what() const throw()
+	{
+		return "illegal AES padding";
+	}
+};
+
+
 class IllegalAESMode : public exception
 {
 public:
@@ -136,6 +222,25 @@ public:
 };
 
 
+class KeyLoadException : public exception
+{
+private:
+
+	string msg;
+
+public:
+
+	KeyLoadException (const string& m) : msg(m) {}
+
+	virtual ~KeyLoadException () throw() {}
+
+	virtual const char* what() const throw()
+	{
+		return msg.c_str();
+	}
+};
+
+
 /*
 **  bitwise rotation
 */
@@ -0,0 +1,231 @@
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "arena.h"
+
+using namespace std;
+
+
+#define AES_ARENA_MIN_SIZE 4096
+#define AES_ARENA_CLASSES 48
+
+
+bool AESBufferArena::hugepages = false;
+
+
+static size_t roundUp (size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+
+/*
+**  Maps at least mapped bytes, page aligned, and sets mapped to what was
+**  really mapped and huge to whether 2 MiB pages back it. MAP_HUGETLB
+**  commits every page it maps from the host's pool, so a reservation,
+**  which is mostly never touched, only asks for transparent ones.
+*/
+
+static uint8_t *mapPages (size_t& mapped, bool hugepages, bool reserve, bool& huge)
+{
+	void *mem = MAP_FAILED;
+	huge = false;
+#ifdef MAP_HUGETLB
+	if (hugepages && !reserve) {
+		size_t rounded = roundUp(mapped, AES_HUGE_PAGE_SIZE);
+		mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		huge = (mem != MAP_FAILED);
+		if (huge)
+			mapped = rounded;
+	}
+#endif
+	if (mem == MAP_FAILED) {
+		// only what is touched is committed, so reserving generously
+		// up front costs nothing but address space
+		mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED)
+			throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+		if (hugepages)
+			huge = (madvise(mem, mapped, MADV_HUGEPAGE) == 0);
+#endif
+	}
+	return (uint8_t *)mem;
+}
+
+
+AESBufferArena::AESBufferArena (size_t s, size_t reserve)
+	: base(NULL), mapped(0), size(roundUp(s, AES_ARENA_MIN_SIZE)), count(0),
+	  huge(false), head(0), carved(0),
+	  next(max((size_t)1, reserve / roundUp(s, AES_ARENA_MIN_SIZE)))
+{
+	count = next.size();
+	mapped = count * size;
+	base = mapPages(mapped, hugepages, true, huge);
+}
+
+
+AESBufferArena::~AESBufferArena ()
+{
+	munmap(base, mapped);
+}
+
+
+uint8_t *AESBufferArena::acquire ()
+{
+	uint64_t old = head.load(memory_order_acquire);
+	while ((old & 0xffffffff) != 0) {
+		uint32_t index = (uint32_t)old - 1;
+		uint64_t tag = (old >> 32) + 1;
+		uint64_t replacement = (tag << 32) | next[index].load(memory_order_relaxed);
+		if (head.compare_exchange_weak(old, replacement,
+				memory_order_acq_rel, memory_order_acquire)) {
+			return base + (size_t)index * size;
+		}
+	}
+
+	// nothing to recycle, so hand out a buffer that was never used
+	size_t fresh = carved.fetch_add(1, memory_order_relaxed);
+	if (fresh < count)
+		return base + fresh * size;
+	return NULL;
+}
+
+
+void AESBufferArena::release (uint8_t *buf)
+{
+	uint32_t index = (uint32_t)((buf - base) / size);
+	uint64_t old = head.load(memory_order_relaxed);
+	uint64_t replacement;
+	do {
+		next[index].store((uint32_t)old, memory_order_relaxed);
+		replacement = (((old >> 32) + 1) << 32) | (index + 1);
+	} while (!head.compare_exchange_weak(old, replacement,
+			memory_order_release, memory_order_relaxed));
+}
+
+
+bool AESBufferArena::owns (const uint8_t *buf)
+{
+	return buf >= base && buf < base + count * size;
+}
+
+
+size_t AESBufferArena::bufferSize ()
+{
+	return size;
+}
+
+
+bool AESBufferArena::hugePages ()
+{
+	return huge;
+}
+
+
+/*
+**  One shared arena per power-of-two size class, created on first use.
+*/
+
+AESBufferArena *AESBufferArena::shared (size_t s)
+{
+	static atomic<AESBufferArena *> classes[AES_ARENA_CLASSES];
+	static mutex creating;
+
+	unsigned int c = 0;
+	while (((size_t)AES_ARENA_MIN_SIZE << c) < s && c + 1 < AES_ARENA_CLASSES)
+		++c;
+
+	AESBufferArena *arena = classes[c].load(memory_order_acquire);
+	if (arena == NULL) {
+		lock_guard<mutex> lk(creating);
+		arena = classes[c].load(memory_order_relaxed);
+		if (arena == NULL) {
+			arena = new AESBufferArena((size_t)AES_ARENA_MIN_SIZE << c);
+			classes[c].store(arena, memory_order_release);
+		}
+	}
+	return arena;
+}
+
+
+void AESBufferArena::useHugePages (bool enable)
+{
+	hugepages = enable;
+}
+
+
+bool AESBufferArena::usingHugePages ()
+{
+	return hugepages;
+}
+
+
+//   #                 m""    m""
+//   #mmm   m   m    mm#mm  mm#mm   mmm    m mm
+//   #" "#  #   #      #      #    #"  #   #"  "
+//   #   #  #   #      #      #    #""""   #
+//   ##m#"  "mm"#      #      #    "#mm"   #
+//
+
+
+AESBuffer::AESBuffer (size_t n, bool fresh)
+	: arena(NULL), data(NULL), size(n), length(n), mapped(false)
+{
+	if (fresh) {
+		bool huge;
+		size = max(n, (size_t)1);
+		data = mapPages(size, AESBufferArena::usingHugePages(), false, huge);
+		mapped = true;
+		return;
+	}
+
+	arena = AESBufferArena::shared(n);
+	data = arena->acquire();
+	if (data != NULL) {
+		size = arena->bufferSize();
+		return;
+	}
+	arena = NULL;
+	void *mem = NULL;
+	if (posix_memalign(&mem, AES_ARENA_MIN_SIZE, n) != 0)
+		throw bad_alloc();
+	data = (uint8_t *)mem;
+}
+
+
+AESBuffer::~AESBuffer ()
+{
+	// the buffers carry plaintext, so they are wiped before reuse; only
+	// what was asked for can have been written, which keeps the rest of
+	// the size class zero too
+	memset(data, 0, length);
+	if (arena != NULL)
+		arena->release(data);
+	else if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+}
+
+
+uint8_t *AESBuffer::get ()
+{
+	return data;
+}
+
+
+size_t AESBuffer::capacity ()
+{
+	return size;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+
+#define AES_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define AES_ARENA_RESERVE (256 * 1024 * 1024)
+
+
+/*
+**  Fixed-size buffers carved out of one up-front mapping and recycled
+**  through a lock-free free list. The mapping is page aligned, reserved
+**  rather than committed, and advised to use transparent 2 MiB pages
+**  when they are asked for; MAP_HUGETLB would take the whole reservation
+**  out of the host's pool at once. acquire() returns NULL once the
+**  reservation is used up.
+*/
+
+class AESBufferArena
+{
+private:
+
+	uint8_t *base;
+	size_t mapped;
+	const size_t size;
+	size_t count;
+	bool huge;
+
+	// head of the free list: a generation tag in the high half guards
+	// against ABA, the index of the first free buffer plus one below it
+	atomic<uint64_t> head;
+	atomic<size_t> carved;
+	vector<atomic<uint32_t>> next;
+
+	static bool hugepages;
+
+public:
+
+	AESBufferArena (size_t s, size_t reserve = AES_ARENA_RESERVE);
+	~AESBufferArena ();
+
+	AESBufferArena (const AESBufferArena&) = delete;
+	AESBufferArena& operator= (const AESBufferArena&) = delete;
+
+	uint8_t *acquire ();
+	void release (uint8_t *buf);
+	bool owns (const uint8_t *buf);
+
+	size_t bufferSize ();
+	bool hugePages ();
+
+	static AESBufferArena *shared (size_t s);
+	static void useHugePages (bool enable);
+	static bool usingHugePages ();
+};
+
+
+/*
+**  A buffer leased from the shared arena for its size class, or from the
+**  heap when the arena is exhausted. A fresh buffer is mapped for itself
+**  instead, so that its pages are placed by whichever thread touches them
+**  first rather than by an earlier lease; being sized to what it holds,
+**  it tries MAP_HUGETLB before transparent huge pages. Wiped and released
+**  on destruction.
+*/
+
+class AESBuffer
+{
+private:
+
+	AESBufferArena *arena;
+	uint8_t *data;
+	size_t size;
+	size_t length;
+	bool mapped;
+
+public:
+
+	explicit AESBuffer (size_t n, bool fresh = false);
+	~AESBuffer ();
+
+	AESBuffer (const AESBuffer&) = delete;
+	AESBuffer& operator= (const AESBuffer&) = delete;
+
+	uint8_t *get ();
+	size_t capacity ();
+};
@@ -0,0 +1,783 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "aes.h"
+#include "parallel.h"
+#include "async.h"
+
+using namespace std;
+
+
+static AESAsyncException systemError (const char *what)
+{
+	return AESAsyncException(string(what) + ": " + strerror(errno));
+}
+
+
+//
+//    mmmmm                  ""#
+//    #   "#  mmm    mmm      #
+//    #mmm#" #" "#  #" "#     #
+//    #      #   #  #   #     #
+//    #      "#m#"  "#m#"     "mm
+//
+
+
+AESPool::AESPool (unsigned int nthreads)
+	: stopping(false)
+{
+	if (nthreads == 0)
+		nthreads = AESParallel::cpus().size();
+	for (unsigned int t = 0; t < nthreads; ++t)
+		workers.push_back(thread(&AESPool::run, this));
+}
+
+
+AESPool::~AESPool ()
+{
+	{
+		lock_guard<mutex> hold(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+}
+
+
+AESPool& AESPool::shared ()
+{
+	static AESPool pool;
+	return pool;
+}
+
+
+void AESPool::run ()
+{
+	for (;;) {
+		function<void ()> job;
+		{
+			unique_lock<mutex> hold(lock);
+			wake.wait(hold, [this] { return stopping || !jobs.empty(); });
+			if (stopping)
+				return;
+			job = move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
+
+
+void AESPool::post (function<void ()> job)
+{
+	{
+		lock_guard<mutex> hold(lock);
+		jobs.push_back(move(job));
+	}
+	wake.notify_one();
+}
+
+
+size_t AESPool::threads ()
+{
+	return workers.size();
+}
+
+
+AESPool::Schedule AESPool::schedule ()
+{
+	return Schedule{*this};
+}
+
+
+AESPool::Each AESPool::each (size_t n, function<void (size_t)> body)
+{
+	return Each(*this, n, move(body));
+}
+
+
+AESPool::Each::Each (AESPool& p, size_t count, function<void (size_t)> b)
+	: pool(p), n(count), body(move(b)), left(count)
+{
+}
+
+
+void AESPool::Each::finish (size_t k)
+{
+	try {
+		body(k);
+	} catch (...) {
+		lock_guard<mutex> hold(failing);
+		if (!error)
+			error = current_exception();
+	}
+	if (left.fetch_sub(1) == 1)
+		waiting.resume();
+}
+
+
+void AESPool::Each::await_suspend (coroutine_handle<> h)
+{
+	// once the last job is posted this awaiter may already be gone
+	waiting = h;
+	AESPool& p = pool;
+	const size_t count = n;
+	for (size_t k = 0; k < count; ++k)
+		p.post([this, k] { finish(k); });
+}
+
+
+void AESPool::Each::await_resume ()
+{
+	if (error)
+		rethrow_exception(error);
+}
+
+
+//
+//    mmmmm                       m
+//    #   "#  mmm    mmm    mmm  mm#mm   mmm    m mm
+//    #mmmm" #"  #  "   #  #"  "   #    #" "#   #"  "
+//    #   "m #""""  m"""#  #       #    #   #   #
+//    #    " "#mm"  "mm"#  "#mm"   "mm  "#m#"   #
+//
+
+
+AESReactor::AESReactor (AESPool& p)
+	: pool(p), nextid(0), stopping(false)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		throw systemError("epoll_create1");
+	wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakefd < 0) {
+		close(epfd);
+		throw systemError("eventfd");
+	}
+	// id 0 is the wake-up, never a wait
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+	loop = thread(&AESReactor::run, this);
+}
+
+
+AESReactor::~AESReactor ()
+{
+	{
+		lock_guard<mutex> hold(lock);
+		stopping = true;
+	}
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) != sizeof(one))
+		abort();
+	loop.join();
+	close(wakefd);
+	close(epfd);
+}
+
+
+AESReactor& AESReactor::shared ()
+{
+	static AESReactor reactor;
+	return reactor;
+}
+
+
+void AESReactor::run ()
+{
+	epoll_event events[64];
+	for (;;) {
+		int n = epoll_wait(epfd, events, 64, -1);
+		if (n < 0 && errno != EINTR)
+			return;
+
+		// a wait that was cancelled meanwhile is no longer registered
+		lock_guard<mutex> hold(lock);
+		if (stopping)
+			return;
+		for (int k = 0; k < n; ++k) {
+			if (events[k].data.u64 == 0)
+				continue;
+			auto r = fds.find((int)(events[k].data.u64 - 1));
+			if (r == fds.end())
+				continue;
+			uint32_t got = events[k].events;
+			bool failed = (got & (EPOLLERR | EPOLLHUP)) != 0;
+			if (r->second.reader != 0 && (failed || (got & EPOLLIN) != 0))
+				resume(r->second.reader);
+			if (r->second.writer != 0 && (failed || (got & EPOLLOUT) != 0))
+				resume(r->second.writer);
+			// the event disarmed the descriptor, whoever it was for
+			if (r->second.reader != 0 || r->second.writer != 0)
+				arm(r->first, r->second);
+		}
+	}
+}
+
+
+// with the lock held
+void AESReactor::resume (uint64_t id)
+{
+	auto w = waits.find(id);
+	if (w == waits.end())
+		return;
+	coroutine_handle<> h = w->second.handle;
+	auto r = fds.find(w->second.fd);
+	if (r != fds.end()) {
+		if (r->second.reader == id)
+			r->second.reader = 0;
+		if (r->second.writer == id)
+			r->second.writer = 0;
+	}
+	waits.erase(w);
+	pool.post([h] { h.resume(); });
+}
+
+
+/*
+**  With the lock held: one registration per descriptor, for whatever its
+**  reader and writer wait on together, since a second EPOLL_CTL_MOD
+**  would replace the first waiter's events rather than add to them.
+*/
+
+bool AESReactor::arm (int fd, Registration& r)
+{
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (r.reader != 0 ? EPOLLIN : 0) | (r.writer != 0 ? EPOLLOUT : 0) | EPOLLONESHOT;
+	ev.data.u64 = (uint64_t)fd + 1;
+	int op = r.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(epfd, op, fd, &ev) != 0) {
+		// closing a descriptor drops it from epoll, and a new one may
+		// have its number
+		op = (errno == ENOENT) ? EPOLL_CTL_ADD : (errno == EEXIST) ? EPOLL_CTL_MOD : -1;
+		if (op < 0 || epoll_ctl(epfd, op, fd, &ev) != 0)
+			return false;
+	}
+	r.added = true;
+	return true;
+}
+
+
+void AESReactor::cancel (uint64_t id)
+{
+	lock_guard<mutex> hold(lock);
+	if (waits.find(id) == waits.end()) {
+		// not registered yet, or already resumed: await_resume() tidies up
+		cancelled.insert(id);
+		return;
+	}
+	resume(id);
+}
+
+
+void AESReactor::forget (int fd)
+{
+	lock_guard<mutex> hold(lock);
+	auto r = fds.find(fd);
+	if (r == fds.end() || r->second.reader != 0 || r->second.writer != 0)
+		return;
+	if (r->second.added)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	fds.erase(r);
+}
+
+
+AESReactor::Ready AESReactor::readable (int fd, stop_token stop)
+{
+	return Ready(*this, fd, EPOLLIN, stop);
+}
+
+
+AESReactor::Ready AESReactor::writable (int fd, stop_token stop)
+{
+	return Ready(*this, fd, EPOLLOUT, stop);
+}
+
+
+AESReactor::Ready::Ready (AESReactor& r, int f, uint32_t e, stop_token s)
+	: reactor(r), fd(f), events(e), stop(s), id(0)
+{
+}
+
+
+/*
+**  The stop callback goes in before the wait is registered, and nothing
+**  of this awaiter is touched after, since the coroutine may be running
+**  on the pool by then.
+*/
+
+bool AESReactor::Ready::await_suspend (coroutine_handle<> h)
+{
+	{
+		lock_guard<mutex> hold(reactor.lock);
+		id = ++reactor.nextid;
+	}
+	AESReactor *r = &reactor;
+	uint64_t key = id;
+	cancel.emplace(stop, [r, key] { r->cancel(key); });
+
+	lock_guard<mutex> hold(reactor.lock);
+	if (reactor.cancelled.count(id) != 0)
+		return false;
+	Registration& reg = reactor.fds.emplace(fd, Registration{0, 0, false}).first->second;
+	uint64_t& slot = (events == EPOLLIN) ? reg.reader : reg.writer;
+	uint64_t was = slot;
+	slot = id;
+	if (!reactor.arm(fd, reg)) {
+		// a regular file, say: it is always ready
+		slot = was;
+		return false;
+	}
+	reactor.waits[id] = Wait{h, fd, events};
+	return true;
+}
+
+
+void AESReactor::Ready::await_resume ()
+{
+	cancel.reset();
+	{
+		lock_guard<mutex> hold(reactor.lock);
+		reactor.cancelled.erase(id);
+	}
+	if (stop.stop_requested())
+		throw AESCancelled();
+}
+
+
+//
+//      mm
+//      ##    mmm   m   m  m mm    mmm
+//     #  #  #   "  "m m"  #"  #  #"  "
+//     #mm#   """m   #m#   #   #  #
+//    #    # "mmm"   "#    #   #  "#mm"
+//                   m"
+//                  ""
+
+
+/*
+**  One chunk in place. chain is the IV or the ciphertext block before the
+**  chunk; it is not written.
+*/
+
+static void cipherChunk (AESEngine& engine, uint8_t *data, size_t len, const uint8_t *chain,
+	bool cbc, bool decrypt)
+{
+	if (!cbc) {
+		if (decrypt)
+			engine.invCipherBlocks(data, len / AES_BLOCK_SIZE);
+		else
+			engine.cipherBlocks(data, len / AES_BLOCK_SIZE);
+		return;
+	}
+
+	uint8_t prev[AES_BLOCK_SIZE];
+	memcpy(prev, chain, AES_BLOCK_SIZE);
+	if (!decrypt) {
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE) {
+			AESEngine::encryptCBC(data + off, prev);
+			engine.cipherBlock(data + off);
+			memcpy(prev, data + off, AES_BLOCK_SIZE);
+		}
+		return;
+	}
+	vector<uint8_t> cipher(data, data + len);
+	engine.invCipherBlocks(data, len / AES_BLOCK_SIZE);
+	AESEngine::decryptCBC(data, prev);
+	for (size_t off = AES_BLOCK_SIZE; off < len; off += AES_BLOCK_SIZE)
+		AESEngine::decryptCBC(data + off, &cipher[off - AES_BLOCK_SIZE]);
+}
+
+
+AESAsync::AESAsync (AESEngine& e, size_t c, AESPool& p, AESReactor& r)
+	: engine(e), pool(p), reactor(r),
+	chunk(max((size_t)AES_BLOCK_SIZE, c - (c % AES_BLOCK_SIZE)))
+{
+}
+
+
+AESTask<void> AESAsync::transform (uint8_t *data, size_t len, const uint8_t *iv, bool decrypt, stop_token stop)
+{
+	const size_t n = (len + chunk - 1) / chunk;
+	const bool cbc = engine.isModeCBC();
+
+	if (cbc && !decrypt) {
+		for (size_t k = 0; k < n; ++k) {
+			if (stop.stop_requested())
+				throw AESCancelled();
+			co_await pool.schedule();
+			const uint8_t *chain = (k == 0) ? iv : data + k * chunk - AES_BLOCK_SIZE;
+			cipherChunk(engine, data + k * chunk, min(chunk, len - k * chunk), chain, true, false);
+		}
+		co_return;
+	}
+
+	// the blocks chunks chain from are overwritten by their neighbours
+	vector<uint8_t> chains(cbc ? n * AES_BLOCK_SIZE : 0);
+	for (size_t k = 0; cbc && k < n; ++k)
+		memcpy(&chains[k * AES_BLOCK_SIZE], (k == 0) ? iv : data + k * chunk - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	co_await pool.each(n, [&] (size_t k) {
+		if (!stop.stop_requested())
+			cipherChunk(engine, data + k * chunk, min(chunk, len - k * chunk),
+				cbc ? &chains[k * AES_BLOCK_SIZE] : NULL, cbc, decrypt);
+	});
+	if (stop.stop_requested())
+		throw AESCancelled();
+}
+
+
+AESTask<vector<uint8_t>> AESAsync::encrypt (vector<uint8_t> data, vector<uint8_t> iv, stop_token stop)
+{
+	if (!iv.empty() && iv.size() != AES_BLOCK_SIZE)
+		throw IllegalAESBlockSize("IVs must be 16 bytes");
+	uint8_t chain[AES_BLOCK_SIZE];
+	memset(chain, 0, AES_BLOCK_SIZE);
+	if (!iv.empty())
+		memcpy(chain, &iv[0], AES_BLOCK_SIZE);
+
+	size_t len = data.size();
+	data.resize(len - (len % AES_BLOCK_SIZE) + AES_BLOCK_SIZE);
+	AESEngine::pad(&data[len - (len % AES_BLOCK_SIZE)], len % AES_BLOCK_SIZE);
+	co_await transform(&data[0], data.size(), chain, false, stop);
+	co_return move(data);
+}
+
+
+AESTask<vector<uint8_t>> AESAsync::decrypt (vector<uint8_t> data, vector<uint8_t> iv, stop_token stop)
+{
+	if (!iv.empty() && iv.size() != AES_BLOCK_SIZE)
+		throw IllegalAESBlockSize("IVs must be 16 bytes");
+	uint8_t chain[AES_BLOCK_SIZE];
+	memset(chain, 0, AES_BLOCK_SIZE);
+	if (!iv.empty())
+		memcpy(chain, &iv[0], AES_BLOCK_SIZE);
+	if (data.empty() || (data.size() % AES_BLOCK_SIZE) != 0)
+		throw IllegalAESBlockSize();
+
+	co_await transform(&data[0], data.size(), chain, true, stop);
+	size_t count = AESEngine::unpad(&data[data.size() - AES_BLOCK_SIZE]);
+	data.resize(data.size() - AES_BLOCK_SIZE + count);
+	co_return move(data);
+}
+
+
+AESTask<size_t> AESAsync::readSome (int fd, uint8_t *buf, size_t len, stop_token stop)
+{
+	for (;;) {
+		if (stop.stop_requested())
+			throw AESCancelled();
+		ssize_t n = read(fd, buf, len);
+		if (n >= 0)
+			co_return (size_t)n;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw systemError("read");
+		co_await reactor.readable(fd, stop);
+	}
+}
+
+
+AESTask<void> AESAsync::writeAll (int fd, const uint8_t *buf, size_t len, stop_token stop)
+{
+	size_t done = 0;
+	while (done < len) {
+		if (stop.stop_requested())
+			throw AESCancelled();
+		ssize_t n = write(fd, buf + done, len - done);
+		if (n >= 0) {
+			done += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw systemError("write");
+		co_await reactor.writable(fd, stop);
+	}
+}
+
+
+// drops the descriptors' registrations however the stream ends
+struct Forget {
+	AESReactor& reactor;
+	int in;
+	int out;
+
+	~Forget ()
+	{
+		reactor.forget(in);
+		reactor.forget(out);
+	}
+};
+
+
+AESTask<uint64_t> AESAsync::encryptStream (int in, int out, stop_token stop)
+{
+	Forget forget{reactor, in, out};
+	vector<uint8_t> buffer(chunk + AES_BLOCK_SIZE);
+	uint8_t chain[AES_BLOCK_SIZE];
+	memset(chain, 0, AES_BLOCK_SIZE);
+	uint64_t total = 0;
+	bool eof = false;
+	while (!eof) {
+		size_t have = 0;
+		while (have < chunk && !eof) {
+			size_t n = co_await readSome(in, &buffer[have], chunk - have, stop);
+			eof = (n == 0);
+			have += n;
+		}
+		total += have;
+
+		size_t len = have;
+		if (eof) {
+			len = have - (have % AES_BLOCK_SIZE) + AES_BLOCK_SIZE;
+			AESEngine::pad(&buffer[have - (have % AES_BLOCK_SIZE)], have % AES_BLOCK_SIZE);
+		}
+		co_await transform(&buffer[0], len, chain, false, stop);
+		memcpy(chain, &buffer[len - AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		co_await writeAll(out, &buffer[0], len, stop);
+	}
+	fill(buffer.begin(), buffer.end(), 0);
+	co_return total;
+}
+
+
+/*
+**  The last block is held back until the input ends, since only it
+**  carries the padding.
+*/
+
+AESTask<uint64_t> AESAsync::decryptStream (int in, int out, stop_token stop)
+{
+	Forget forget{reactor, in, out};
+	vector<uint8_t> buffer(chunk + AES_BLOCK_SIZE);
+	uint8_t chain[AES_BLOCK_SIZE];
+	uint8_t next[AES_BLOCK_SIZE];
+	memset(chain, 0, AES_BLOCK_SIZE);
+	uint64_t total = 0;
+	size_t have = 0;
+	bool eof = false;
+	for (;;) {
+		while (have < buffer.size() && !eof) {
+			size_t n = co_await readSome(in, &buffer[have], buffer.size() - have, stop);
+			eof = (n == 0);
+			have += n;
+		}
+
+		if (eof) {
+			if (have == 0 || (have % AES_BLOCK_SIZE) != 0)
+				throw IllegalAESBlockSize();
+			co_await transform(&buffer[0], have, chain, true, stop);
+			size_t len = have - AES_BLOCK_SIZE + AESEngine::unpad(&buffer[have - AES_BLOCK_SIZE]);
+			co_await writeAll(out, &buffer[0], len, stop);
+			total += len;
+			break;
+		}
+
+		memcpy(next, &buffer[chunk - AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		co_await transform(&buffer[0], chunk, chain, true, stop);
+		memcpy(chain, next, AES_BLOCK_SIZE);
+		co_await writeAll(out, &buffer[0], chunk, stop);
+		total += chunk;
+		memmove(&buffer[0], &buffer[chunk], AES_BLOCK_SIZE);
+		have = AES_BLOCK_SIZE;
+	}
+	fill(buffer.begin(), buffer.end(), 0);
+	co_return total;
+}
+
+
+//
+//    mmmmmmm               m
+//       #     mmm    mmm   mm#mm   mmm
+//       #    #"  #  #   "    #    #   "
+//       #    #""""   """m    #     """m
+//       #    "#mm"  "mmm"    "mm  "mmm"
+//
+
+
+static vector<uint8_t> reference (AESEngine::AESMode mode, const vector<uint8_t>& key,
+	const vector<uint8_t>& data)
+{
+	AESEngine engine(mode, key);
+	FILE *in = fmemopen((void *)(data.empty() ? "" : (const char *)&data[0]), data.size(), "r");
+	FILE *out = tmpfile();
+	engine.encryptFile(in, out);
+	fclose(in);
+	vector<uint8_t> cipher(ftell(out));
+	rewind(out);
+	size_t got = readChunk(cipher.empty() ? NULL : &cipher[0], cipher.size(), out);
+	fclose(out);
+	cipher.resize(got);
+	return cipher;
+}
+
+
+static AESTask<bool> roundTrip (AESAsync& async, vector<uint8_t> data, vector<uint8_t> expected)
+{
+	vector<uint8_t> cipher = co_await async.encrypt(data);
+	vector<uint8_t> plain = co_await async.decrypt(cipher);
+	co_return cipher == expected && plain == data;
+}
+
+
+static AESTask<uint64_t> encryptAndClose (AESAsync& async, int in, int out)
+{
+	uint64_t n = co_await async.encryptStream(in, out);
+	shutdown(out, SHUT_WR);
+	co_return n;
+}
+
+
+int runasync ()
+{
+	cout << "Running async tests ..." << endl;
+
+	cout << "\ttesting pool ... ";
+	AESPool pool(3);
+	vector<int> hits(1000, 0);
+	[] (AESPool& pool, vector<int>& hits) -> AESTask<void> {
+		co_await pool.schedule();
+		co_await pool.each(hits.size(), [&hits] (size_t k) { hits[k]++; });
+	}(pool, hits).wait();
+	if (count(hits.begin(), hits.end(), 1) != (long)hits.size())
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting buffers ... ";
+	static const AESEngine::AESMode MODES[] = { AESEngine::AES_128_ECB, AESEngine::AES_256_CBC };
+	for (unsigned int m = 0; m < 2; ++m) {
+		vector<uint8_t> key = AESEngine::generateKey(MODES[m]);
+		AESEngine engine(MODES[m], key);
+		AESAsync async(engine, 256, pool);
+		vector<AESTask<bool>> tasks;
+		for (unsigned int t = 0; t < 200; ++t) {
+			vector<uint8_t> data(rand() % 3000);
+			for (size_t j = 0; j < data.size(); ++j)
+				data[j] = rand();
+			tasks.push_back(roundTrip(async, data, reference(MODES[m], key, data)));
+		}
+		whenAll(tasks).wait();
+		for (size_t t = 0; t < tasks.size(); ++t)
+			if (!tasks[t].result())
+				return 1;
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting streams ... ";
+	vector<uint8_t> key = AESEngine::generateKey(AESEngine::AES_128_CBC);
+	AESEngine engine(AESEngine::AES_128_CBC, key);
+	AESAsync async(engine, 4096, pool);
+	vector<uint8_t> data(300000 + rand() % 1000);
+	for (size_t j = 0; j < data.size(); ++j)
+		data[j] = rand();
+	FILE *in = tmpfile();
+	FILE *out = tmpfile();
+	if (fwrite(&data[0], 1, data.size(), in) != data.size() || fflush(in) != 0)
+		return 1;
+	rewind(in);
+	// more than a socket buffer's worth, so both ends have to wait
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) != 0)
+		return 1;
+	vector<AESTask<uint64_t>> streams;
+	streams.push_back(encryptAndClose(async, fileno(in), sockets[0]));
+	streams.push_back(async.decryptStream(sockets[1], fileno(out)));
+	whenAll(streams).wait();
+	vector<uint8_t> output(data.size() + 1);
+	rewind(out);
+	bool same = (streams[0].result() == data.size() && streams[1].result() == data.size()
+		&& readChunk(&output[0], output.size(), out) == data.size()
+		&& equal(data.begin(), data.end(), output.begin()));
+	fclose(in);
+	fclose(out);
+	close(sockets[0]);
+	close(sockets[1]);
+	if (!same)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting duplex ... ";
+	// one stream writes a socket while another reads it back through an
+	// echo, so a reader and a writer wait on the same descriptor
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) != 0)
+		return 1;
+	fcntl(sockets[1], F_SETFL, fcntl(sockets[1], F_GETFL) & ~O_NONBLOCK);
+	thread echo([&sockets] {
+		uint8_t buf[4096];
+		ssize_t n;
+		while ((n = read(sockets[1], buf, sizeof(buf))) > 0)
+			if (write(sockets[1], buf, n) != n)
+				break;
+		shutdown(sockets[1], SHUT_WR);
+	});
+	// more than both socket buffers hold, so the writer blocks while the
+	// reader is parked on the same fd
+	data.resize(4 * 1024 * 1024);
+	for (size_t j = 0; j < data.size(); ++j)
+		data[j] = rand();
+	output.resize(data.size() + 1);
+	in = tmpfile();
+	out = tmpfile();
+	if (fwrite(&data[0], 1, data.size(), in) != data.size() || fflush(in) != 0)
+		return 1;
+	rewind(in);
+	streams.clear();
+	streams.push_back(encryptAndClose(async, fileno(in), sockets[0]));
+	streams.push_back(async.decryptStream(sockets[0], fileno(out)));
+	whenAll(streams).wait();
+	echo.join();
+	rewind(out);
+	same = (streams[0].result() == data.size() && streams[1].result() == data.size()
+		&& readChunk(&output[0], output.size(), out) == data.size()
+		&& equal(data.begin(), data.end(), output.begin()));
+	fclose(in);
+	fclose(out);
+	close(sockets[0]);
+	close(sockets[1]);
+	if (!same)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting cancellation ... ";
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) != 0)
+		return 1;
+	stop_source source;
+	AESTask<uint64_t> idle = async.decryptStream(sockets[1], sockets[1], source.get_token());
+	thread stopper([&source] {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		source.request_stop();
+	});
+	bool cancelled = false;
+	try {
+		idle.wait();
+	} catch (AESCancelled&) {
+		cancelled = true;
+	}
+	stopper.join();
+	close(sockets[0]);
+	close(sockets[1]);
+	if (!cancelled)
+		return 1;
+	cout << "PASS" << endl;
+
+	return 0;
+}
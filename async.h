@@ -0,0 +1,484 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include <cstdint>
+
+#include "aes.h"
+
+using namespace std;
+
+
+int runasync ();
+
+
+// the rest needs coroutines: async.cc is built as C++20, the other
+// translation units only see the test entry point
+#if __cplusplus >= 202002L
+
+#include <coroutine>
+#include <stop_token>
+#include <optional>
+#include <atomic>
+#include <utility>
+
+
+/*
+**  Worker threads shared by every coroutine that offloads cipher work,
+**  one per core by default. co_await schedule() continues on one of them;
+**  co_await each(n, body) runs body(0) .. body(n - 1) across them and
+**  continues once all have returned, rethrowing the first exception.
+*/
+
+class AESPool
+{
+private:
+
+	vector<thread> workers;
+
+	mutex lock;
+	condition_variable wake;
+	deque<function<void ()>> jobs;
+	bool stopping;
+
+	void run ();
+
+public:
+
+	explicit AESPool (unsigned int nthreads = 0);
+	~AESPool ();
+
+	AESPool (const AESPool&) = delete;
+	AESPool& operator= (const AESPool&) = delete;
+
+	void post (function<void ()> job);
+	size_t threads ();
+
+	static AESPool& shared ();
+
+	struct Schedule
+	{
+		AESPool& pool;
+
+		bool await_ready () { return false; }
+		void await_suspend (coroutine_handle<> h) { pool.post([h] { h.resume(); }); }
+		void await_resume () {}
+	};
+
+	class Each
+	{
+	private:
+
+		AESPool& pool;
+		const size_t n;
+		function<void (size_t)> body;
+		atomic<size_t> left;
+		coroutine_handle<> waiting;
+		mutex failing;
+		exception_ptr error;
+
+		void finish (size_t k);
+
+	public:
+
+		Each (AESPool& p, size_t count, function<void (size_t)> b);
+
+		bool await_ready () { return n == 0; }
+		void await_suspend (coroutine_handle<> h);
+		void await_resume ();
+	};
+
+	Schedule schedule ();
+	Each each (size_t n, function<void (size_t)> body);
+};
+
+
+/*
+**  The coroutine type of the API: lazy, so nothing runs until it is
+**  awaited, and the awaiting coroutine resumes on whichever thread the
+**  task finishes. wait() blocks a thread that is not a coroutine until
+**  the task is done, and returns its result or rethrows its exception.
+*/
+
+template <typename T> class AESTask;
+
+struct AESPromiseBase
+{
+	coroutine_handle<> continuation;
+	exception_ptr error;
+
+	struct Final
+	{
+		bool await_ready () noexcept { return false; }
+		void await_resume () noexcept {}
+
+		template <typename P>
+		coroutine_handle<> await_suspend (coroutine_handle<P> h) noexcept
+		{
+			coroutine_handle<> next = h.promise().continuation;
+			return next ? next : noop_coroutine();
+		}
+	};
+
+	suspend_always initial_suspend () noexcept { return {}; }
+	Final final_suspend () noexcept { return {}; }
+	void unhandled_exception () { error = current_exception(); }
+};
+
+
+template <typename T>
+struct AESPromise : AESPromiseBase
+{
+	optional<T> value;
+
+	AESTask<T> get_return_object ();
+	void return_value (T v) { value.emplace(move(v)); }
+
+	T result ()
+	{
+		if (error)
+			rethrow_exception(error);
+		return move(*value);
+	}
+};
+
+
+template <>
+struct AESPromise<void> : AESPromiseBase
+{
+	AESTask<void> get_return_object ();
+	void return_void () {}
+
+	void result ()
+	{
+		if (error)
+			rethrow_exception(error);
+	}
+};
+
+
+// runs a task to completion without taking its result
+template <typename T>
+struct AESJoin
+{
+	coroutine_handle<AESPromise<T>> task;
+
+	bool await_ready () { return false; }
+	void await_resume () {}
+
+	coroutine_handle<> await_suspend (coroutine_handle<> h)
+	{
+		task.promise().continuation = h;
+		return task;
+	}
+};
+
+
+// a coroutine that starts at once and cleans up after itself
+struct AESDetached
+{
+	struct promise_type
+	{
+		AESDetached get_return_object () { return {}; }
+		suspend_never initial_suspend () noexcept { return {}; }
+		suspend_never final_suspend () noexcept { return {}; }
+		void return_void () {}
+		void unhandled_exception () { terminate(); }
+	};
+};
+
+
+template <typename T>
+class AESTask
+{
+public:
+
+	using promise_type = AESPromise<T>;
+
+private:
+
+	coroutine_handle<promise_type> handle;
+
+	template <typename U> friend class AESAll;
+
+public:
+
+	explicit AESTask (coroutine_handle<promise_type> h)
+		: handle(h)
+	{}
+
+	AESTask (AESTask&& t) noexcept
+		: handle(exchange(t.handle, nullptr))
+	{}
+
+	AESTask& operator= (AESTask&& t) noexcept
+	{
+		if (this != &t) {
+			if (handle)
+				handle.destroy();
+			handle = exchange(t.handle, nullptr);
+		}
+		return *this;
+	}
+
+	~AESTask ()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	bool await_ready () { return false; }
+	T await_resume () { return handle.promise().result(); }
+
+	coroutine_handle<> await_suspend (coroutine_handle<> h)
+	{
+		handle.promise().continuation = h;
+		return handle;
+	}
+
+	// the result of a task that has finished, say under whenAll()
+	T result () { return handle.promise().result(); }
+
+	T wait ()
+	{
+		mutex m;
+		condition_variable cv;
+		bool finished = false;
+		[] (coroutine_handle<promise_type> h, mutex& m, condition_variable& cv, bool& finished) -> AESDetached {
+			co_await AESJoin<T>{h};
+			lock_guard<mutex> hold(m);
+			finished = true;
+			cv.notify_all();
+		}(handle, m, cv, finished);
+		unique_lock<mutex> hold(m);
+		cv.wait(hold, [&finished] { return finished; });
+		return handle.promise().result();
+	}
+};
+
+
+template <typename T>
+AESTask<T> AESPromise<T>::get_return_object ()
+{
+	return AESTask<T>(coroutine_handle<AESPromise<T>>::from_promise(*this));
+}
+
+
+inline AESTask<void> AESPromise<void>::get_return_object ()
+{
+	return AESTask<void>(coroutine_handle<AESPromise<void>>::from_promise(*this));
+}
+
+
+/*
+**  Starts every task and continues once all have finished. Their
+**  results and exceptions stay with them, for result() to hand out.
+*/
+
+template <typename T>
+class AESAll
+{
+private:
+
+	vector<AESTask<T>>& tasks;
+	atomic<size_t> left;
+	coroutine_handle<> waiting;
+
+	static AESDetached finish (AESAll *all, coroutine_handle<AESPromise<T>> task)
+	{
+		co_await AESJoin<T>{task};
+		if (all->left.fetch_sub(1) == 1)
+			all->waiting.resume();
+	}
+
+public:
+
+	explicit AESAll (vector<AESTask<T>>& t)
+		: tasks(t), left(0)
+	{}
+
+	bool await_ready () { return tasks.empty(); }
+	void await_resume () {}
+
+	bool await_suspend (coroutine_handle<> h)
+	{
+		// one extra count, so the last task cannot resume h before the
+		// loop is done with this awaiter
+		waiting = h;
+		left = tasks.size() + 1;
+		for (size_t k = 0; k < tasks.size(); ++k)
+			finish(this, tasks[k].handle);
+		return left.fetch_sub(1) != 1;
+	}
+};
+
+
+template <typename T>
+AESTask<void> whenAll (vector<AESTask<T>>& tasks)
+{
+	co_await AESAll<T>(tasks);
+}
+
+
+/*
+**  One epoll thread for every stream's file descriptors: a coroutine that
+**  would block waits on readable() or writable() instead, and is resumed
+**  on the pool when the descriptor is ready, or when its stop token is
+**  triggered, in which case the wait throws AESCancelled. Regular files
+**  cannot be polled and are always ready. A descriptor has at most one
+**  reader and one writer waiting at a time, say two streams on the same
+**  socket; both share its one epoll registration. forget() removes the
+**  registration once no one waits on it, and the streams call it as they
+**  end, so a descriptor number closed and reused starts afresh.
+*/
+
+class AESReactor
+{
+private:
+
+	struct Wait {
+		coroutine_handle<> handle;
+		int fd;
+		uint32_t events;
+	};
+
+	// the waits on one descriptor, by id, 0 for none
+	struct Registration {
+		uint64_t reader;
+		uint64_t writer;
+		bool added;
+	};
+
+	AESPool& pool;
+	int epfd;
+	int wakefd;
+	thread loop;
+
+	mutex lock;
+	map<uint64_t, Wait> waits;
+	map<int, Registration> fds;
+	set<uint64_t> cancelled;
+	uint64_t nextid;
+	bool stopping;
+
+	void run ();
+	void cancel (uint64_t id);
+	void resume (uint64_t id);
+	bool arm (int fd, Registration& r);
+
+public:
+
+	explicit AESReactor (AESPool& p = AESPool::shared());
+	~AESReactor ();
+
+	AESReactor (const AESReactor&) = delete;
+	AESReactor& operator= (const AESReactor&) = delete;
+
+	static AESReactor& shared ();
+
+	class Ready
+	{
+	private:
+
+		AESReactor& reactor;
+		const int fd;
+		const uint32_t events;
+		stop_token stop;
+		uint64_t id;
+		optional<stop_callback<function<void ()>>> cancel;
+
+	public:
+
+		Ready (AESReactor& r, int f, uint32_t e, stop_token s);
+
+		bool await_ready () { return false; }
+		bool await_suspend (coroutine_handle<> h);
+		void await_resume ();
+	};
+
+	Ready readable (int fd, stop_token stop = {});
+	Ready writable (int fd, stop_token stop = {});
+	void forget (int fd);
+};
+
+
+/*
+**  Encryption and decryption as coroutines over an engine, which is only
+**  read, so any number of them may share it (and must not outlive it, or
+**  this object). Whole buffers are cut into chunks for the pool: ECB and
+**  CBC decryption spread them over the workers, CBC encryption chains
+**  them one after the other. The streams read and write file descriptors,
+**  non-blocking ones through the reactor, so thousands of them need no
+**  thread each; their output is that of encryptFile and decryptFile. A
+**  triggered stop token ends any of them with AESCancelled.
+*/
+
+class AESAsync
+{
+private:
+
+	AESEngine& engine;
+	AESPool& pool;
+	AESReactor& reactor;
+	const size_t chunk;
+
+	AESTask<void> transform (uint8_t *data, size_t len, const uint8_t *iv, bool decrypt, stop_token stop);
+	AESTask<size_t> readSome (int fd, uint8_t *buf, size_t len, stop_token stop);
+	AESTask<void> writeAll (int fd, const uint8_t *buf, size_t len, stop_token stop);
+
+public:
+
+	AESAsync (AESEngine& e, size_t c = AES_CHUNK_SIZE,
+		AESPool& p = AESPool::shared(), AESReactor& r = AESReactor::shared());
+
+	AESTask<vector<uint8_t>> encrypt (vector<uint8_t> data, vector<uint8_t> iv = {}, stop_token stop = {});
+	AESTask<vector<uint8_t>> decrypt (vector<uint8_t> data, vector<uint8_t> iv = {}, stop_token stop = {});
+
+	AESTask<uint64_t> encryptStream (int in, int out, stop_token stop = {});
+	AESTask<uint64_t> decryptStream (int in, int out, stop_token stop = {});
+};
+
+
+#endif // __cplusplus >= 202002L
+
+
+class AESCancelled : public exception
+{
+public:
+
+	virtual const char* what() const throw()
+	{
+		return "operation cancelled";
+	}
+};
+
+
+class AESAsyncException : public exception
+{
+private:
+
+	string msg;
+
+public:
+
+	AESAsyncException (const string& m)
+		: msg(m)
+	{}
+
+	virtual ~AESAsyncException () throw()
+	{}
+
+	virtual const char* what() const throw()
+	{
+		return msg.c_str();
+	}
+};
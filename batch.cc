@@ -0,0 +1,146 @@
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "batch.h"
+
+using namespace std;
+
+
+struct Lane {
+	AESRecord *record;
+	size_t off;
+	uint8_t chain[AES_BLOCK_SIZE];
+	uint8_t ciphertext[AES_BLOCK_SIZE];
+};
+
+
+static void startLane (Lane& lane, AESRecord *record)
+{
+	lane.record = record;
+	lane.off = 0;
+	if (record->iv != NULL)
+		memcpy(lane.chain, record->iv, AES_BLOCK_SIZE);
+	else
+		memset(lane.chain, 0, AES_BLOCK_SIZE);
+}
+
+
+AESBatch::AESBatch (AESEngine& e)
+	: engine(e)
+{}
+
+
+size_t AESBatch::encryptedSize (size_t len)
+{
+	return len - (len % AES_BLOCK_SIZE) + AES_BLOCK_SIZE;
+}
+
+
+void AESBatch::encrypt (AESRecord *records, size_t n)
+{
+	bool cbc = engine.isModeCBC();
+	Lane lanes[AES_BATCH_LANES];
+	uint8_t blocks[AES_BATCH_LANES * AES_BLOCK_SIZE];
+	size_t active = 0;
+	size_t next = 0;
+
+	for (;;) {
+		while (active < AES_BATCH_LANES && next < n)
+			startLane(lanes[active++], &records[next++]);
+		if (active == 0)
+			break;
+
+		for (size_t k = 0; k < active; ++k) {
+			Lane& lane = lanes[k];
+			uint8_t *block = blocks + k * AES_BLOCK_SIZE;
+			size_t left = lane.record->len - lane.off;
+			if (left >= AES_BLOCK_SIZE) {
+				memcpy(block, lane.record->in + lane.off, AES_BLOCK_SIZE);
+			} else {
+				memcpy(block, lane.record->in + lane.off, left);
+				AESEngine::pad(block, left);
+			}
+			if (cbc)
+				AESEngine::encryptCBC(block, lane.chain);
+		}
+
+		engine.cipherBlocks(blocks, active);
+
+		// walk down so a finished lane can take the last one's place
+		for (size_t k = active; k-- > 0; ) {
+			Lane& lane = lanes[k];
+			uint8_t *block = blocks + k * AES_BLOCK_SIZE;
+			memcpy(lane.record->out + lane.off, block, AES_BLOCK_SIZE);
+			memcpy(lane.chain, block, AES_BLOCK_SIZE);
+			lane.off += AES_BLOCK_SIZE;
+			if (lane.off > lane.record->len) {
+				lane.record->outlen = lane.off;
+				lane.record->valid = true;
+				lanes[k] = lanes[--active];
+			}
+		}
+	}
+	memset(blocks, 0, sizeof(blocks));
+}
+
+
+void AESBatch::decrypt (AESRecord *records, size_t n)
+{
+	bool cbc = engine.isModeCBC();
+	Lane lanes[AES_BATCH_LANES];
+	uint8_t blocks[AES_BATCH_LANES * AES_BLOCK_SIZE];
+	size_t active = 0;
+	size_t next = 0;
+
+	for (;;) {
+		while (active < AES_BATCH_LANES && next < n) {
+			AESRecord *record = &records[next++];
+			if (record->len == 0 || (record->len % AES_BLOCK_SIZE) != 0) {
+				record->outlen = 0;
+				record->valid = false;
+				continue;
+			}
+			startLane(lanes[active++], record);
+		}
+		if (active == 0)
+			break;
+
+		for (size_t k = 0; k < active; ++k) {
+			Lane& lane = lanes[k];
+			memcpy(lane.ciphertext, lane.record->in + lane.off, AES_BLOCK_SIZE);
+			memcpy(blocks + k * AES_BLOCK_SIZE, lane.ciphertext, AES_BLOCK_SIZE);
+		}
+
+		engine.invCipherBlocks(blocks, active);
+
+		for (size_t k = active; k-- > 0; ) {
+			Lane& lane = lanes[k];
+			AESRecord *record = lane.record;
+			uint8_t *block = blocks + k * AES_BLOCK_SIZE;
+			if (cbc) {
+				AESEngine::decryptCBC(block, lane.chain);
+				memcpy(lane.chain, lane.ciphertext, AES_BLOCK_SIZE);
+			}
+			if (lane.off + AES_BLOCK_SIZE < record->len) {
+				memcpy(record->out + lane.off, block, AES_BLOCK_SIZE);
+				lane.off += AES_BLOCK_SIZE;
+				continue;
+			}
+
+			// the last block: only what the padding leaves is written
+			try {
+				size_t count = AESEngine::unpad(block);
+				memcpy(record->out + lane.off, block, count);
+				record->outlen = lane.off + count;
+				record->valid = true;
+			} catch (IllegalAESPadding&) {
+				memset(record->out, 0, lane.off);
+				record->outlen = 0;
+				record->valid = false;
+			}
+			lanes[k] = lanes[--active];
+		}
+	}
+	memset(blocks, 0, sizeof(blocks));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_BATCH_LANES 8
+
+
+/*
+**  One message of a batch: len bytes at in, to out, which may be in and
+**  needs room for the padded length when encrypting. iv is only used in
+**  CBC mode, NULL meaning zeros. outlen and valid are filled in; valid is
+**  false for ciphertext that is not whole blocks or whose padding is bad.
+*/
+
+struct AESRecord
+{
+	const uint8_t *in;
+	size_t len;
+	uint8_t *out;
+	const uint8_t *iv;
+	size_t outlen;
+	bool valid;
+};
+
+
+/*
+**  Many small records under one key in one call. Up to AES_BATCH_LANES
+**  records are in flight at once, each in a lane with its own chaining
+**  value, and the next block of every lane goes through the cipher
+**  together, so short messages fill the multi-block path the way one
+**  long message does. A finished record's lane goes to the next one.
+*/
+
+class AESBatch
+{
+private:
+
+	AESEngine& engine;
+
+public:
+
+	AESBatch (AESEngine& e);
+
+	void encrypt (AESRecord *records, size_t n);
+	void decrypt (AESRecord *records, size_t n);
+
+	static size_t encryptedSize (size_t len);
+};
@@ -0,0 +1,280 @@
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "aes.h"
+#include "arena.h"
+#include "parallel.h"
+#include "compress.h"
+
+using namespace std;
+
+
+// frames are never allowed to claim more than this, however the header
+// was crafted
+#define AES_COMPRESS_MAX_CHUNK (64 * 1024 * 1024)
+#define AES_FRAME_HEADER 8
+
+
+static const uint8_t MAGIC[8] = { 0x89, 'A', 'E', 'S', '\r', '\n', 0x1a, '\n' };
+
+
+static void put32 (uint8_t *p, uint32_t n)
+{
+	p[0] = (uint8_t)(n >> 24);
+	p[1] = (uint8_t)(n >> 16);
+	p[2] = (uint8_t)(n >> 8);
+	p[3] = (uint8_t)n;
+}
+
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+AESHeader::AESHeader (uint8_t f, uint32_t c)
+	: flags(f), chunk(c)
+{
+}
+
+
+void AESHeader::write (uint8_t *out) const
+{
+	memcpy(out, MAGIC, sizeof(MAGIC));
+	out[8] = AES_HEADER_VERSION;
+	out[9] = flags;
+	out[10] = 0;
+	out[11] = 0;
+	put32(out + 12, chunk);
+}
+
+
+bool AESHeader::read (const uint8_t *in)
+{
+	// plain ciphertext starts with the magic only by a 2^-64 chance
+	if (memcmp(in, MAGIC, sizeof(MAGIC)) != 0)
+		return false;
+	// the stages do not combine: tree chunks are not compressed
+	if (in[8] != AES_HEADER_VERSION || (in[9] != AES_HEADER_ZLIB && in[9] != AES_HEADER_TREE))
+		throw CorruptAESStream("unsupported stream header");
+	flags = in[9];
+	chunk = get32(in + 12);
+	if (chunk == 0 || chunk > AES_COMPRESS_MAX_CHUNK)
+		throw CorruptAESStream("unsupported stream header");
+	return true;
+}
+
+
+//
+//    mmm    mmm   mmmmm  mmmm    m mm   mmm    mmm    mmm
+//   #"  "  #" "#  # # #  #" "#   #"  " #"  #  #   "  #   "
+//   #      #   #  # # #  #   #   #     #""""   """m   """m
+//   "#mm"  "#m#"  # # #  ##m#"   #     "#mm"  "mmm"  "mmm"
+//                        #
+//
+
+
+AESCompressor::AESCompressor (unsigned int n, size_t c, int l)
+	: nthreads(n == 0 ? AESParallel::cpus().size() : n), chunk(c), level(l)
+{
+}
+
+
+void AESCompressor::encryptFile (AESEngine& engine, FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	uint8_t head[AES_HEADER_SIZE];
+	AESHeader(AES_HEADER_ZLIB, chunk).write(head);
+	fwrite(head, 1, AES_HEADER_SIZE, outfile);
+
+	const size_t batch = nthreads * chunk;
+	const size_t bound = AES_FRAME_HEADER + compressBound(chunk);
+	AESBuffer inbuffer(batch);
+	AESBuffer framebuffer(nthreads * bound);
+	AESBuffer outbuffer(bound + AES_BLOCK_SIZE);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *frames = framebuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+	vector<size_t> sizes(nthreads);
+
+	AESStream stream(engine, AESStream::ENCRYPT);
+	size_t count = 0;
+	do {
+		count = readChunk(inbuf, batch, infile);
+		if (mac != NULL)
+			mac->cmacUpdate(inbuf, count);
+
+		size_t n = (count + chunk - 1) / chunk;
+		atomic<bool> failed(false);
+		parallelFor(n, nthreads, [&](size_t k) {
+			size_t len = min(chunk, count - k * chunk);
+			uint8_t *frame = frames + k * bound;
+			uLongf clen = bound - AES_FRAME_HEADER;
+			if (compress2(frame + AES_FRAME_HEADER, &clen, inbuf + k * chunk, len, level) != Z_OK)
+				failed = true;
+			put32(frame, len);
+			put32(frame + 4, clen);
+			sizes[k] = AES_FRAME_HEADER + clen;
+		});
+		if (failed)
+			throw CorruptAESStream("compression failed");
+
+		for (size_t k = 0; k < n; ++k)
+			fwrite(outbuf, 1, stream.update(frames + k * bound, sizes[k], outbuf), outfile);
+	} while (count == batch);
+	fwrite(outbuf, 1, stream.final(outbuf), outfile);
+}
+
+
+void AESCompressor::decryptFile (AESEngine& engine, const AESHeader& header,
+	FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	// the header is not authenticated, so it may not size the buffers
+	// beyond what this compressor would write itself
+	if (header.chunk > chunk)
+		throw CorruptAESStream("unsupported stream header");
+	const size_t limit = header.chunk;
+	const size_t bound = AES_FRAME_HEADER + compressBound(limit);
+	AESBuffer inbuffer(AES_CHUNK_SIZE);
+	AESBuffer plainbuffer(AES_CHUNK_SIZE + AES_BLOCK_SIZE);
+	AESBuffer outbuffer(nthreads * limit);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *plainbuf = plainbuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+
+	// decrypted frames: those before start are inflated, those at offsets
+	// are complete and queued, and scan is where the next one begins
+	vector<uint8_t> pending;
+	size_t start = 0;
+	size_t scan = 0;
+	vector<size_t> offsets;
+	vector<size_t> lengths(nthreads);
+
+	auto inflateBatch = [&] {
+		atomic<bool> failed(false);
+		parallelFor(offsets.size(), nthreads, [&](size_t k) {
+			const uint8_t *frame = &pending[offsets[k]];
+			uLongf len = get32(frame);
+			if (uncompress(outbuf + k * limit, &len, frame + AES_FRAME_HEADER, get32(frame + 4)) != Z_OK
+					|| len != get32(frame))
+				failed = true;
+			lengths[k] = len;
+		});
+		if (failed)
+			throw CorruptAESStream();
+		for (size_t k = 0; k < offsets.size(); ++k) {
+			if (mac != NULL)
+				mac->cmacUpdate(outbuf + k * limit, lengths[k]);
+			fwrite(outbuf + k * limit, 1, lengths[k], outfile);
+		}
+	};
+
+	// queues every complete frame, inflating whenever a batch is full
+	// (or, at the end, whatever is queued)
+	auto consume = [&] (bool last) {
+		for (;;) {
+			bool complete = false;
+			if (pending.size() - scan >= AES_FRAME_HEADER) {
+				size_t len = get32(&pending[scan]);
+				size_t clen = get32(&pending[scan + 4]);
+				if (len > limit || AES_FRAME_HEADER + clen > bound)
+					throw CorruptAESStream();
+				complete = (pending.size() - scan >= AES_FRAME_HEADER + clen);
+				if (complete) {
+					offsets.push_back(scan);
+					scan += AES_FRAME_HEADER + clen;
+				}
+			}
+			if (offsets.size() == nthreads || (!complete && last && !offsets.empty())) {
+				inflateBatch();
+				offsets.clear();
+				start = scan;
+			}
+			if (!complete)
+				break;
+		}
+
+		// what is done with is dropped once it is no less than what is
+		// kept, so each byte is moved at most once on average
+		if (start > 0 && start >= pending.size() - start) {
+			fill(pending.begin(), pending.begin() + start, 0);
+			pending.erase(pending.begin(), pending.begin() + start);
+			for (size_t k = 0; k < offsets.size(); ++k)
+				offsets[k] -= start;
+			scan -= start;
+			start = 0;
+		}
+	};
+
+	AESStream stream(engine, AESStream::DECRYPT);
+	size_t count = 0;
+	while ((count = readChunk(inbuf, AES_CHUNK_SIZE, infile)) > 0) {
+		size_t nbytes = stream.update(inbuf, count, plainbuf);
+		pending.insert(pending.end(), plainbuf, plainbuf + nbytes);
+		consume(false);
+	}
+	size_t nbytes = stream.final(plainbuf);
+	pending.insert(pending.end(), plainbuf, plainbuf + nbytes);
+	consume(true);
+
+	bool trailing = (scan != pending.size());
+	fill(pending.begin(), pending.end(), 0);
+	if (trailing)
+		throw CorruptAESStream();
+}
+
+
+/*
+**  Peeking
+*/
+
+struct Unread {
+	vector<uint8_t> data;
+	size_t pos;
+	FILE *rest;
+};
+
+
+static ssize_t unreadRead (void *cookie, char *buf, size_t size)
+{
+	Unread *u = (Unread *)cookie;
+	if (u->pos < u->data.size()) {
+		size_t n = min(size, u->data.size() - u->pos);
+		memcpy(buf, &u->data[u->pos], n);
+		u->pos += n;
+		return n;
+	}
+	return fread(buf, 1, size, u->rest);
+}
+
+
+static int unreadClose (void *cookie)
+{
+	delete (Unread *)cookie;
+	return 0;
+}
+
+
+FILE *unreadStream (const uint8_t *data, size_t len, FILE *rest)
+{
+	Unread *u = new Unread;
+	u->data.assign(data, data + len);
+	u->pos = 0;
+	u->rest = rest;
+
+	cookie_io_functions_t io;
+	memset(&io, 0, sizeof(io));
+	io.read = unreadRead;
+	io.close = unreadClose;
+	FILE *f = fopencookie(u, "r", io);
+	if (f == NULL)
+		delete u;
+	return f;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <exception>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_HEADER_SIZE 16
+#define AES_HEADER_VERSION 1
+#define AES_HEADER_ZLIB 0x01
+#define AES_HEADER_TREE 0x02
+
+#define AES_COMPRESS_CHUNK (256 * 1024)
+
+
+/*
+**  The cleartext header in front of ciphertext that went through an
+**  extra pipeline stage; plain ciphertext carries none. It is
+**
+**      magic[8] version flags reserved[2] chunk[4]
+**
+**  with chunk big-endian: the most bytes one frame expands to, or for the
+**  tree format the plaintext bytes in each chunk. The magic follows PNG's
+**  (high bit, CR LF, ^Z, LF) so mangled transfers show.
+*/
+
+struct AESHeader
+{
+	uint8_t flags;
+	uint32_t chunk;
+
+	AESHeader (uint8_t f = 0, uint32_t c = AES_COMPRESS_CHUNK);
+
+	void write (uint8_t *out) const;
+	bool read (const uint8_t *in);
+};
+
+
+/*
+**  Compress-then-encrypt. The input is cut into chunks that are deflated
+**  independently, a batch of them at a time across the worker threads,
+**  and each becomes a frame
+**
+**      length[4] compressed[4] data[compressed]
+**
+**  (lengths big-endian) in the plaintext fed to the cipher. Decryption
+**  parses the frames back out and inflates them in parallel the same way;
+**  it refuses a header whose chunk is larger than this compressor's.
+**  The MAC, if any, covers the uncompressed data, so tags do not depend
+**  on whether the stage was used.
+*/
+
+class AESCompressor
+{
+private:
+
+	const unsigned int nthreads;
+	const size_t chunk;
+	const int level;
+
+public:
+
+	AESCompressor (unsigned int n = 1, size_t c = AES_COMPRESS_CHUNK, int l = -1);
+
+	void encryptFile (AESEngine& engine, FILE *infile, FILE *outfile, AESEngine *mac = NULL);
+	void decryptFile (AESEngine& engine, const AESHeader& header,
+		FILE *infile, FILE *outfile, AESEngine *mac = NULL);
+};
+
+
+/*
+**  A stream that yields len bytes of data, then the rest of another. It
+**  lets the header be peeked at from a pipe. Closing it leaves rest open.
+*/
+
+FILE *unreadStream (const uint8_t *data, size_t len, FILE *rest);
+
+
+class CorruptAESStream : public exception
+{
+private:
+
+	const char *msg;
+
+public:
+
+	CorruptAESStream (const char *m = "corrupt compressed stream")
+		: msg(m)
+	{}
+
+	virtual const char* what() const throw()
+	{
+		return msg;
+	}
+};
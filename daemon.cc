@@ -0,0 +1,761 @@
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "aes.h"
+#include "parallel.h"
+#include "daemon.h"
+
+using namespace std;
+
+
+#define AES_DAEMON_EVENTS 64
+#define AES_DAEMON_RECV (64 * 1024)
+#define AES_DAEMON_MAX_FDS 4
+
+
+static const uint8_t REQUEST_MAGIC[4] = { 'A', 'E', 'S', 'D' };
+
+
+static void put32 (uint8_t *p, uint32_t n)
+{
+	p[0] = (uint8_t)(n >> 24);
+	p[1] = (uint8_t)(n >> 16);
+	p[2] = (uint8_t)(n >> 8);
+	p[3] = (uint8_t)n;
+}
+
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static void put64 (uint8_t *p, uint64_t n)
+{
+	put32(p, (uint32_t)(n >> 32));
+	put32(p + 4, (uint32_t)n);
+}
+
+
+static uint64_t get64 (const uint8_t *p)
+{
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+
+static AESDaemonException systemError (const char *what)
+{
+	return AESDaemonException(string(what) + ": " + strerror(errno));
+}
+
+
+/*
+**  ECB/CBC with PKCS#7 padding over a buffer in place; encryption needs
+**  room for one more block after the data.
+*/
+
+static size_t encryptInPlace (AESEngine& engine, uint8_t *data, size_t len)
+{
+	size_t whole = len - (len % AES_BLOCK_SIZE);
+	for (size_t off = 0; off < whole; off += AES_BLOCK_SIZE)
+		engine.encryptBlock(data + off);
+	AESEngine::pad(data + whole, len - whole);
+	engine.encryptBlock(data + whole);
+	return whole + AES_BLOCK_SIZE;
+}
+
+
+static size_t decryptInPlace (AESEngine& engine, uint8_t *data, size_t len)
+{
+	if ((len % AES_BLOCK_SIZE) != 0)
+		throw IllegalAESBlockSize();
+	if (len == 0)
+		return 0;
+	for (size_t off = 0; off < len; off += AES_BLOCK_SIZE)
+		engine.decryptBlock(data + off);
+	return len - AES_BLOCK_SIZE + AESEngine::unpad(data + len - AES_BLOCK_SIZE);
+}
+
+
+//       #
+//    mmm#   mmm    mmm   mmmmm   mmm   m mm
+//   #" "#  "   #  #"  #  # # #  #" "#  #"  #
+//   #   #  m"""#  #""""  # # #  #   #  #   #
+//   "#m##  "mm"#  "#mm"  # # #  "#m#"  #   #
+//
+
+
+AESDaemon::AESDaemon (const string& socketpath, const string& keydirectory, unsigned int nthreads,
+	AESEngine::Backend b)
+	: path(socketpath), backend(b), listener(-1), epoll(-1), completions(-1), signals(-1),
+	  stopping(false)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw AESDaemonException("invalid socket path: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	char *real = realpath(keydirectory.c_str(), NULL);
+	if (real == NULL)
+		throw systemError(keydirectory.c_str());
+	keydir = real;
+	free(real);
+
+	// a socket left behind by a daemon that died is replaced, anything
+	// else at that path is left alone
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		throw systemError("socket");
+	mode_t mask = umask(0177);
+	int bound = bind(listener, (sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+		AESDaemonException e = systemError(path.c_str());
+		::close(listener);
+		throw e;
+	}
+
+	// the workers inherit the mask, so termination is only ever seen
+	// by the event loop
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	completions = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	signals = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	int fds[] = { listener, completions, signals, epoll };
+	bool ok = (epoll >= 0);
+	for (unsigned int k = 0; ok && k < 3; ++k) {
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[k];
+		ok = (fds[k] >= 0 && epoll_ctl(epoll, EPOLL_CTL_ADD, fds[k], &ev) == 0);
+	}
+	if (!ok) {
+		AESDaemonException e = systemError("epoll");
+		for (unsigned int k = 0; k < sizeof(fds) / sizeof(fds[0]); ++k) {
+			if (fds[k] >= 0)
+				::close(fds[k]);
+		}
+		unlink(path.c_str());
+		throw e;
+	}
+
+	if (nthreads == 0)
+		nthreads = AESParallel::cpus().size();
+	for (unsigned int k = 0; k < nthreads; ++k)
+		workers.push_back(thread(&AESDaemon::work, this));
+}
+
+
+AESDaemon::~AESDaemon ()
+{
+	{
+		lock_guard<mutex> lk(queuelock);
+		stopping = true;
+	}
+	queued.notify_all();
+	for (unsigned int k = 0; k < workers.size(); ++k)
+		workers[k].join();
+	workers.clear();
+
+	for (map<int, Connection *>::iterator i = connections.begin(); i != connections.end(); ++i) {
+		Connection *c = i->second;
+		::close(c->fd);
+		for (unsigned int k = 0; k < c->fds.size(); ++k)
+			::close(c->fds[k]);
+		fill(c->in.begin(), c->in.end(), 0);
+		fill(c->out.begin(), c->out.end(), 0);
+		delete c;
+	}
+	connections.clear();
+	for (map<string, Key>::iterator i = keys.begin(); i != keys.end(); ++i)
+		delete i->second.engine;
+	keys.clear();
+
+	int fds[] = { signals, completions, epoll, listener };
+	for (unsigned int k = 0; k < sizeof(fds) / sizeof(fds[0]); ++k) {
+		if (fds[k] >= 0)
+			::close(fds[k]);
+	}
+	signals = completions = epoll = -1;
+	if (listener >= 0)
+		unlink(path.c_str());
+	listener = -1;
+}
+
+
+void AESDaemon::run ()
+{
+	epoll_event events[AES_DAEMON_EVENTS];
+	for (;;) {
+		int n = epoll_wait(epoll, events, AES_DAEMON_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw systemError("epoll_wait");
+		}
+
+		for (int k = 0; k < n; ++k) {
+			int fd = events[k].data.fd;
+			if (fd == listener) {
+				accept();
+			} else if (fd == signals) {
+				return;
+			} else if (fd == completions) {
+				uint64_t count;
+				while (read(completions, &count, sizeof(count)) > 0)
+					;
+				vector<Connection *> done;
+				{
+					lock_guard<mutex> lk(queuelock);
+					done.swap(finished);
+				}
+				for (unsigned int d = 0; d < done.size(); ++d) {
+					done[d]->busy = false;
+					if (done[d]->closing)
+						close(done[d]);
+					else
+						send(done[d]);
+				}
+			} else {
+				map<int, Connection *>::iterator i = connections.find(fd);
+				if (i == connections.end())
+					continue;
+				Connection *c = i->second;
+				if (c->busy) {
+					// only a hangup arrives while a request is in flight
+					close(c);
+				} else if (events[k].events & EPOLLOUT) {
+					send(c);
+				} else {
+					receive(c);
+				}
+			}
+		}
+	}
+}
+
+
+void AESDaemon::accept ()
+{
+	int fd;
+	while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		Connection *c = new Connection();
+		c->fd = fd;
+		c->sent = 0;
+		c->busy = false;
+		c->closing = false;
+		connections[fd] = c;
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+
+void AESDaemon::watch (Connection *c, uint32_t events)
+{
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = c->fd;
+	epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+void AESDaemon::close (Connection *c)
+{
+	// with a request in flight the worker still holds the connection;
+	// it goes once the completion comes back
+	epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	if (c->busy) {
+		c->closing = true;
+		return;
+	}
+	connections.erase(c->fd);
+	::close(c->fd);
+	for (unsigned int k = 0; k < c->fds.size(); ++k)
+		::close(c->fds[k]);
+	fill(c->in.begin(), c->in.end(), 0);
+	fill(c->out.begin(), c->out.end(), 0);
+	delete c;
+}
+
+
+void AESDaemon::receive (Connection *c)
+{
+	uint8_t buf[AES_DAEMON_RECV];
+	char control[CMSG_SPACE(AES_DAEMON_MAX_FDS * sizeof(int))];
+	for (;;) {
+		iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); n >= 0 && cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+				const int *fds = (const int *)CMSG_DATA(cm);
+				size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				c->fds.insert(c->fds.end(), fds, fds + count);
+			}
+		}
+		if (n <= 0 || c->fds.size() > AES_DAEMON_MAX_FDS) {
+			close(c);
+			return;
+		}
+		c->in.insert(c->in.end(), buf, buf + n);
+		memset(buf, 0, n);
+		if (parse(c))
+			return;
+	}
+}
+
+
+/*
+**  Queues the request at the front of the input once it is complete.
+**  Returns true when it did, or when the connection had to be dropped.
+*/
+
+bool AESDaemon::parse (Connection *c)
+{
+	if (c->in.size() < AES_DAEMON_REQUEST_SIZE)
+		return false;
+
+	const uint8_t *h = &c->in[0];
+	uint8_t op = h[4];
+	uint8_t mode = h[5];
+	uint8_t flags = h[6];
+	size_t pathlen = get32(h + 8);
+	uint64_t length = get64(h + 16);
+	bool memfd = (flags & AES_DAEMON_MEMFD) != 0;
+	if (memcmp(h, REQUEST_MAGIC, sizeof(REQUEST_MAGIC)) != 0
+			|| (op != AES_DAEMON_ENCRYPT && op != AES_DAEMON_DECRYPT)
+			|| mode > AESEngine::AES_256_CBC || (flags & ~AES_DAEMON_MEMFD) != 0
+			|| pathlen > AES_DAEMON_MAX_PATH || length > AES_DAEMON_MAX_PAYLOAD
+			|| (!memfd && length >= AES_DAEMON_MEMFD_THRESHOLD)) {
+		close(c);
+		return true;
+	}
+
+	size_t need = AES_DAEMON_REQUEST_SIZE + pathlen + (memfd ? 0 : length);
+	if (c->in.size() < need)
+		return false;
+	if (memfd && c->fds.empty()) {
+		close(c);
+		return true;
+	}
+
+	Job *job = new Job();
+	job->conn = c;
+	job->op = op;
+	job->mode = (AESEngine::AESMode)mode;
+	job->path.assign((const char *)h + AES_DAEMON_REQUEST_SIZE, pathlen);
+	memcpy(job->iv, h + 24, AES_BLOCK_SIZE);
+	job->length = length;
+	job->memfd = -1;
+	if (memfd) {
+		job->memfd = c->fds.front();
+		c->fds.erase(c->fds.begin());
+	} else {
+		job->payload.assign(c->in.begin() + AES_DAEMON_REQUEST_SIZE + pathlen, c->in.begin() + need);
+	}
+	fill(c->in.begin(), c->in.begin() + need, 0);
+	c->in.erase(c->in.begin(), c->in.begin() + need);
+
+	c->busy = true;
+	watch(c, 0);
+	{
+		lock_guard<mutex> lk(queuelock);
+		jobs.push_back(job);
+	}
+	queued.notify_one();
+	return true;
+}
+
+
+void AESDaemon::send (Connection *c)
+{
+	while (c->sent < c->out.size()) {
+		ssize_t n = ::send(c->fd, &c->out[c->sent], c->out.size() - c->sent, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			watch(c, EPOLLOUT);
+			return;
+		}
+		if (n < 0) {
+			close(c);
+			return;
+		}
+		c->sent += n;
+	}
+	fill(c->out.begin(), c->out.end(), 0);
+	c->out.clear();
+	c->sent = 0;
+
+	// a pipelined request may already be waiting
+	if (!parse(c))
+		watch(c, EPOLLIN);
+}
+
+
+/*
+**  Workers
+*/
+
+void AESDaemon::work ()
+{
+	for (;;) {
+		Job *job;
+		{
+			unique_lock<mutex> lk(queuelock);
+			queued.wait(lk, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		process(job);
+		if (job->memfd >= 0)
+			::close(job->memfd);
+		fill(job->payload.begin(), job->payload.end(), 0);
+		Connection *c = job->conn;
+		delete job;
+
+		{
+			lock_guard<mutex> lk(queuelock);
+			finished.push_back(c);
+		}
+		uint64_t one = 1;
+		ssize_t n = write(completions, &one, sizeof(one));
+		(void)n;
+	}
+}
+
+
+/*
+**  Returns a copy made under the lock, since another worker may replace
+**  the cached engine as soon as it is released.
+*/
+
+AESEngine AESDaemon::lookup (AESEngine::AESMode mode, const string& keyfile)
+{
+	if (keyfile.empty())
+		return AESEngine(mode, vector<uint8_t>(AESEngine::keySize(mode), 0), backend);
+
+	char *real = realpath(keyfile.c_str(), NULL);
+	if (real == NULL)
+		throw systemError(keyfile.c_str());
+	string resolved = real;
+	free(real);
+	string prefix = (keydir == "/") ? keydir : keydir + "/";
+	if (resolved.compare(0, prefix.size(), prefix) != 0)
+		throw AESDaemonException("key file outside " + keydir + ": " + keyfile);
+	struct stat st;
+	if (stat(resolved.c_str(), &st) != 0)
+		throw systemError(keyfile.c_str());
+
+	lock_guard<mutex> lk(keylock);
+	string name = to_string((int)mode) + ":" + resolved;
+	map<string, Key>::iterator i = keys.find(name);
+	if (i != keys.end()) {
+		const Key& k = i->second;
+		if (k.dev == st.st_dev && k.ino == st.st_ino && k.size == st.st_size
+				&& k.mtime.tv_sec == st.st_mtim.tv_sec && k.mtime.tv_nsec == st.st_mtim.tv_nsec)
+			return *k.engine;
+		delete k.engine;
+		keys.erase(i);
+	}
+
+	vector<uint8_t> key = AESEngine::loadKey(resolved.c_str(), mode);
+	Key k;
+	k.engine = new AESEngine(mode, key, backend);
+	fill(key.begin(), key.end(), 0);
+	k.dev = st.st_dev;
+	k.ino = st.st_ino;
+	k.size = st.st_size;
+	k.mtime = st.st_mtim;
+	keys[name] = k;
+	return *k.engine;
+}
+
+
+void AESDaemon::process (Job *job)
+{
+	uint8_t reply[AES_DAEMON_REPLY_SIZE];
+	memset(reply, 0, sizeof(reply));
+	vector<uint8_t>& out = job->conn->out;
+
+	uint8_t *map = (uint8_t *)MAP_FAILED;
+	size_t mapped = 0;
+	try {
+		AESEngine engine(lookup(job->mode, job->path));
+		engine.setIV(job->iv);
+
+		size_t len = job->length;
+		uint8_t *data;
+		size_t room = (job->op == AES_DAEMON_ENCRYPT) ? len + AES_BLOCK_SIZE : len;
+		if (job->memfd >= 0 && room > 0) {
+			// the client keeps the file: were it free to shrink it, a
+			// worker touching the mapping would take SIGBUS
+			int seals = fcntl(job->memfd, F_GET_SEALS);
+			if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)
+				throw AESDaemonException("payload file is not sealed against shrinking");
+			struct stat st;
+			if (fstat(job->memfd, &st) != 0 || (uint64_t)st.st_size < len)
+				throw AESDaemonException("payload file shorter than the request");
+			if ((size_t)st.st_size < room && ftruncate(job->memfd, room) != 0)
+				throw systemError("ftruncate");
+			mapped = room;
+			map = (uint8_t *)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, job->memfd, 0);
+			if (map == MAP_FAILED)
+				throw systemError("mmap");
+			data = map;
+		} else if (job->memfd >= 0) {
+			data = NULL;
+		} else {
+			job->payload.resize(room);
+			data = job->payload.empty() ? NULL : &job->payload[0];
+		}
+
+		size_t nbytes = (job->op == AES_DAEMON_ENCRYPT)
+			? encryptInPlace(engine, data, len)
+			: decryptInPlace(engine, data, len);
+
+		put64(reply + 8, nbytes);
+		out.assign(reply, reply + AES_DAEMON_REPLY_SIZE);
+		if (job->memfd >= 0) {
+			if (map != MAP_FAILED)
+				munmap(map, mapped);
+			map = (uint8_t *)MAP_FAILED;
+		} else {
+			out.insert(out.end(), data, data + nbytes);
+		}
+	} catch (exception& e) {
+		if (map != MAP_FAILED)
+			munmap(map, mapped);
+		string msg = e.what();
+		put32(reply, 1);
+		put64(reply + 8, msg.size());
+		fill(out.begin(), out.end(), 0);
+		out.assign(reply, reply + AES_DAEMON_REPLY_SIZE);
+		out.insert(out.end(), msg.begin(), msg.end());
+	}
+}
+
+
+//          ""#      "
+//    mmm     #    mmm     mmm   m mm   mmm#mm
+//   #"  "    #      #    #"  #  #"  #    #
+//   #        #      #    #""""  #   #    #
+//   "#mm"    "mm  mm#mm  "#mm"  #   #    "mm
+//
+
+
+static void sendAll (int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw systemError("send");
+		data += n;
+		len -= n;
+	}
+}
+
+
+static void recvAll (int fd, uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(fd, data, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw systemError("recv");
+		if (n == 0)
+			throw AESDaemonException("daemon closed the connection");
+		data += n;
+		len -= n;
+	}
+}
+
+
+AESClient::AESClient (const string& socketpath)
+	: fd(-1)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketpath.empty() || socketpath.size() >= sizeof(addr.sun_path))
+		throw AESDaemonException("invalid socket path: " + socketpath);
+	strcpy(addr.sun_path, socketpath.c_str());
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw systemError("socket");
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		AESDaemonException e = systemError(socketpath.c_str());
+		::close(fd);
+		throw e;
+	}
+}
+
+
+AESClient::~AESClient ()
+{
+	::close(fd);
+}
+
+
+vector<uint8_t> AESClient::request (uint8_t op, AESEngine::AESMode mode, const string& keyfile,
+	const uint8_t *iv, const vector<uint8_t>& payload)
+{
+	bool usememfd = payload.size() >= AES_DAEMON_MEMFD_THRESHOLD;
+	int memfd = -1;
+	if (usememfd) {
+		memfd = memfd_create("aes-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (memfd < 0)
+			throw systemError("memfd_create");
+		size_t off = 0;
+		while (off < payload.size()) {
+			ssize_t n = write(memfd, &payload[off], payload.size() - off);
+			if (n <= 0) {
+				AESDaemonException e = systemError("write");
+				::close(memfd);
+				throw e;
+			}
+			off += n;
+		}
+		if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+			AESDaemonException e = systemError("F_ADD_SEALS");
+			::close(memfd);
+			throw e;
+		}
+	}
+
+	uint8_t header[AES_DAEMON_REQUEST_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, REQUEST_MAGIC, sizeof(REQUEST_MAGIC));
+	header[4] = op;
+	header[5] = (uint8_t)mode;
+	header[6] = usememfd ? AES_DAEMON_MEMFD : 0;
+	put32(header + 8, keyfile.size());
+	put64(header + 16, payload.size());
+	if (iv != NULL)
+		memcpy(header + 24, iv, AES_BLOCK_SIZE);
+
+	vector<uint8_t> result;
+	try {
+		iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = (void *)keyfile.data();
+		iov[1].iov_len = keyfile.size();
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		char control[CMSG_SPACE(sizeof(int))];
+		if (usememfd) {
+			memset(control, 0, sizeof(control));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+		}
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0)
+			throw systemError("sendmsg");
+		// the descriptor went with the first byte; the rest is plain data
+		if ((size_t)n < sizeof(header)) {
+			sendAll(fd, header + n, sizeof(header) - n);
+			sendAll(fd, (const uint8_t *)keyfile.data(), keyfile.size());
+		} else {
+			n -= sizeof(header);
+			sendAll(fd, (const uint8_t *)keyfile.data() + n, keyfile.size() - n);
+		}
+		if (!usememfd && !payload.empty())
+			sendAll(fd, &payload[0], payload.size());
+
+		uint8_t reply[AES_DAEMON_REPLY_SIZE];
+		recvAll(fd, reply, sizeof(reply));
+		uint32_t status = get32(reply);
+		uint64_t length = get64(reply + 8);
+		if (status != 0) {
+			string msg(min(length, (uint64_t)AES_DAEMON_MAX_PATH), '\0');
+			if (!msg.empty())
+				recvAll(fd, (uint8_t *)&msg[0], msg.size());
+			throw AESDaemonException(msg);
+		}
+
+		result.resize(length);
+		if (usememfd) {
+			size_t off = 0;
+			while (off < result.size()) {
+				ssize_t r = pread(memfd, &result[off], result.size() - off, off);
+				if (r <= 0)
+					throw systemError("pread");
+				off += r;
+			}
+		} else if (length > 0) {
+			recvAll(fd, &result[0], length);
+		}
+	} catch (...) {
+		if (memfd >= 0)
+			::close(memfd);
+		throw;
+	}
+	if (memfd >= 0)
+		::close(memfd);
+	return result;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <cstdint>
+#include <ctime>
+
+#include <sys/types.h>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_DAEMON_REQUEST_SIZE 40
+#define AES_DAEMON_REPLY_SIZE 16
+#define AES_DAEMON_ENCRYPT 1
+#define AES_DAEMON_DECRYPT 2
+#define AES_DAEMON_MEMFD 0x01
+
+// payloads at least this large travel in a memfd rather than the socket,
+// and the daemon refuses them inline
+#define AES_DAEMON_MEMFD_THRESHOLD (256 * 1024)
+#define AES_DAEMON_MAX_PAYLOAD ((uint64_t)1 << 32)
+#define AES_DAEMON_MAX_PATH 4096
+
+
+/*
+**  A long-running encryption service on a Unix domain socket.
+**
+**  Requests are
+**
+**      magic[4] op mode flags reserved pathlen[4] reserved[4] length[8] iv[16]
+**
+**  followed by pathlen bytes naming the key file (empty for the all-zero
+**  key, as on the command line) and, unless flags has AES_DAEMON_MEMFD,
+**  length bytes of payload, less than AES_DAEMON_MEMFD_THRESHOLD. With AES_DAEMON_MEMFD the payload is instead
+**  in a memfd passed alongside the request (SCM_RIGHTS), sealed with
+**  F_SEAL_SHRINK; it is processed in place and the file grown for padding
+**  as needed, never shrunk. Replies are
+**
+**      status[4] reserved[4] length[8]
+**
+**  then length bytes: the output when inline, or an error message when
+**  status is not zero. From a memfd, the output is its first length
+**  bytes. Integers are big-endian.
+**
+**  One thread runs an epoll loop over the listening socket, the
+**  connections and an eventfd the workers signal completions on; a
+**  connection has at most one request in flight, so replies keep order.
+**  Key files must resolve to a path under the key directory. They are
+**  read with loadKey and expanded once, then each request works on a
+**  copy of the cached engine. A key file that is replaced or rewritten
+**  (another inode, size or mtime) is read again.
+*/
+
+class AESDaemon
+{
+private:
+
+	struct Connection {
+		int fd;
+		vector<uint8_t> in;
+		vector<int> fds;
+		vector<uint8_t> out;
+		size_t sent;
+		bool busy;
+		bool closing;
+	};
+
+	struct Key {
+		AESEngine *engine;
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		struct timespec mtime;
+	};
+
+	struct Job {
+		Connection *conn;
+		uint8_t op;
+		AESEngine::AESMode mode;
+		string path;
+		uint8_t iv[AES_BLOCK_SIZE];
+		uint64_t length;
+		int memfd;
+		vector<uint8_t> payload;
+	};
+
+	const string path;
+	string keydir;
+	const AESEngine::Backend backend;
+
+	int listener;
+	int epoll;
+	int completions;
+	int signals;
+
+	map<int, Connection *> connections;
+
+	mutex keylock;
+	map<string, Key> keys;
+
+	mutex queuelock;
+	condition_variable queued;
+	deque<Job *> jobs;
+	vector<Connection *> finished;
+	bool stopping;
+	vector<thread> workers;
+
+	void accept ();
+	void receive (Connection *c);
+	bool parse (Connection *c);
+	void send (Connection *c);
+	void close (Connection *c);
+	void watch (Connection *c, uint32_t events);
+
+	void work ();
+	void process (Job *job);
+	AESEngine lookup (AESEngine::AESMode mode, const string& keyfile);
+
+public:
+
+	AESDaemon (const string& socketpath, const string& keydirectory, unsigned int nthreads = 0,
+		AESEngine::Backend b = AESEngine::AES_BACKEND_AUTO);
+	~AESDaemon ();
+
+	void run ();
+};
+
+
+/*
+**  The other end: one connection, one request at a time.
+*/
+
+class AESClient
+{
+private:
+
+	int fd;
+
+public:
+
+	explicit AESClient (const string& socketpath);
+	~AESClient ();
+
+	vector<uint8_t> request (uint8_t op, AESEngine::AESMode mode, const string& keyfile,
+		const uint8_t *iv, const vector<uint8_t>& payload);
+};
+
+
+class AESDaemonException : public exception
+{
+private:
+
+	string msg;
+
+public:
+
+	AESDaemonException (const string& m)
+		: msg(m)
+	{}
+
+	virtual ~AESDaemonException () throw()
+	{}
+
+	virtual const char* what() const throw()
+	{
+		return msg.c_str();
+	}
+};
@@ -0,0 +1,178 @@
+#include <string>
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "direct.h"
+
+using namespace std;
+
+
+AESDirectFile::AESDirectFile (int f, bool w)
+	: fd(f),
+	  writing(w),
+	  flags(0),
+	  regular(false),
+	  direct(false),
+	  offset(0),
+	  size(-1),
+	  pending(0)
+{
+	struct stat st;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fstat(fd, &st) != 0)
+		throw AESDirectException(string("unable to inspect descriptor: ") + strerror(errno));
+	regular = S_ISREG(st.st_mode);
+	if (!regular)
+		return;
+
+	// the job takes over where the descriptor is, as read and write would
+	offset = lseek(fd, 0, (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+	if (offset < 0)
+		throw AESDirectException(string("unable to inspect descriptor: ") + strerror(errno));
+	pending = offset;
+	size = (st.st_size > offset) ? st.st_size - offset : 0;
+
+	// from an unaligned offset not one transfer could go through O_DIRECT
+	if ((offset % AES_DIRECT_ALIGN) == 0)
+		direct = (fcntl(fd, F_SETFL, flags | O_DIRECT) == 0);
+	if (!direct && !writing)
+		posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+
+AESDirectFile::~AESDirectFile ()
+{
+	finish();
+	if (regular)
+		fcntl(fd, F_SETFL, flags);
+}
+
+
+void AESDirectFile::clearDirect ()
+{
+	if (direct) {
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+		direct = false;
+	}
+}
+
+
+void AESDirectFile::release (off_t from, off_t to)
+{
+	if (to > from)
+		posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+}
+
+
+/*
+**  Reads until len bytes or the end of the file. A short read through
+**  O_DIRECT is the end of the file: the offset after it is unaligned.
+*/
+
+size_t AESDirectFile::read (uint8_t *buf, size_t len)
+{
+	size_t total = 0;
+	while (total < len) {
+		ssize_t n = regular ? pread(fd, buf + total, len - total, offset) : ::read(fd, buf + total, len - total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && direct) {
+			clearDirect();
+			continue;
+		}
+		if (n < 0)
+			throw AESDirectException(string("unable to read input: ") + strerror(errno));
+		if (n == 0)
+			break;
+		if (regular && !direct)
+			release(offset, offset + n);
+		total += n;
+		offset += n;
+		if (direct && (n % AES_DIRECT_ALIGN) != 0)
+			break;
+	}
+	return total;
+}
+
+
+/*
+**  Every write but the last must be a multiple of AES_DIRECT_ALIGN long
+**  for O_DIRECT to last the whole file. Through the cache, writeback of
+**  each write is started at once, and the one before it waited for and
+**  dropped, so only about two writes' worth is ever cached.
+*/
+
+void AESDirectFile::write (const uint8_t *buf, size_t len)
+{
+	size_t aligned = direct ? len - (len % AES_DIRECT_ALIGN) : len;
+	size_t done = 0;
+	while (done < len) {
+		if (done == aligned)
+			clearDirect();
+		size_t want = ((done < aligned) ? aligned : len) - done;
+		ssize_t n = regular ? pwrite(fd, buf + done, want, offset) : ::write(fd, buf + done, want);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && direct) {
+			clearDirect();
+			aligned = len;
+			continue;
+		}
+		if (n < 0)
+			throw AESDirectException(string("unable to write output: ") + strerror(errno));
+		if (regular && !direct) {
+			sync_file_range(fd, offset, n, SYNC_FILE_RANGE_WRITE);
+			// a length of 0 would wait for everything up to the end of
+			// the file, this write included
+			if (offset > pending) {
+				sync_file_range(fd, pending, offset - pending,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				release(pending, offset);
+			}
+			pending = offset;
+		}
+		done += n;
+		offset += n;
+		if (direct)
+			pending = offset;
+	}
+}
+
+
+/*
+**  Waits for what is still being written back and drops it, then leaves
+**  the descriptor just past what was read or written, so whatever uses it
+**  next carries on from there.
+*/
+
+void AESDirectFile::finish ()
+{
+	if (!regular)
+		return;
+	if (writing && pending != offset) {
+		sync_file_range(fd, pending, offset - pending,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		release(pending, offset);
+		pending = offset;
+	}
+	lseek(fd, offset, SEEK_SET);
+}
+
+
+bool AESDirectFile::bypassing ()
+{
+	return direct;
+}
+
+
+// of a regular file from where it was when opened to its end, or -1
+off_t AESDirectFile::length ()
+{
+	return size;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <exception>
+
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/types.h>
+
+using namespace std;
+
+
+// the offset, length and buffer alignment O_DIRECT wants: the page size,
+// which covers the logical block size of every common device
+#define AES_DIRECT_ALIGN 4096
+
+
+/*
+**  One side of a bulk job that should leave the page cache alone. The
+**  job starts at the descriptor's offset (its end, with O_APPEND) and
+**  leaves the descriptor just past what it read or wrote. From an aligned
+**  offset the descriptor is switched to O_DIRECT when its file system
+**  allows it, and read or written in whole multiples of AES_DIRECT_ALIGN
+**  from aligned buffers; the unaligned tail of a file is written with
+**  O_DIRECT cleared again, synced, and dropped from the cache. Otherwise,
+**  or where O_DIRECT is refused, the file is read or written through the cache and
+**  each range is dropped with posix_fadvise(DONTNEED) once done with,
+**  written ones after their writeback. Pipes and terminals are simply
+**  read and written. The descriptor stays open and owned by the caller;
+**  its flags are restored on destruction.
+*/
+
+class AESDirectFile
+{
+private:
+
+	const int fd;
+	const bool writing;
+	int flags;
+	bool regular;
+	bool direct;
+	off_t offset;
+	off_t size;
+
+	// written, but not yet known to be on disk and out of the cache
+	off_t pending;
+
+	void clearDirect ();
+	void release (off_t from, off_t to);
+
+public:
+
+	AESDirectFile (int f, bool w);
+	~AESDirectFile ();
+
+	AESDirectFile (const AESDirectFile&) = delete;
+	AESDirectFile& operator= (const AESDirectFile&) = delete;
+
+	size_t read (uint8_t *buf, size_t len);
+	void write (const uint8_t *buf, size_t len);
+	void finish ();
+
+	bool bypassing ();
+	off_t length ();
+};
+
+
+class AESDirectException : public exception
+{
+private:
+
+	string msg;
+
+public:
+
+	AESDirectException (const string& m)
+		: msg(m)
+	{}
+
+	virtual ~AESDirectException () throw()
+	{}
+
+	virtual const char* what() const throw()
+	{
+		return msg.c_str();
+	}
+};
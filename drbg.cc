@@ -0,0 +1,211 @@
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "aes.h"
+#include "keystream.h"
+#include "drbg.h"
+
+using namespace std;
+
+
+/*
+**  A forked child starts with a copy of its parent's state, so every
+**  instance compares the fork count with the one it was seeded under and
+**  reseeds when they differ.
+*/
+
+static atomic<unsigned long> forks(0);
+static once_flag watching;
+
+static void forked ()
+{
+	forks.fetch_add(1, memory_order_relaxed);
+}
+
+
+static void watchForks ()
+{
+	call_once(watching, [] { pthread_atfork(NULL, NULL, forked); });
+}
+
+
+static unique_ptr<AESEngine> rekey (const uint8_t *key)
+{
+	vector<uint8_t> k(key, key + 32);
+	unique_ptr<AESEngine> engine(new AESEngine(AESEngine::AES_256_ECB, k));
+	fill(k.begin(), k.end(), 0);
+	return engine;
+}
+
+
+AESRandom::AESRandom ()
+	: requests(0), generation(0)
+{
+	watchForks();
+	memset(key, 0, sizeof(key));
+	memset(v, 0, sizeof(v));
+	engine = rekey(key);
+	reseed();
+}
+
+
+AESRandom::AESRandom (const uint8_t *seed)
+	: requests(0), generation(0)
+{
+	watchForks();
+	memset(key, 0, sizeof(key));
+	memset(v, 0, sizeof(v));
+	engine = rekey(key);
+	reseed(seed);
+}
+
+
+AESRandom::~AESRandom ()
+{
+	memset(key, 0, sizeof(key));
+	memset(v, 0, sizeof(v));
+}
+
+
+/*
+**  CTR_DRBG_Update: the next 48 bytes of keystream, XORed with the
+**  provided data when there is any, become the new key and V.
+*/
+
+void AESRandom::update (const uint8_t *provided)
+{
+	uint8_t temp[AES_DRBG_SEED_SIZE];
+	for (size_t off = 0; off < sizeof(temp); off += AES_BLOCK_SIZE) {
+		AESKeystream::addCounter(v, 1);
+		memcpy(temp + off, v, AES_BLOCK_SIZE);
+		engine->cipherBlock(temp + off);
+	}
+	if (provided != NULL) {
+		for (size_t k = 0; k < sizeof(temp); ++k)
+			temp[k] ^= provided[k];
+	}
+	memcpy(key, temp, sizeof(key));
+	memcpy(v, temp + sizeof(key), sizeof(v));
+	memset(temp, 0, sizeof(temp));
+	engine = rekey(key);
+}
+
+
+/*
+**  With no seed given, one is read from getrandom.
+*/
+
+void AESRandom::reseed (const uint8_t *seed)
+{
+	uint8_t fresh[AES_DRBG_SEED_SIZE];
+	if (seed == NULL) {
+		entropy(fresh, sizeof(fresh));
+		seed = fresh;
+	}
+	generation = forks.load(memory_order_relaxed);
+	update(seed);
+	memset(fresh, 0, sizeof(fresh));
+	requests = 1;
+}
+
+
+void AESRandom::request (uint8_t *out, size_t len)
+{
+	if (requests > AES_DRBG_RESEED_INTERVAL || generation != forks.load(memory_order_relaxed))
+		reseed();
+
+	size_t off = 0;
+	for (; off + AES_BLOCK_SIZE <= len; off += AES_BLOCK_SIZE) {
+		AESKeystream::addCounter(v, 1);
+		memcpy(out + off, v, AES_BLOCK_SIZE);
+		engine->cipherBlock(out + off);
+	}
+	if (off < len) {
+		uint8_t block[AES_BLOCK_SIZE];
+		AESKeystream::addCounter(v, 1);
+		memcpy(block, v, AES_BLOCK_SIZE);
+		engine->cipherBlock(block);
+		memcpy(out + off, block, len - off);
+		memset(block, 0, sizeof(block));
+	}
+	update(NULL);
+	++requests;
+}
+
+
+void AESRandom::generate (uint8_t *out, size_t len)
+{
+	for (size_t off = 0; off < len; off += AES_DRBG_MAX_REQUEST)
+		request(out + off, min((size_t)AES_DRBG_MAX_REQUEST, len - off));
+}
+
+
+/*
+**  Small requests are served from a block of output generated ahead,
+**  which spreads the rekeying in each request over many of them. The
+**  bytes are wiped as they are handed out.
+*/
+
+struct AESRandomPool
+{
+	AESRandom random;
+	uint8_t buffer[4096];
+	size_t left;
+	unsigned long generation;
+
+	AESRandomPool ()
+		: left(0), generation(forks.load(memory_order_relaxed))
+	{}
+
+	~AESRandomPool ()
+	{
+		memset(buffer, 0, sizeof(buffer));
+	}
+};
+
+
+void AESRandom::fill (uint8_t *out, size_t len)
+{
+	static thread_local AESRandomPool pool;
+	if (pool.generation != forks.load(memory_order_relaxed)) {
+		pool.generation = forks.load(memory_order_relaxed);
+		pool.left = 0;
+	}
+	if (len >= sizeof(pool.buffer)) {
+		pool.random.generate(out, len);
+		return;
+	}
+	if (pool.left < len) {
+		pool.random.generate(pool.buffer, sizeof(pool.buffer));
+		pool.left = sizeof(pool.buffer);
+	}
+	uint8_t *from = pool.buffer + sizeof(pool.buffer) - pool.left;
+	memcpy(out, from, len);
+	memset(from, 0, len);
+	pool.left -= len;
+}
+
+
+void AESRandom::entropy (uint8_t *out, size_t len)
+{
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = getrandom(out + got, len - got, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw KeyGenerationException("unable to read entropy from getrandom");
+		}
+		got += n;
+	}
+}
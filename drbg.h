@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+
+#include <cstdint>
+#include <cstddef>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_DRBG_SEED_SIZE 48
+#define AES_DRBG_MAX_REQUEST (64 * 1024)
+#define AES_DRBG_RESEED_INTERVAL (1 << 16)
+
+
+/*
+**  CTR_DRBG from SP 800-90A section 10.2.1, over AES-256 and without a
+**  derivation function: 48 bytes of seed straight from getrandom, a
+**  request at most 64 KiB, and a reseed every 65536 requests and after
+**  a fork. Instances are not shared between threads; fill() uses one
+**  per thread, so keys and IVs cost no locks and, most of the time, no
+**  system calls either.
+*/
+
+class AESRandom
+{
+private:
+
+	uint8_t key[32];
+	uint8_t v[AES_BLOCK_SIZE];
+	unique_ptr<AESEngine> engine;
+	uint64_t requests;
+	unsigned long generation;
+
+	void update (const uint8_t *provided);
+	void request (uint8_t *out, size_t len);
+
+public:
+
+	AESRandom ();
+	explicit AESRandom (const uint8_t *seed);
+	~AESRandom ();
+
+	AESRandom (const AESRandom&) = delete;
+	AESRandom& operator= (const AESRandom&) = delete;
+
+	void reseed (const uint8_t *seed = NULL);
+	void generate (uint8_t *out, size_t len);
+
+	static void fill (uint8_t *out, size_t len);
+	static void entropy (uint8_t *out, size_t len);
+};
@@ -0,0 +1,124 @@
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "arena.h"
+#include "parallel.h"
+#include "fanout.h"
+
+using namespace std;
+
+
+// the batch is whole tiles when it can be, and whole blocks at least
+static size_t batchSize (unsigned int nthreads, size_t chunk)
+{
+	size_t b = nthreads * max((size_t)AES_BLOCK_SIZE, chunk - (chunk % AES_BLOCK_SIZE));
+	return (b >= AES_FANOUT_TILE) ? b - (b % AES_FANOUT_TILE) : b;
+}
+
+
+AESFanout::AESFanout (const vector<AESEngine *>& e, unsigned int n, size_t chunk)
+	: engines(e),
+	  nthreads(n == 0 ? AESParallel::cpus().size() : n),
+	  batch(batchSize(nthreads, chunk))
+{
+	vector<size_t> cbc;
+	for (size_t k = 0; k < engines.size(); ++k) {
+		if (engines[k]->isModeCBC())
+			cbc.push_back(k);
+		else
+			ecb.push_back(k);
+	}
+	groups.resize(min(cbc.size(), (size_t)nthreads));
+	for (size_t k = 0; k < cbc.size(); ++k)
+		groups[k % groups.size()].push_back(cbc[k]);
+}
+
+
+/*
+**  len is a whole number of blocks, already padded if it ends the input.
+**  out[k] receives engine k's ciphertext and may not overlap in.
+*/
+
+void AESFanout::encrypt (const uint8_t *in, size_t len, const vector<uint8_t *>& out)
+{
+	len -= len % AES_BLOCK_SIZE;
+	const size_t ntiles = (len + AES_FANOUT_TILE - 1) / AES_FANOUT_TILE;
+	const size_t nitems = groups.size() + (ecb.empty() ? 0 : ntiles);
+
+	// the groups come first: they are the long ones
+	parallelFor(nitems, nthreads, [&](size_t item) {
+		if (item >= groups.size()) {
+			size_t off = (item - groups.size()) * AES_FANOUT_TILE;
+			size_t n = min((size_t)AES_FANOUT_TILE, len - off);
+			for (size_t j = 0; j < ecb.size(); ++j) {
+				memcpy(out[ecb[j]] + off, in + off, n);
+				engines[ecb[j]]->cipherBlocks(out[ecb[j]] + off, n / AES_BLOCK_SIZE);
+			}
+			return;
+		}
+
+		const vector<size_t>& group = groups[item];
+		vector<uint8_t> chains(group.size() * AES_BLOCK_SIZE);
+		for (size_t j = 0; j < group.size(); ++j)
+			engines[group[j]]->getIV(&chains[j * AES_BLOCK_SIZE]);
+		for (size_t off = 0; off < len; off += AES_FANOUT_TILE) {
+			size_t n = min((size_t)AES_FANOUT_TILE, len - off);
+			for (size_t j = 0; j < group.size(); ++j) {
+				AESEngine *engine = engines[group[j]];
+				uint8_t *chain = &chains[j * AES_BLOCK_SIZE];
+				uint8_t *block = out[group[j]] + off;
+				memcpy(block, in + off, n);
+				for (size_t b = 0; b < n; b += AES_BLOCK_SIZE) {
+					AESEngine::encryptCBC(block + b, chain);
+					engine->cipherBlock(block + b);
+					chain = block + b;
+				}
+				memcpy(&chains[j * AES_BLOCK_SIZE], chain, AES_BLOCK_SIZE);
+			}
+		}
+		for (size_t j = 0; j < group.size(); ++j)
+			engines[group[j]]->setIV(&chains[j * AES_BLOCK_SIZE]);
+	});
+}
+
+
+void AESFanout::encryptFile (FILE *infile, const vector<FILE *>& outfiles, AESEngine *mac)
+{
+	AESBuffer inbuffer(batch + AES_BLOCK_SIZE);
+	uint8_t *inbuf = inbuffer.get();
+	vector<unique_ptr<AESBuffer>> outbuffers;
+	vector<uint8_t *> outbufs;
+	for (size_t k = 0; k < engines.size(); ++k) {
+		outbuffers.push_back(unique_ptr<AESBuffer>(new AESBuffer(batch + AES_BLOCK_SIZE)));
+		outbufs.push_back(outbuffers.back()->get());
+	}
+
+	size_t count = 0;
+	do {
+		count = readChunk(inbuf, batch, infile);
+		if (mac != NULL)
+			mac->cmacUpdate(inbuf, count);
+
+		size_t nbytes = count;
+		if (count < batch) {
+			size_t whole = count - (count % AES_BLOCK_SIZE);
+			nbytes = whole + AESEngine::pad(inbuf + whole, count - whole);
+		}
+		encrypt(inbuf, nbytes, outbufs);
+		for (size_t k = 0; k < engines.size(); ++k)
+			fwrite(outbufs[k], 1, nbytes, outfiles[k]);
+	} while (count == batch);
+	memset(inbuf, 0, batch + AES_BLOCK_SIZE);
+}
+
+
+size_t AESFanout::recipients ()
+{
+	return engines.size();
+}
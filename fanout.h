@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_FANOUT_TILE (16 * 1024)
+
+
+/*
+**  One input encrypted under several engines in a single pass, such as a
+**  backup sent to several sites, each under its own key. The input is read
+**  once, a batch of nthreads * chunk bytes at a time, and padded once,
+**  since every output pads the same plaintext. Input I/O and the batch
+**  buffer do not grow with the number of engines; only the outputs do.
+**
+**  The batch is cut into tiles of AES_FANOUT_TILE bytes. Each ECB tile
+**  goes to one thread, which encrypts its copy under every ECB engine
+**  while the tile is still in L1/L2. CBC chains a tile to the one before
+**  it, so the CBC engines are shared out in groups, one thread each. Each
+**  group walks the tiles and runs all of its engines over a tile before
+**  moving on. The groups and the ECB tiles run in the same parallelFor.
+**
+**  Output k holds what encryptFile would write under engine k. The CBC
+**  engines go on from their IV and leave it at their last ciphertext
+**  block. The ECB engines are only read, so the threads can share them.
+*/
+
+class AESFanout
+{
+private:
+
+	vector<AESEngine *> engines;
+	vector<size_t> ecb;
+	vector<vector<size_t>> groups;
+	const unsigned int nthreads;
+	const size_t batch;
+
+public:
+
+	AESFanout (const vector<AESEngine *>& e, unsigned int n = 0, size_t chunk = AES_CHUNK_SIZE);
+
+	void encrypt (const uint8_t *in, size_t len, const vector<uint8_t *>& out);
+	void encryptFile (FILE *in, const vector<FILE *>& out, AESEngine *mac = NULL);
+
+	size_t recipients ();
+};
@@ -0,0 +1,627 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+#include "kat.h"
+#include "parallel.h"
+#include "keystream.h"
+#include "batch.h"
+#include "drbg.h"
+
+using namespace std;
+
+
+/*
+**  Known-answer vectors from FIPS-197 appendix C, SP 800-38A appendix F,
+**  RFC 4493 section 4 and the CAVP CTR_DRBG test file.
+*/
+
+struct BlockVector {
+	AESEngine::AESMode mode;
+	const char *key;
+	const char *plaintext;
+	const char *ciphertext;
+};
+
+static const BlockVector FIPS197[] = {
+	{
+		AESEngine::AESMode::AES_128_ECB,
+		"000102030405060708090a0b0c0d0e0f",
+		"00112233445566778899aabbccddeeff",
+		"69c4e0d86a7b0430d8cdb78070b4c55a"
+	},
+	{
+		AESEngine::AESMode::AES_192_ECB,
+		"000102030405060708090a0b0c0d0e0f1011121314151617",
+		"00112233445566778899aabbccddeeff",
+		"dda97ca4864cdfe06eaf70a0ec0d7191"
+	},
+	{
+		AESEngine::AESMode::AES_256_ECB,
+		"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+		"00112233445566778899aabbccddeeff",
+		"8ea2b7ca516745bfeafc49904b496089"
+	}
+};
+
+static const char *SP800_38A_IV = "000102030405060708090a0b0c0d0e0f";
+
+static const char *SP800_38A_PLAINTEXT =
+	"6bc1bee22e409f96e93d7e117393172a"
+	"ae2d8a571e03ac9c9eb76fac45af8e51"
+	"30c81c46a35ce411e5fbc1191a0a52ef"
+	"f69f2445df4f9b17ad2b417be66c3710";
+
+static const BlockVector SP800_38A[] = {
+	{
+		AESEngine::AESMode::AES_128_ECB,
+		"2b7e151628aed2a6abf7158809cf4f3c",
+		SP800_38A_PLAINTEXT,
+		"3ad77bb40d7a3660a89ecaf32466ef97"
+		"f5d3d58503b9699de785895a96fdbaaf"
+		"43b1cd7f598ece23881b00e3ed030688"
+		"7b0c785e27e8ad3f8223207104725dd4"
+	},
+	{
+		AESEngine::AESMode::AES_192_ECB,
+		"8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+		SP800_38A_PLAINTEXT,
+		"bd334f1d6e45f25ff712a214571fa5cc"
+		"974104846d0ad3ad7734ecb3ecee4eef"
+		"ef7afd2270e2e60adce0ba2face6444e"
+		"9a4b41ba738d6c72fb16691603c18e0e"
+	},
+	{
+		AESEngine::AESMode::AES_256_ECB,
+		"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+		SP800_38A_PLAINTEXT,
+		"f3eed1bdb5d2a03c064b5a7e3db181f8"
+		"591ccb10d410ed26dc5ba74a31362870"
+		"b6ed21b99ca6f4f9f153e7b1beafed1d"
+		"23304b7a39f9f3ff067d8d8f9e24ecc7"
+	},
+	{
+		AESEngine::AESMode::AES_128_CBC,
+		"2b7e151628aed2a6abf7158809cf4f3c",
+		SP800_38A_PLAINTEXT,
+		"7649abac8119b246cee98e9b12e9197d"
+		"5086cb9b507219ee95db113a917678b2"
+		"73bed6b8e3c1743b7116e69e22229516"
+		"3ff1caa1681fac09120eca307586e1a7"
+	},
+	{
+		AESEngine::AESMode::AES_192_CBC,
+		"8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+		SP800_38A_PLAINTEXT,
+		"4f021db243bc633d7178183a9fa071e8"
+		"b4d9ada9ad7dedf4e5e738763f69145a"
+		"571b242012fb7ae07fa9baac3df102e0"
+		"08b0e27988598881d920a9e64f5615cd"
+	},
+	{
+		AESEngine::AESMode::AES_256_CBC,
+		"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+		SP800_38A_PLAINTEXT,
+		"f58c4c04d6e5f1ba779eabfb5f7bfbd6"
+		"9cfc4e967edb808d679f777bc6702c7d"
+		"39f23369a9d9bacfa530e26304231461"
+		"b2eb05e2c39be9fcda6c19078c6a9d1b"
+	}
+};
+
+static const char *SP800_38A_COUNTER = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+// counter mode runs on the forward cipher alone, so the ECB modes stand
+// in for the key sizes
+static const BlockVector SP800_38A_CTR[] = {
+	{
+		AESEngine::AESMode::AES_128_ECB,
+		"2b7e151628aed2a6abf7158809cf4f3c",
+		SP800_38A_PLAINTEXT,
+		"874d6191b620e3261bef6864990db6ce"
+		"9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab"
+		"1e031dda2fbe03d1792170a0f3009cee"
+	},
+	{
+		AESEngine::AESMode::AES_192_ECB,
+		"8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+		SP800_38A_PLAINTEXT,
+		"1abc932417521ca24f2b0459fe7e6e0b"
+		"090339ec0aa6faefd5ccc2c6f4ce8e94"
+		"1e36b26bd1ebc670d1bd1d665620abf7"
+		"4f78a7f6d29809585a97daec58c6b050"
+	},
+	{
+		AESEngine::AESMode::AES_256_ECB,
+		"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+		SP800_38A_PLAINTEXT,
+		"601ec313775789a5b7a7f504bbf3d228"
+		"f443e3ca4d62b59aca84e990cacaf5c5"
+		"2b0930daa23de94ce87017ba2d84988d"
+		"dfc9c58db67aada613c2dd08457941a6"
+	}
+};
+
+static const char *RFC4493_KEY = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char *RFC4493_K1 = "fbeed618357133667c85e08f7236a8de";
+static const char *RFC4493_K2 = "f7ddac306ae266ccf90bc11ee46d513b";
+
+struct MACVector {
+	size_t length;
+	const char *tag;
+};
+
+static const MACVector RFC4493[] = {
+	{  0, "bb1d6929e95937287fa37d129b756746" },
+	{ 16, "070a16b46b4d4144f79bdd9dd04a287c" },
+	{ 40, "dfa66747de9ae63030ca32611497c827" },
+	{ 64, "51f0bebf7e3b9d92fc49741779363cfe" }
+};
+
+// drbgvectors_no_reseed, [AES-256 no df], no nonce, personalization or
+// additional input: instantiate, generate 512 bits twice, keep the second
+struct DRBGVector {
+	const char *entropy;
+	const char *returned;
+};
+
+static const DRBGVector SP800_90A[] = {
+	{
+		"df5d73faa468649edda33b5cca79b0b05600419ccb7a879ddfec9db32ee494e5"
+		"531b51de16a30f769262474c73bec010",
+		"d1c07cd95af8a7f11012c84ce48bb8cb87189e99d40fccb1771c619bdf82ab22"
+		"80b1dc2f2581f39164f7ac0c510494b3a43c41b7db17514c87b107ae793e01c5"
+	}
+};
+
+static const AESEngine::AESMode MODES[] = {
+	AESEngine::AESMode::AES_128_ECB,
+	AESEngine::AESMode::AES_192_ECB,
+	AESEngine::AESMode::AES_256_ECB,
+	AESEngine::AESMode::AES_128_CBC,
+	AESEngine::AESMode::AES_192_CBC,
+	AESEngine::AESMode::AES_256_CBC
+};
+
+static const AESEngine::Backend BACKENDS[] = {
+	AESEngine::AES_BACKEND_TABLE,
+	AESEngine::AES_BACKEND_VPERM
+};
+
+static const char *MODE_NAMES[] = {
+	"AES-128-ECB",
+	"AES-192-ECB",
+	"AES-256-ECB",
+	"AES-128-CBC",
+	"AES-192-CBC",
+	"AES-256-CBC"
+};
+
+
+static vector<uint8_t> fromhex (const char *hex)
+{
+	vector<uint8_t> bytes;
+	for (const char *p = hex; p[0] != '\0' && p[1] != '\0'; p += 2) {
+		unsigned int byte;
+		sscanf(p, "%2x", &byte);
+		bytes.push_back((uint8_t)byte);
+	}
+	return bytes;
+}
+
+
+static vector<uint8_t> random_bytes (size_t len)
+{
+	vector<uint8_t> bytes(len);
+	for (size_t k = 0; k < len; ++k) {
+		bytes[k] = (uint8_t)(0xff & rand());
+	}
+	return bytes;
+}
+
+
+/*
+**  Reference paths: one block at a time through encryptBlock/decryptBlock,
+**  with the padding applied by hand. Everything else is compared to these.
+*/
+
+static vector<uint8_t> reference_encrypt (AESEngine& engine, const vector<uint8_t>& plain)
+{
+	vector<uint8_t> out(plain);
+	uint8_t val = (uint8_t)(AES_BLOCK_SIZE - (plain.size() % AES_BLOCK_SIZE));
+	out.insert(out.end(), val, val);
+	for (size_t off = 0; off < out.size(); off += AES_BLOCK_SIZE) {
+		engine.encryptBlock(&out[off]);
+	}
+	return out;
+}
+
+
+static vector<uint8_t> stream_process (AESEngine& engine, AESStream::Direction d,
+		const vector<uint8_t>& in, size_t maxfragment)
+{
+	// the input and output are placed at random offsets so that unaligned
+	// buffers are exercised as well
+	size_t inoff = rand() % AES_BLOCK_SIZE;
+	size_t outoff = rand() % AES_BLOCK_SIZE;
+	vector<uint8_t> inbuf(inoff + in.size());
+	vector<uint8_t> outbuf(outoff + in.size() + 2 * AES_BLOCK_SIZE);
+	copy(in.begin(), in.end(), inbuf.begin() + inoff);
+
+	AESStream stream(engine, d);
+	size_t nbytes = 0;
+	for (size_t off = 0; off < in.size(); ) {
+		size_t n = min((size_t)(rand() % (maxfragment + 1)), in.size() - off);
+		nbytes += stream.update(&inbuf[inoff + off], n, &outbuf[outoff + nbytes]);
+		off += n;
+	}
+	nbytes += stream.final(&outbuf[outoff + nbytes]);
+	return vector<uint8_t>(outbuf.begin() + outoff, outbuf.begin() + outoff + nbytes);
+}
+
+
+static vector<uint8_t> file_process (AESEngine& engine, AESStream::Direction d,
+		const vector<uint8_t>& in)
+{
+	FILE *infile = tmpfile();
+	FILE *outfile = tmpfile();
+	vector<uint8_t> out;
+	if (infile == NULL || outfile == NULL) {
+		return out;
+	}
+	if (!in.empty())
+		fwrite(&in[0], 1, in.size(), infile);
+	rewind(infile);
+	if (d == AESStream::ENCRYPT)
+		engine.encryptFile(infile, outfile);
+	else
+		engine.decryptFile(infile, outfile);
+	out.resize(ftell(outfile));
+	rewind(outfile);
+	if (!out.empty() && fread(&out[0], 1, out.size(), outfile) != out.size())
+		out.clear();
+	fclose(infile);
+	fclose(outfile);
+	return out;
+}
+
+
+static vector<uint8_t> parallel_process (AESEngine& engine, AESStream::Direction d,
+		const vector<uint8_t>& in, unsigned int nthreads, size_t slice)
+{
+	AESParallel par(engine, nthreads, slice);
+	FILE *infile = tmpfile();
+	FILE *outfile = tmpfile();
+	vector<uint8_t> out;
+	if (infile == NULL || outfile == NULL) {
+		return out;
+	}
+	if (!in.empty())
+		fwrite(&in[0], 1, in.size(), infile);
+	rewind(infile);
+	if (d == AESStream::ENCRYPT)
+		par.encryptFile(infile, outfile);
+	else
+		par.decryptFile(infile, outfile);
+	out.resize(ftell(outfile));
+	rewind(outfile);
+	if (!out.empty() && fread(&out[0], 1, out.size(), outfile) != out.size())
+		out.clear();
+	fclose(infile);
+	fclose(outfile);
+	return out;
+}
+
+
+static bool test_fips197 (AESEngine::Backend backend)
+{
+	for (unsigned int v = 0; v < sizeof(FIPS197) / sizeof(FIPS197[0]); ++v) {
+		const BlockVector& kat = FIPS197[v];
+		AESEngine engine(kat.mode, fromhex(kat.key), backend);
+		vector<uint8_t> block = fromhex(kat.plaintext);
+		engine.cipherBlock(&block[0]);
+		if (block != fromhex(kat.ciphertext))
+			return false;
+		engine.invCipherBlock(&block[0]);
+		if (block != fromhex(kat.plaintext))
+			return false;
+	}
+	return true;
+}
+
+
+static bool test_sp800_38a (AESEngine::Backend backend)
+{
+	vector<uint8_t> iv = fromhex(SP800_38A_IV);
+	for (unsigned int v = 0; v < sizeof(SP800_38A) / sizeof(SP800_38A[0]); ++v) {
+		const BlockVector& kat = SP800_38A[v];
+		vector<uint8_t> plain = fromhex(kat.plaintext);
+		vector<uint8_t> expected = fromhex(kat.ciphertext);
+
+		// block by block
+		AESEngine enc(kat.mode, fromhex(kat.key), backend);
+		enc.setIV(&iv[0]);
+		vector<uint8_t> data = plain;
+		for (size_t off = 0; off < data.size(); off += AES_BLOCK_SIZE)
+			enc.encryptBlock(&data[off]);
+		if (data != expected)
+			return false;
+
+		AESEngine dec(kat.mode, fromhex(kat.key), backend);
+		dec.setIV(&iv[0]);
+		for (size_t off = 0; off < data.size(); off += AES_BLOCK_SIZE)
+			dec.decryptBlock(&data[off]);
+		if (data != plain)
+			return false;
+
+		// the padded stream must agree with the vectors up to the padding
+		AESEngine senc(kat.mode, fromhex(kat.key), backend);
+		senc.setIV(&iv[0]);
+		data = stream_process(senc, AESStream::ENCRYPT, plain, 24);
+		if (data.size() != plain.size() + AES_BLOCK_SIZE
+				|| !equal(expected.begin(), expected.end(), data.begin()))
+			return false;
+
+		AESEngine fenc(kat.mode, fromhex(kat.key), backend);
+		fenc.setIV(&iv[0]);
+		if (file_process(fenc, AESStream::ENCRYPT, plain) != data)
+			return false;
+
+		AESEngine sdec(kat.mode, fromhex(kat.key), backend);
+		sdec.setIV(&iv[0]);
+		if (stream_process(sdec, AESStream::DECRYPT, data, 24) != plain)
+			return false;
+
+		// one block per worker, so every block boundary is a slice boundary
+		for (unsigned int nthreads = 1; nthreads <= 4; ++nthreads) {
+			AESEngine penc(kat.mode, fromhex(kat.key), backend);
+			penc.setIV(&iv[0]);
+			if (parallel_process(penc, AESStream::ENCRYPT, plain, nthreads, AES_BLOCK_SIZE) != data)
+				return false;
+			AESEngine pdec(kat.mode, fromhex(kat.key), backend);
+			pdec.setIV(&iv[0]);
+			if (parallel_process(pdec, AESStream::DECRYPT, data, nthreads, AES_BLOCK_SIZE) != plain)
+				return false;
+		}
+	}
+	return true;
+}
+
+
+static bool test_sp800_38a_ctr (AESEngine::Backend backend)
+{
+	vector<uint8_t> iv = fromhex(SP800_38A_COUNTER);
+	for (unsigned int v = 0; v < sizeof(SP800_38A_CTR) / sizeof(SP800_38A_CTR[0]); ++v) {
+		const BlockVector& kat = SP800_38A_CTR[v];
+		vector<uint8_t> plain = fromhex(kat.plaintext);
+		vector<uint8_t> expected = fromhex(kat.ciphertext);
+
+		AESEngine engine(kat.mode, fromhex(kat.key), backend);
+		vector<uint8_t> data(plain.size());
+		AESKeystream::transform(engine, &iv[0], &plain[0], plain.size(), &data[0]);
+		if (data != expected)
+			return false;
+		AESKeystream::transform(engine, &iv[0], &data[0], data.size(), &data[0]);
+		if (data != plain)
+			return false;
+
+		// the first message out of a warm cache starts at the base counter
+		AESKeystream cache(engine, &iv[0], 1024);
+		while (cache.available() < plain.size())
+			this_thread::yield();
+		vector<uint8_t> counter(AES_BLOCK_SIZE);
+		cache.encrypt(&plain[0], plain.size(), &data[0], &counter[0]);
+		if (data != expected || counter != iv || cache.cacheHits() != 1)
+			return false;
+	}
+	return true;
+}
+
+
+static bool test_rfc4493 (AESEngine::Backend backend)
+{
+	AESEngine engine(AESEngine::AESMode::AES_128_ECB, fromhex(RFC4493_KEY), backend);
+	uint8_t k1[AES_BLOCK_SIZE];
+	uint8_t k2[AES_BLOCK_SIZE];
+	engine.cmacSubkeys(k1, k2);
+	if (vector<uint8_t>(k1, k1 + AES_BLOCK_SIZE) != fromhex(RFC4493_K1)
+			|| vector<uint8_t>(k2, k2 + AES_BLOCK_SIZE) != fromhex(RFC4493_K2))
+		return false;
+
+	vector<uint8_t> msg = fromhex(SP800_38A_PLAINTEXT);
+	for (unsigned int v = 0; v < sizeof(RFC4493) / sizeof(RFC4493[0]); ++v) {
+		uint8_t tag[AES_BLOCK_SIZE];
+		engine.cmacInit();
+		engine.cmacUpdate(&msg[0], RFC4493[v].length);
+		engine.cmacFinal(tag);
+		if (vector<uint8_t>(tag, tag + AES_BLOCK_SIZE) != fromhex(RFC4493[v].tag))
+			return false;
+	}
+	return true;
+}
+
+
+static bool test_sp800_90a ()
+{
+	for (unsigned int v = 0; v < sizeof(SP800_90A) / sizeof(SP800_90A[0]); ++v) {
+		vector<uint8_t> entropy = fromhex(SP800_90A[v].entropy);
+		vector<uint8_t> expected = fromhex(SP800_90A[v].returned);
+		if (entropy.size() != AES_DRBG_SEED_SIZE)
+			return false;
+		AESRandom drbg(&entropy[0]);
+		vector<uint8_t> returned(expected.size());
+		drbg.generate(&returned[0], returned.size());
+		drbg.generate(&returned[0], returned.size());
+		if (returned != expected)
+			return false;
+	}
+	return true;
+}
+
+
+int runkats ()
+{
+	cout << "Running known-answer tests ..." << endl;
+
+	for (unsigned int b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++b) {
+		AESEngine::Backend backend = BACKENDS[b];
+		if (!AESEngine::backendAvailable(backend))
+			continue;
+		const char *name = AESEngine::backendName(backend);
+
+		cout << "\ttesting FIPS-197 (" << name << ") ... ";
+		if (!test_fips197(backend))
+			return 1;
+		cout << "PASS" << endl;
+
+		cout << "\ttesting SP 800-38A (" << name << ") ... ";
+		if (!test_sp800_38a(backend))
+			return 1;
+		cout << "PASS" << endl;
+
+		cout << "\ttesting SP 800-38A CTR (" << name << ") ... ";
+		if (!test_sp800_38a_ctr(backend))
+			return 1;
+		cout << "PASS" << endl;
+
+		cout << "\ttesting RFC 4493 (" << name << ") ... ";
+		if (!test_rfc4493(backend))
+			return 1;
+		cout << "PASS" << endl;
+	}
+
+	cout << "\ttesting SP 800-90A CTR_DRBG ... ";
+	if (!test_sp800_90a())
+		return 1;
+	cout << "PASS" << endl;
+
+	return 0;
+}
+
+
+/*
+**  A batch of records of random sizes and IVs under one key, half of them
+**  in place, against the reference one record at a time.
+*/
+
+static bool batch_process (AESEngine::AESMode mode, AESEngine::Backend backend, unsigned int n)
+{
+	vector<uint8_t> key = random_bytes(AESEngine::keySize(mode));
+	vector<vector<uint8_t>> plains(n), ivs(n), expected(n), outs(n);
+	vector<AESRecord> records(n);
+	for (unsigned int k = 0; k < n; ++k) {
+		plains[k] = random_bytes(rand() % 600);
+		ivs[k] = random_bytes(AES_BLOCK_SIZE);
+		AESEngine ref(mode, key, AESEngine::AES_BACKEND_TABLE);
+		ref.setIV(&ivs[k][0]);
+		expected[k] = reference_encrypt(ref, plains[k]);
+
+		bool inplace = (k % 2 == 0);
+		outs[k] = plains[k];
+		outs[k].resize(AESBatch::encryptedSize(plains[k].size()));
+		records[k].in = inplace ? outs[k].data() : plains[k].data();
+		records[k].len = plains[k].size();
+		records[k].out = outs[k].data();
+		records[k].iv = &ivs[k][0];
+	}
+
+	AESEngine engine(mode, key, backend);
+	AESBatch batch(engine);
+	batch.encrypt(records.data(), n);
+	for (unsigned int k = 0; k < n; ++k) {
+		if (!records[k].valid || records[k].outlen != expected[k].size() || outs[k] != expected[k])
+			return false;
+		records[k].in = outs[k].data();
+		records[k].len = outs[k].size();
+	}
+
+	// one record cut short, which must not disturb the others
+	records[0].len -= 1;
+	batch.decrypt(records.data(), n);
+	if (records[0].valid)
+		return false;
+	for (unsigned int k = 1; k < n; ++k) {
+		outs[k].resize(records[k].outlen);
+		if (!records[k].valid || outs[k] != plains[k])
+			return false;
+	}
+	return true;
+}
+
+
+/*
+**  Differential fuzzing: random keys, lengths, fragment sizes and buffer
+**  offsets, with every path checked against the reference.
+*/
+
+int runfuzz (unsigned int trials)
+{
+	cout << "Running differential tests ..." << endl;
+
+	for (unsigned int b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++b) {
+		AESEngine::Backend backend = BACKENDS[b];
+		if (!AESEngine::backendAvailable(backend))
+			continue;
+		const char *name = AESEngine::backendName(backend);
+
+		for (unsigned int m = 0; m < sizeof(MODES) / sizeof(MODES[0]); ++m) {
+			AESEngine::AESMode mode = MODES[m];
+			cout << "\ttesting " << MODE_NAMES[m] << " (" << name << ") ... ";
+			for (unsigned int trial = 0; trial < trials; ++trial) {
+				vector<uint8_t> key = random_bytes(AESEngine::keySize(mode));
+				vector<uint8_t> iv = random_bytes(AES_BLOCK_SIZE);
+				vector<uint8_t> plain = random_bytes(rand() % 2048);
+				size_t maxfragment = 1 + rand() % 100;
+
+				AESEngine ref(mode, key, AESEngine::AES_BACKEND_TABLE);
+				ref.setIV(&iv[0]);
+				vector<uint8_t> expected = reference_encrypt(ref, plain);
+
+				AESEngine senc(mode, key, backend);
+				senc.setIV(&iv[0]);
+				if (stream_process(senc, AESStream::ENCRYPT, plain, maxfragment) != expected)
+					return 1;
+
+				AESEngine fenc(mode, key, backend);
+				fenc.setIV(&iv[0]);
+				if (file_process(fenc, AESStream::ENCRYPT, plain) != expected)
+					return 1;
+
+				AESEngine sdec(mode, key, backend);
+				sdec.setIV(&iv[0]);
+				if (stream_process(sdec, AESStream::DECRYPT, expected, maxfragment) != plain)
+					return 1;
+
+				AESEngine fdec(mode, key, backend);
+				fdec.setIV(&iv[0]);
+				if (file_process(fdec, AESStream::DECRYPT, expected) != plain)
+					return 1;
+
+				unsigned int nthreads = 1 + rand() % 4;
+				size_t slice = AES_BLOCK_SIZE * (1 + rand() % 16);
+				AESEngine penc(mode, key, backend);
+				penc.setIV(&iv[0]);
+				if (parallel_process(penc, AESStream::ENCRYPT, plain, nthreads, slice) != expected)
+					return 1;
+
+				AESEngine pdec(mode, key, backend);
+				pdec.setIV(&iv[0]);
+				if (parallel_process(pdec, AESStream::DECRYPT, expected, nthreads, slice) != plain)
+					return 1;
+			}
+			if (!batch_process(mode, backend, trials))
+				return 1;
+			cout << "PASS" << endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "aes.h"
+
+
+int runkats ();
+int runfuzz (unsigned int trials);
@@ -0,0 +1,183 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "keystream.h"
+
+using namespace std;
+
+
+// blocks the producer computes between looks at the ring
+static const size_t BATCH = 64;
+
+
+/*
+**  Counters are base plus a 64-bit offset. The producer takes offsets
+**  counting up from zero and misses take them counting down from the
+**  top, so the ring's blocks are always consecutive counters and the
+**  two never meet in practice.
+*/
+
+AESKeystream::AESKeystream (const AESEngine& e, const uint8_t *iv, size_t bytes)
+	: engine(e), capacity(bytes / AES_BLOCK_SIZE), ring(capacity * AES_BLOCK_SIZE),
+	head(0), ready(0), headseq(0), next(0), spill(0),
+	hits(0), misses(0), stopping(false)
+{
+	memcpy(base, iv, AES_BLOCK_SIZE);
+	if (capacity > 0)
+		producer = thread(&AESKeystream::produce, this);
+}
+
+
+AESKeystream::~AESKeystream ()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	refill.notify_all();
+	if (producer.joinable())
+		producer.join();
+	fill(ring.begin(), ring.end(), 0);
+	memset(base, 0, sizeof(base));
+}
+
+
+void AESKeystream::produce ()
+{
+	const size_t batch = min(BATCH, capacity);
+	unique_lock<mutex> guard(lock);
+	for (;;) {
+		refill.wait(guard, [&] { return stopping || capacity - ready >= batch; });
+		if (stopping)
+			return;
+
+		// head + ready stays put while messages are taken from the head,
+		// so the slots after it are the producer's until it publishes them
+		size_t tail = head + ready;
+		uint64_t s = next;
+		next += batch;
+		guard.unlock();
+
+		uint8_t counter[AES_BLOCK_SIZE];
+		memcpy(counter, base, AES_BLOCK_SIZE);
+		addCounter(counter, s);
+		for (size_t b = 0; b < batch; ++b) {
+			uint8_t *slot = &ring[((tail + b) % capacity) * AES_BLOCK_SIZE];
+			memcpy(slot, counter, AES_BLOCK_SIZE);
+			engine.cipherBlock(slot);
+			addCounter(counter, 1);
+		}
+
+		guard.lock();
+		ready += batch;
+	}
+}
+
+
+/*
+**  Encrypts len bytes into out (which may be in) and writes the counter
+**  block the message starts at to counter.
+*/
+
+void AESKeystream::encrypt (const uint8_t *in, size_t len, uint8_t *out, uint8_t *counter)
+{
+	size_t nblocks = (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+	unique_lock<mutex> guard(lock);
+	if (nblocks > 0 && nblocks <= ready) {
+		uint64_t s = headseq;
+		for (size_t b = 0; b < nblocks; ++b) {
+			uint8_t *slot = &ring[((head + b) % capacity) * AES_BLOCK_SIZE];
+			size_t off = b * AES_BLOCK_SIZE;
+			size_t n = min((size_t)AES_BLOCK_SIZE, len - off);
+			for (size_t k = 0; k < n; ++k)
+				out[off + k] = in[off + k] ^ slot[k];
+			memset(slot, 0, AES_BLOCK_SIZE);
+		}
+		head = (head + nblocks) % capacity;
+		ready -= nblocks;
+		headseq += nblocks;
+		++hits;
+		guard.unlock();
+		refill.notify_one();
+
+		memcpy(counter, base, AES_BLOCK_SIZE);
+		addCounter(counter, s);
+		return;
+	}
+
+	spill -= nblocks;
+	uint64_t s = spill;
+	++misses;
+	guard.unlock();
+
+	memcpy(counter, base, AES_BLOCK_SIZE);
+	addCounter(counter, s);
+	transform(engine, counter, in, len, out);
+}
+
+
+size_t AESKeystream::available ()
+{
+	lock_guard<mutex> guard(lock);
+	return ready * AES_BLOCK_SIZE;
+}
+
+
+uint64_t AESKeystream::cacheHits ()
+{
+	lock_guard<mutex> guard(lock);
+	return hits;
+}
+
+
+uint64_t AESKeystream::cacheMisses ()
+{
+	lock_guard<mutex> guard(lock);
+	return misses;
+}
+
+
+/*
+**  Plain counter mode from counter on, for decryption or for messages
+**  that miss the cache. in and out may be the same buffer.
+*/
+
+void AESKeystream::transform (AESEngine& engine, const uint8_t *counter,
+	const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t ctr[AES_BLOCK_SIZE];
+	uint8_t block[AES_BLOCK_SIZE];
+	memcpy(ctr, counter, AES_BLOCK_SIZE);
+	for (size_t off = 0; off < len; off += AES_BLOCK_SIZE) {
+		memcpy(block, ctr, AES_BLOCK_SIZE);
+		engine.cipherBlock(block);
+		size_t n = min((size_t)AES_BLOCK_SIZE, len - off);
+		for (size_t k = 0; k < n; ++k)
+			out[off + k] = in[off + k] ^ block[k];
+		addCounter(ctr, 1);
+	}
+	memset(block, 0, sizeof(block));
+}
+
+
+/*
+**  Adds n to a big-endian 128-bit counter, modulo 2^128.
+*/
+
+void AESKeystream::addCounter (uint8_t *counter, uint64_t n)
+{
+	unsigned int carry = 0;
+	for (int k = AES_BLOCK_SIZE - 1; k >= 0; --k) {
+		unsigned int sum = counter[k] + (unsigned int)(n & 0xff) + carry;
+		counter[k] = (uint8_t)sum;
+		carry = sum >> 8;
+		n >>= 8;
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <cstdint>
+#include <cstddef>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_KEYSTREAM_CAPACITY (64 * 1024)
+
+
+/*
+**  Counter mode (SP 800-38A section 6.5) with the keystream computed
+**  ahead of time. A background thread keeps a bounded ring of keystream
+**  blocks for the counters after base filled, so encrypting a message
+**  that fits in what is ready is one XOR; the rounds happen off the
+**  caller's path, and the ring refills behind it.
+**
+**  Every message starts on a fresh counter block, which encrypt() hands
+**  back for the receiver: ciphertext is decrypted with transform() from
+**  that counter, and needs no cache. Messages that find too little ready
+**  keystream take a counter range of their own and are done inline;
+**  keystream is never used twice. The base counter must not be reused
+**  under the same key, by this or any other instance. Safe to share
+**  between threads.
+*/
+
+class AESKeystream
+{
+private:
+
+	AESEngine engine;
+	uint8_t base[AES_BLOCK_SIZE];
+
+	// capacity blocks of keystream, ready ones from head on, for the
+	// counters base + headseq onwards
+	const size_t capacity;
+	vector<uint8_t> ring;
+	size_t head;
+	size_t ready;
+	uint64_t headseq;
+	uint64_t next;
+	uint64_t spill;
+
+	uint64_t hits;
+	uint64_t misses;
+
+	bool stopping;
+	mutex lock;
+	condition_variable refill;
+	thread producer;
+
+	void produce ();
+
+public:
+
+	AESKeystream (const AESEngine& e, const uint8_t *iv, size_t bytes = AES_KEYSTREAM_CAPACITY);
+	~AESKeystream ();
+
+	AESKeystream (const AESKeystream&) = delete;
+	AESKeystream& operator= (const AESKeystream&) = delete;
+
+	void encrypt (const uint8_t *in, size_t len, uint8_t *out, uint8_t *counter);
+
+	size_t available ();
+	uint64_t cacheHits ();
+	uint64_t cacheMisses ();
+
+	static void transform (AESEngine& engine, const uint8_t *counter,
+		const uint8_t *in, size_t len, uint8_t *out);
+	static void addCounter (uint8_t *counter, uint64_t n);
+};
@@ -0,0 +1,434 @@
+#include <new>
+#include <exception>
+
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "keystream.h"
+#include "batch.h"
+#include "libaes.h"
+
+using namespace std;
+
+
+/*
+**  The handles behind the C interface. Nothing may throw past it, so
+**  every entry point maps exceptions to status codes.
+*/
+
+struct aes_ctx {
+	// cipherBlock and invCipherBlock only read the schedule, which is
+	// what lets the buffer functions take a const context
+	mutable AESEngine engine;
+	uint8_t iv[AES_BLOCK_SIZE];
+
+	aes_ctx (AESEngine::AESMode m, const vector<uint8_t>& k)
+		: engine(m, k)
+	{
+		memset(iv, 0, sizeof(iv));
+	}
+
+	~aes_ctx ()
+	{
+		memset(iv, 0, sizeof(iv));
+	}
+};
+
+
+struct aes_stream {
+	AESEngine engine;
+	AESStream stream;
+
+	aes_stream (const aes_ctx *ctx, AESStream::Direction d)
+		: engine(ctx->engine), stream(engine, d)
+	{
+		engine.setIV(ctx->iv);
+	}
+};
+
+
+struct aes_ctr {
+	AESKeystream keystream;
+
+	aes_ctr (const aes_ctx *ctx, const uint8_t *iv, size_t cachelen)
+		: keystream(ctx->engine, iv, cachelen)
+	{}
+};
+
+
+static const AESEngine::AESMode MODES[] = {
+	AESEngine::AES_128_ECB,
+	AESEngine::AES_192_ECB,
+	AESEngine::AES_256_ECB,
+	AESEngine::AES_128_CBC,
+	AESEngine::AES_192_CBC,
+	AESEngine::AES_256_CBC
+};
+
+
+static int status (const exception& e)
+{
+	if (dynamic_cast<const IllegalAESPadding *>(&e) != NULL)
+		return AES_ERR_PADDING;
+	if (dynamic_cast<const IllegalAESBlockSize *>(&e) != NULL)
+		return AES_ERR_LENGTH;
+	if (dynamic_cast<const bad_alloc *>(&e) != NULL)
+		return AES_ERR_MEMORY;
+	return AES_ERR_INTERNAL;
+}
+
+
+AES_API int aes_abi_version (void)
+{
+	return AES_ABI_VERSION;
+}
+
+
+AES_API const char *aes_strerror (int status)
+{
+	switch (status) {
+		case AES_OK:
+			return "success";
+		case AES_ERR_ARGUMENT:
+			return "invalid argument";
+		case AES_ERR_MODE:
+			return "unknown mode";
+		case AES_ERR_KEY:
+			return "key size does not match the mode";
+		case AES_ERR_LENGTH:
+			return "ciphertext is not a whole number of blocks";
+		case AES_ERR_PADDING:
+			return "illegal AES padding";
+		case AES_ERR_BUFFER:
+			return "output buffer too small";
+		case AES_ERR_MEMORY:
+			return "out of memory";
+		default:
+			return "internal error";
+	}
+}
+
+
+//                     m
+//    mmm    mmm   mm#mm  m   m
+//   #"  "  #"  "    #     #m#
+//   #      #        #     m#m
+//   "#mm"  "#mm"    "mm  m" "m
+//
+
+
+AES_API int aes_ctx_new (aes_ctx **ctx, int mode, const uint8_t *key, size_t keylen)
+{
+	if (ctx == NULL || key == NULL)
+		return AES_ERR_ARGUMENT;
+	*ctx = NULL;
+	if (mode < 0 || mode >= (int)(sizeof(MODES) / sizeof(MODES[0])))
+		return AES_ERR_MODE;
+	if (keylen != AESEngine::keySize(MODES[mode]))
+		return AES_ERR_KEY;
+
+	vector<uint8_t> k(key, key + keylen);
+	int ret = AES_OK;
+	try {
+		*ctx = new aes_ctx(MODES[mode], k);
+	} catch (exception& e) {
+		ret = status(e);
+	}
+	fill(k.begin(), k.end(), 0);
+	return ret;
+}
+
+
+AES_API void aes_ctx_free (aes_ctx *ctx)
+{
+	delete ctx;
+}
+
+
+AES_API int aes_ctx_set_iv (aes_ctx *ctx, const uint8_t *iv)
+{
+	if (ctx == NULL || iv == NULL)
+		return AES_ERR_ARGUMENT;
+	memcpy(ctx->iv, iv, AES_BLOCK_SIZE);
+	return AES_OK;
+}
+
+
+AES_API size_t aes_encrypt_size (size_t len)
+{
+	return len - (len % AES_BLOCK_SIZE) + AES_BLOCK_SIZE;
+}
+
+
+/*
+**  Whole-message encryption. out may be the same buffer as in: each
+**  block is read before it is overwritten.
+*/
+
+AES_API int aes_encrypt (const aes_ctx *ctx, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen)
+{
+	if (ctx == NULL || outlen == NULL || (in == NULL && inlen > 0) || out == NULL)
+		return AES_ERR_ARGUMENT;
+	size_t need = aes_encrypt_size(inlen);
+	if (*outlen < need) {
+		*outlen = need;
+		return AES_ERR_BUFFER;
+	}
+
+	AESEngine& engine = ctx->engine;
+	bool cbc = engine.isModeCBC();
+	uint8_t chain[AES_BLOCK_SIZE];
+	memcpy(chain, ctx->iv, AES_BLOCK_SIZE);
+
+	size_t whole = inlen - (inlen % AES_BLOCK_SIZE);
+	for (size_t off = 0; off <= whole; off += AES_BLOCK_SIZE) {
+		uint8_t block[AES_BLOCK_SIZE];
+		if (off < whole) {
+			memcpy(block, in + off, AES_BLOCK_SIZE);
+		} else {
+			if (inlen > whole)
+				memcpy(block, in + off, inlen - whole);
+			AESEngine::pad(block, inlen - whole);
+		}
+		if (cbc)
+			AESEngine::encryptCBC(block, chain);
+		engine.cipherBlock(block);
+		if (cbc)
+			memcpy(chain, block, AES_BLOCK_SIZE);
+		memcpy(out + off, block, AES_BLOCK_SIZE);
+	}
+	memset(chain, 0, sizeof(chain));
+	*outlen = need;
+	return AES_OK;
+}
+
+
+AES_API int aes_decrypt (const aes_ctx *ctx, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen)
+{
+	if (ctx == NULL || outlen == NULL || in == NULL || out == NULL)
+		return AES_ERR_ARGUMENT;
+	if (inlen == 0 || (inlen % AES_BLOCK_SIZE) != 0)
+		return AES_ERR_LENGTH;
+	// the padding is only known once the last block is decrypted, so
+	// the room is checked against the most it can leave
+	if (*outlen < inlen - 1) {
+		*outlen = inlen - 1;
+		return AES_ERR_BUFFER;
+	}
+
+	AESEngine& engine = ctx->engine;
+	bool cbc = engine.isModeCBC();
+	uint8_t chain[AES_BLOCK_SIZE];
+	uint8_t ciphertext[AES_BLOCK_SIZE];
+	uint8_t block[AES_BLOCK_SIZE];
+	memcpy(chain, ctx->iv, AES_BLOCK_SIZE);
+
+	size_t last = inlen - AES_BLOCK_SIZE;
+	for (size_t off = 0; off <= last; off += AES_BLOCK_SIZE) {
+		memcpy(ciphertext, in + off, AES_BLOCK_SIZE);
+		memcpy(block, ciphertext, AES_BLOCK_SIZE);
+		engine.invCipherBlock(block);
+		if (cbc) {
+			AESEngine::decryptCBC(block, chain);
+			memcpy(chain, ciphertext, AES_BLOCK_SIZE);
+		}
+		if (off < last)
+			memcpy(out + off, block, AES_BLOCK_SIZE);
+	}
+	memset(chain, 0, sizeof(chain));
+
+	int ret = AES_OK;
+	try {
+		size_t n = AESEngine::unpad(block);
+		memcpy(out + last, block, n);
+		*outlen = last + n;
+	} catch (exception& e) {
+		ret = status(e);
+	}
+	memset(block, 0, sizeof(block));
+	if (ret != AES_OK)
+		memset(out, 0, last);
+	return ret;
+}
+
+
+/*
+**  Records go through in slices, so the descriptors can live on the
+**  stack. Those without room are left out of the slice.
+*/
+
+static int batch (const aes_ctx *ctx, aes_record *records, size_t n, bool decrypt)
+{
+	if (ctx == NULL || (records == NULL && n > 0))
+		return AES_ERR_ARGUMENT;
+
+	AESBatch batch(ctx->engine);
+	AESRecord slice[64];
+	aes_record *from[64];
+	int ret = AES_OK;
+	for (size_t base = 0; base < n; base += 64) {
+		size_t count = 0;
+		for (size_t k = base; k < n && k < base + 64; ++k) {
+			aes_record *r = &records[k];
+			if ((r->in == NULL && r->inlen > 0) || r->out == NULL) {
+				r->status = AES_ERR_ARGUMENT;
+			} else if (decrypt ? (r->inlen > 0 && r->outlen < r->inlen - 1)
+					: r->outlen < aes_encrypt_size(r->inlen)) {
+				r->outlen = decrypt ? r->inlen - 1 : aes_encrypt_size(r->inlen);
+				r->status = AES_ERR_BUFFER;
+			} else {
+				AESRecord& a = slice[count];
+				a.in = r->in;
+				a.len = r->inlen;
+				a.out = r->out;
+				a.iv = (r->iv != NULL) ? r->iv : ctx->iv;
+				from[count++] = r;
+				continue;
+			}
+			if (ret == AES_OK)
+				ret = r->status;
+		}
+
+		if (decrypt)
+			batch.decrypt(slice, count);
+		else
+			batch.encrypt(slice, count);
+
+		for (size_t k = 0; k < count; ++k) {
+			aes_record *r = from[k];
+			r->outlen = slice[k].outlen;
+			r->status = slice[k].valid ? AES_OK
+				: ((r->inlen % AES_BLOCK_SIZE) != 0 || r->inlen == 0) ? AES_ERR_LENGTH : AES_ERR_PADDING;
+			if (ret == AES_OK)
+				ret = r->status;
+		}
+	}
+	return ret;
+}
+
+
+AES_API int aes_encrypt_batch (const aes_ctx *ctx, aes_record *records, size_t n)
+{
+	return batch(ctx, records, n, false);
+}
+
+
+AES_API int aes_decrypt_batch (const aes_ctx *ctx, aes_record *records, size_t n)
+{
+	return batch(ctx, records, n, true);
+}
+
+
+//            m
+//    mmm   mm#mm   m mm   mmm    mmm   mmmmm
+//   #   "    #     #"  " #"  #  "   #  # # #
+//    """m    #     #     #""""  m"""#  # # #
+//   "mmm"    "mm   #     "#mm"  "mm"#  # # #
+//
+
+
+AES_API int aes_stream_new (aes_stream **stream, const aes_ctx *ctx, int direction)
+{
+	if (stream == NULL || ctx == NULL || (direction != AES_ENCRYPT && direction != AES_DECRYPT))
+		return AES_ERR_ARGUMENT;
+	*stream = NULL;
+	try {
+		*stream = new aes_stream(ctx,
+			direction == AES_ENCRYPT ? AESStream::ENCRYPT : AESStream::DECRYPT);
+	} catch (exception& e) {
+		return status(e);
+	}
+	return AES_OK;
+}
+
+
+AES_API void aes_stream_free (aes_stream *stream)
+{
+	delete stream;
+}
+
+
+AES_API int aes_stream_update (aes_stream *stream, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen)
+{
+	if (stream == NULL || outlen == NULL || (in == NULL && inlen > 0) || out == NULL)
+		return AES_ERR_ARGUMENT;
+	if (*outlen < inlen + AES_BLOCK_SIZE) {
+		*outlen = inlen + AES_BLOCK_SIZE;
+		return AES_ERR_BUFFER;
+	}
+	try {
+		*outlen = (inlen > 0) ? stream->stream.update(in, inlen, out) : 0;
+	} catch (exception& e) {
+		return status(e);
+	}
+	return AES_OK;
+}
+
+
+AES_API int aes_stream_final (aes_stream *stream, uint8_t *out, size_t *outlen)
+{
+	if (stream == NULL || outlen == NULL || out == NULL)
+		return AES_ERR_ARGUMENT;
+	if (*outlen < AES_BLOCK_SIZE) {
+		*outlen = AES_BLOCK_SIZE;
+		return AES_ERR_BUFFER;
+	}
+	try {
+		*outlen = stream->stream.final(out);
+	} catch (exception& e) {
+		return status(e);
+	}
+	return AES_OK;
+}
+
+
+//            m
+//    mmm   mm#mm   m mm
+//   #"  "    #     #"  "
+//   #        #     #
+//   "#mm"    "mm   #
+//
+
+
+AES_API int aes_ctr_new (aes_ctr **ctr, const aes_ctx *ctx, const uint8_t *iv, size_t cachelen)
+{
+	if (ctr == NULL || ctx == NULL || iv == NULL)
+		return AES_ERR_ARGUMENT;
+	*ctr = NULL;
+	try {
+		*ctr = new aes_ctr(ctx, iv, cachelen);
+	} catch (exception& e) {
+		return status(e);
+	}
+	return AES_OK;
+}
+
+
+AES_API void aes_ctr_free (aes_ctr *ctr)
+{
+	delete ctr;
+}
+
+
+AES_API int aes_ctr_encrypt (aes_ctr *ctr, const uint8_t *in, size_t inlen,
+	uint8_t *out, uint8_t *counter)
+{
+	if (ctr == NULL || counter == NULL || ((in == NULL || out == NULL) && inlen > 0))
+		return AES_ERR_ARGUMENT;
+	ctr->keystream.encrypt(in, inlen, out, counter);
+	return AES_OK;
+}
+
+
+AES_API int aes_ctr_decrypt (const aes_ctx *ctx, const uint8_t *counter,
+	const uint8_t *in, size_t inlen, uint8_t *out)
+{
+	if (ctx == NULL || counter == NULL || ((in == NULL || out == NULL) && inlen > 0))
+		return AES_ERR_ARGUMENT;
+	AESKeystream::transform(ctx->engine, counter, in, inlen, out);
+	return AES_OK;
+}
@@ -0,0 +1,129 @@
+#ifndef LIBAES_H
+#define LIBAES_H
+
+/*
+**  C interface to the AES engine, for linking against libaes.so or
+**  libaes.a. Only what is declared here is exported. The values of the
+**  constants are part of the ABI and never change meaning; new ones are
+**  only ever added, and AES_ABI_VERSION goes up when that happens.
+**
+**  Contexts hold an expanded key and an IV. The buffer functions treat
+**  each call as a whole message (PKCS#7 padded) starting from the
+**  context's IV, and leave the context as it was, so one context can be
+**  shared by threads for them. Streams are independent copies of a
+**  context with their own chaining state, for one message each.
+**
+**  The batch functions do many small messages in one call, each with its
+**  own IV and status.
+**
+**  Counter mode contexts keep keystream for one key ready ahead of use,
+**  computed by a background thread, for latency-bound small messages.
+**
+**  Functions return AES_OK or a negative AES_ERR_ value; aes_strerror()
+**  describes it.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define AES_API
+#elif defined(__GNUC__)
+#define AES_API __attribute__((visibility("default")))
+#else
+#define AES_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define AES_ABI_VERSION 3
+#define AES_BLOCK_BYTES 16
+
+#define AES_MODE_128_ECB 0
+#define AES_MODE_192_ECB 1
+#define AES_MODE_256_ECB 2
+#define AES_MODE_128_CBC 3
+#define AES_MODE_192_CBC 4
+#define AES_MODE_256_CBC 5
+
+#define AES_ENCRYPT 0
+#define AES_DECRYPT 1
+
+#define AES_OK 0
+#define AES_ERR_ARGUMENT -1
+#define AES_ERR_MODE -2
+#define AES_ERR_KEY -3
+#define AES_ERR_LENGTH -4
+#define AES_ERR_PADDING -5
+#define AES_ERR_BUFFER -6
+#define AES_ERR_MEMORY -7
+#define AES_ERR_INTERNAL -8
+
+
+typedef struct aes_ctx aes_ctx;
+typedef struct aes_stream aes_stream;
+typedef struct aes_ctr aes_ctr;
+
+typedef struct aes_record {
+	const uint8_t *in;
+	size_t inlen;
+	uint8_t *out;
+	size_t outlen;
+	const uint8_t *iv;
+	int status;
+} aes_record;
+
+
+AES_API int aes_abi_version (void);
+AES_API const char *aes_strerror (int status);
+
+/* keylen must be 16, 24 or 32 to match the mode; the IV starts at zero */
+AES_API int aes_ctx_new (aes_ctx **ctx, int mode, const uint8_t *key, size_t keylen);
+AES_API void aes_ctx_free (aes_ctx *ctx);
+AES_API int aes_ctx_set_iv (aes_ctx *ctx, const uint8_t *iv);
+
+/* the most bytes encrypting len bytes can produce */
+AES_API size_t aes_encrypt_size (size_t len);
+
+/* *outlen is the room at out on the way in, the bytes written on the way out;
+   decryption needs room for inlen - 1 bytes, checked before it starts */
+AES_API int aes_encrypt (const aes_ctx *ctx, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen);
+AES_API int aes_decrypt (const aes_ctx *ctx, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen);
+
+/* each record is a whole message like the above, in to out with outlen
+   the room on the way in and the bytes written on the way out; iv NULL
+   means the context's. Decryption needs room for inlen - 1 bytes, as
+   above. The result is AES_OK or the first record's error. Since 3 */
+AES_API int aes_encrypt_batch (const aes_ctx *ctx, aes_record *records, size_t n);
+AES_API int aes_decrypt_batch (const aes_ctx *ctx, aes_record *records, size_t n);
+
+/* update needs room for inlen + AES_BLOCK_BYTES, final for AES_BLOCK_BYTES;
+   in and out must not overlap */
+AES_API int aes_stream_new (aes_stream **stream, const aes_ctx *ctx, int direction);
+AES_API void aes_stream_free (aes_stream *stream);
+AES_API int aes_stream_update (aes_stream *stream, const uint8_t *in, size_t inlen,
+	uint8_t *out, size_t *outlen);
+AES_API int aes_stream_final (aes_stream *stream, uint8_t *out, size_t *outlen);
+
+/* keystream from the base counter iv on, cachelen bytes of it kept ready
+   (none if 0); iv must never be used twice with a key. encrypt writes the
+   AES_BLOCK_BYTES counter block the message starts at, which decrypt
+   needs. Output is as long as input, and out may be in. Since 2 */
+AES_API int aes_ctr_new (aes_ctr **ctr, const aes_ctx *ctx, const uint8_t *iv, size_t cachelen);
+AES_API void aes_ctr_free (aes_ctr *ctr);
+AES_API int aes_ctr_encrypt (aes_ctr *ctr, const uint8_t *in, size_t inlen,
+	uint8_t *out, uint8_t *counter);
+AES_API int aes_ctr_decrypt (const aes_ctx *ctx, const uint8_t *counter,
+	const uint8_t *in, size_t inlen, uint8_t *out);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
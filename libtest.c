@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libaes.h"
+
+
+/*
+**  Exercises libaes through its C interface only, the way a client
+**  service would link it.
+*/
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("FAIL\n\t%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			return 1; \
+		} \
+	} while (0)
+
+
+static const uint8_t FIPS_KEY[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static const uint8_t FIPS_PLAIN[16] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+
+static const uint8_t FIPS_CIPHER[16] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+	0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+};
+
+
+static int test_buffer (void)
+{
+	aes_ctx *ctx;
+	uint8_t out[64];
+	size_t outlen = sizeof(out);
+
+	CHECK(aes_ctx_new(&ctx, AES_MODE_128_ECB, FIPS_KEY, 15) == AES_ERR_KEY);
+	CHECK(aes_ctx_new(&ctx, 42, FIPS_KEY, 16) == AES_ERR_MODE);
+	CHECK(aes_ctx_new(&ctx, AES_MODE_128_ECB, FIPS_KEY, 16) == AES_OK);
+
+	CHECK(aes_encrypt(ctx, FIPS_PLAIN, 16, out, &outlen) == AES_OK);
+	CHECK(outlen == 32 && aes_encrypt_size(16) == 32);
+	CHECK(memcmp(out, FIPS_CIPHER, 16) == 0);
+
+	outlen = sizeof(out);
+	CHECK(aes_decrypt(ctx, out, 32, out, &outlen) == AES_OK);
+	CHECK(outlen == 16 && memcmp(out, FIPS_PLAIN, 16) == 0);
+
+	outlen = 8;
+	CHECK(aes_encrypt(ctx, FIPS_PLAIN, 16, out, &outlen) == AES_ERR_BUFFER && outlen == 32);
+	outlen = sizeof(out);
+	CHECK(aes_decrypt(ctx, out, 17, out, &outlen) == AES_ERR_LENGTH);
+	outlen = 16;
+	CHECK(aes_decrypt(ctx, out, 32, out + 32, &outlen) == AES_ERR_BUFFER && outlen == 31);
+
+	memset(out, 0, 16);
+	outlen = sizeof(out);
+	CHECK(aes_decrypt(ctx, FIPS_CIPHER, 16, out, &outlen) == AES_ERR_PADDING);
+
+	aes_ctx_free(ctx);
+	return 0;
+}
+
+
+static int test_stream (void)
+{
+	uint8_t key[32];
+	uint8_t iv[AES_BLOCK_BYTES];
+	uint8_t plain[1000];
+	uint8_t whole[1024];
+	uint8_t pieces[1024 + AES_BLOCK_BYTES];
+	uint8_t back[1024 + AES_BLOCK_BYTES];
+	size_t k;
+
+	for (k = 0; k < sizeof(key); ++k)
+		key[k] = (uint8_t)rand();
+	for (k = 0; k < sizeof(iv); ++k)
+		iv[k] = (uint8_t)rand();
+	for (k = 0; k < sizeof(plain); ++k)
+		plain[k] = (uint8_t)rand();
+
+	aes_ctx *ctx;
+	CHECK(aes_ctx_new(&ctx, AES_MODE_256_CBC, key, 32) == AES_OK);
+	CHECK(aes_ctx_set_iv(ctx, iv) == AES_OK);
+
+	size_t wholelen = sizeof(whole);
+	CHECK(aes_encrypt(ctx, plain, sizeof(plain), whole, &wholelen) == AES_OK);
+
+	aes_stream *enc;
+	CHECK(aes_stream_new(&enc, ctx, AES_ENCRYPT) == AES_OK);
+	size_t total = 0;
+	for (k = 0; k < sizeof(plain); ) {
+		size_t n = (size_t)(rand() % 40);
+		if (n > sizeof(plain) - k)
+			n = sizeof(plain) - k;
+		size_t outlen = sizeof(pieces) - total;
+		CHECK(aes_stream_update(enc, plain + k, n, pieces + total, &outlen) == AES_OK);
+		total += outlen;
+		k += n;
+	}
+	size_t outlen = sizeof(pieces) - total;
+	CHECK(aes_stream_final(enc, pieces + total, &outlen) == AES_OK);
+	total += outlen;
+	aes_stream_free(enc);
+	CHECK(total == wholelen && memcmp(whole, pieces, total) == 0);
+
+	aes_stream *dec;
+	CHECK(aes_stream_new(&dec, ctx, AES_DECRYPT) == AES_OK);
+	size_t plen = sizeof(back);
+	CHECK(aes_stream_update(dec, whole, wholelen, back, &plen) == AES_OK);
+	outlen = sizeof(back) - plen;
+	CHECK(aes_stream_final(dec, back + plen, &outlen) == AES_OK);
+	plen += outlen;
+	aes_stream_free(dec);
+	CHECK(plen == sizeof(plain) && memcmp(back, plain, plen) == 0);
+
+	aes_ctx_free(ctx);
+	return 0;
+}
+
+
+static int test_batch (void)
+{
+	uint8_t iv[AES_BLOCK_BYTES];
+	uint8_t plain[20][200];
+	uint8_t sealed[20][208];
+	aes_record records[20];
+	size_t k, j;
+
+	for (k = 0; k < sizeof(iv); ++k)
+		iv[k] = (uint8_t)rand();
+	aes_ctx *ctx;
+	CHECK(aes_ctx_new(&ctx, AES_MODE_128_CBC, FIPS_KEY, 16) == AES_OK);
+	CHECK(aes_ctx_set_iv(ctx, iv) == AES_OK);
+
+	for (k = 0; k < 20; ++k) {
+		for (j = 0; j < sizeof(plain[k]); ++j)
+			plain[k][j] = (uint8_t)rand();
+		records[k].in = plain[k];
+		records[k].inlen = 10 * k;
+		records[k].out = sealed[k];
+		records[k].outlen = sizeof(sealed[k]);
+		records[k].iv = (k % 2 == 0) ? NULL : plain[k];
+	}
+	records[7].outlen = 16;
+	CHECK(aes_encrypt_batch(ctx, records, 20) == AES_ERR_BUFFER);
+	CHECK(records[7].status == AES_ERR_BUFFER && records[7].outlen == 80);
+
+	for (k = 0; k < 20; ++k) {
+		if (k == 7)
+			continue;
+		uint8_t single[208];
+		size_t len = sizeof(single);
+		CHECK(records[k].status == AES_OK && records[k].outlen == aes_encrypt_size(10 * k));
+		if (records[k].iv != NULL)
+			aes_ctx_set_iv(ctx, records[k].iv);
+		CHECK(aes_encrypt(ctx, plain[k], 10 * k, single, &len) == AES_OK);
+		aes_ctx_set_iv(ctx, iv);
+		CHECK(len == records[k].outlen && memcmp(single, sealed[k], len) == 0);
+
+		records[k].in = sealed[k];
+		records[k].inlen = records[k].outlen;
+		records[k].outlen = sizeof(sealed[k]);
+	}
+	records[7].inlen = 0;
+	CHECK(aes_decrypt_batch(ctx, records, 20) == AES_ERR_LENGTH);
+	for (k = 0; k < 20; ++k) {
+		if (k == 7)
+			continue;
+		CHECK(records[k].status == AES_OK && records[k].outlen == 10 * k);
+		CHECK(memcmp(sealed[k], plain[k], 10 * k) == 0);
+	}
+
+	aes_ctx_free(ctx);
+	return 0;
+}
+
+
+static int test_ctr (void)
+{
+	uint8_t iv[AES_BLOCK_BYTES];
+	uint8_t counter[AES_BLOCK_BYTES];
+	uint8_t previous[AES_BLOCK_BYTES];
+	uint8_t message[200];
+	uint8_t sealed[200];
+	size_t k;
+	int n;
+
+	for (k = 0; k < sizeof(iv); ++k)
+		iv[k] = (uint8_t)rand();
+
+	aes_ctx *ctx;
+	aes_ctr *ctr;
+	CHECK(aes_ctx_new(&ctx, AES_MODE_128_ECB, FIPS_KEY, 16) == AES_OK);
+	CHECK(aes_ctr_new(&ctr, ctx, iv, 4096) == AES_OK);
+
+	for (n = 0; n < 100; ++n) {
+		for (k = 0; k < sizeof(message); ++k)
+			message[k] = (uint8_t)rand();
+		CHECK(aes_ctr_encrypt(ctr, message, sizeof(message), sealed, counter) == AES_OK);
+		CHECK(n == 0 || memcmp(counter, previous, sizeof(counter)) != 0);
+		memcpy(previous, counter, sizeof(counter));
+		CHECK(aes_ctr_decrypt(ctx, counter, sealed, sizeof(sealed), sealed) == AES_OK);
+		CHECK(memcmp(sealed, message, sizeof(message)) == 0);
+	}
+
+	aes_ctr_free(ctr);
+	aes_ctx_free(ctx);
+	return 0;
+}
+
+
+int main (void)
+{
+	printf("Running library tests ...\n");
+
+	printf("\ttesting ABI version ... ");
+	CHECK(aes_abi_version() == AES_ABI_VERSION);
+	printf("PASS\n");
+
+	printf("\ttesting buffer API ... ");
+	if (test_buffer() != 0)
+		return 1;
+	printf("PASS\n");
+
+	printf("\ttesting stream API ... ");
+	if (test_stream() != 0)
+		return 1;
+	printf("PASS\n");
+
+	printf("\ttesting batch API ... ");
+	if (test_batch() != 0)
+		return 1;
+	printf("PASS\n");
+
+	printf("\ttesting counter mode API ... ");
+	if (test_ctr() != 0)
+		return 1;
+	printf("PASS\n");
+
+	return 0;
+}
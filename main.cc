@@ -1,13 +1,37 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <set>
+#include <chrono>
+#include <memory>
 
 #include <cstdlib>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
 
 #include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #include "aes.h"
+#include "kat.h"
+#include "parallel.h"
+#include "arena.h"
+#include "tune.h"
+#include "compress.h"
+#include "daemon.h"
+#include "perf.h"
+#include "keystream.h"
+#include "drbg.h"
+#include "tree.h"
+#include "async.h"
+#include "throttle.h"
+#include "direct.h"
+#include "fanout.h"
 
 
 typedef struct args_struct {
@@ -16,9 +40,41 @@ typedef struct args_struct {
 	char opmode;
 	AESEngine::AESMode mode;
 	vector<uint8_t> key;
+	vector<uint8_t> mackey;
+	vector<uint8_t> newkey;
+	const char *tagfile;
+	const char *socket;
+	const char *keydir;
+	string keyfile;
+	unsigned int threads;
+	size_t chunk;
+	AESEngine::Backend backend;
+	bool compress;
+	bool tree;
+	bool perf;
+	bool streamed;
+	uint64_t count;
+	bool ranged;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t rate;
+	double share;
+	bool lowpriority;
+	AESThrottle *throttle;
+	bool direct;
+	vector<vector<uint8_t>> fankeys;
+	vector<const char *> fanouts;
+
+	// set on the command line, so not taken from the tuning profile
+	bool threadsset;
+	bool chunkset;
+	bool backendset;
+	bool retune;
 
 	FILE *infile;
 	FILE *outfile;
+	bool inplace;
+	string outpath;
 
 	args_struct ()
 	{
@@ -26,14 +82,147 @@ typedef struct args_struct {
 		opmode = '-';
 		mode = AESEngine::AESMode::AES_128_ECB;
 		key = vector<uint8_t>(AESEngine::keySize(mode));
+		tagfile = NULL;
+		socket = NULL;
+		keydir = ".";
+		threads = 1;
+		chunk = AES_CHUNK_SIZE;
+		backend = AESEngine::AES_BACKEND_AUTO;
+		compress = false;
+		tree = false;
+		perf = false;
+		streamed = false;
+		count = 0;
+		ranged = false;
+		offset = 0;
+		length = 0;
+		rate = 0;
+		share = 0;
+		lowpriority = false;
+		throttle = NULL;
+		direct = false;
+
+		threadsset = false;
+		chunkset = false;
+		backendset = false;
+		retune = false;
 
 		infile = stdin;
 		outfile = stdout;
+		inplace = false;
 	}
 
 } args_type;
 
 
+/*
+**  Output over the input file is only allowed for r, which then writes a
+**  new file next to it and renames it over the input once it is complete,
+**  so the output is not opened here.
+*/
+
+bool open_files (args_type& args, const char *inpath, const char *outpath)
+{
+	struct stat in, out;
+	args.inplace = (inpath != NULL && outpath != NULL
+		&& stat(inpath, &in) == 0 && stat(outpath, &out) == 0
+		&& in.st_dev == out.st_dev && in.st_ino == out.st_ino);
+	if (args.inplace && args.opmode != 'r') {
+		fprintf(stderr, "only r can write over its input: %s\n", outpath);
+		return false;
+	}
+
+	if (inpath != NULL) {
+		args.infile = fopen(inpath, "rb");
+		if (args.infile == NULL) {
+			fprintf(stderr, "unable to open input file: %s\n", inpath);
+			return false;
+		}
+	}
+	if (args.inplace) {
+		args.outpath = outpath;
+	} else if (outpath != NULL) {
+		args.outfile = fopen(outpath, "wb");
+		if (args.outfile == NULL) {
+			fprintf(stderr, "unable to open output file: %s\n", outpath);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+**  OFFSET:LENGTH, both in bytes of plaintext.
+*/
+
+bool parse_range (const char *arg, args_type& args)
+{
+	char *end;
+	args.offset = strtoull(arg, &end, 10);
+	if (end == arg || *end != ':')
+		return false;
+	const char *len = end + 1;
+	args.length = strtoull(len, &end, 10);
+	if (end == len || *end != '\0')
+		return false;
+	args.ranged = true;
+	return true;
+}
+
+
+/*
+**  A byte count: digits, with an optional K, M or G for powers of 1024.
+*/
+
+bool parse_size (const char *arg, uint64_t& n)
+{
+	if (!isdigit((unsigned char)*arg))
+		return false;
+	char *end;
+	errno = 0;
+	n = strtoull(arg, &end, 10);
+	if (errno == ERANGE)
+		return false;
+	const char *units = "KMG";
+	const char *unit = (*end != '\0') ? strchr(units, toupper(*end)) : NULL;
+	if (unit != NULL) {
+		for (const char *u = units; u <= unit; ++u) {
+			if (n > UINT64_MAX / 1024)
+				return false;
+			n *= 1024;
+		}
+		++end;
+	}
+	return *end == '\0';
+}
+
+
+/*
+**  A thread count: digits only, 0 for every core.
+*/
+
+bool parse_threads (const char *arg, unsigned int& n)
+{
+	if (!isdigit((unsigned char)*arg))
+		return false;
+	char *end;
+	errno = 0;
+	unsigned long count = strtoul(arg, &end, 10);
+	if (errno == ERANGE || *end != '\0' || count > AES_MAX_THREADS)
+		return false;
+	n = count;
+	return true;
+}
+
+
+bool parse_rate (const char *arg, args_type& args)
+{
+	return parse_size(arg, args.rate) && args.rate != 0;
+}
+
+
 bool parse_args (int argc, char *argv[], args_type& args)
 {
 	args.mode = AESEngine::AESMode::AES_128_ECB;
@@ -42,9 +231,14 @@ bool parse_args (int argc, char *argv[], args_type& args)
 	string mode = "ecb";
 	int size = 128;
 	string keyfilename;
+	string newkeyfilename;
+	string mackeyfilename;
+	string backend = "auto";
+	const char *inpath = NULL;
+	const char *outpath = NULL;
 
 	int c;
-	while ((c = getopt(argc, argv, "m:s:k:i:o:v")) != -1) {
+	while ((c = getopt(argc, argv, "m:s:k:i:o:t:a:j:c:b:S:K:n:R:r:L:zMDHPTlv")) != -1) {
 		switch (c) {
 			case 'm':
 				mode = optarg;
@@ -55,12 +249,90 @@ bool parse_args (int argc, char *argv[], args_type& args)
 			case 'v':
 				args.verbose = true;
 				break;
+			case 't':
+				args.tagfile = optarg;
+				break;
+			case 'a':
+				mackeyfilename = optarg;
+				break;
+			case 'j':
+				if (!parse_threads(optarg, args.threads)) {
+					fprintf(stderr, "invalid thread count: %s\n", optarg);
+					return false;
+				}
+				args.threadsset = true;
+				break;
+			case 'c':
+				args.chunk = strtoul(optarg, NULL, 10);
+				args.chunkset = true;
+				if (args.chunk < AES_BLOCK_SIZE) {
+					fprintf(stderr, "invalid chunk size: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'b':
+				backend = tolowercase(string(optarg));
+				args.backendset = true;
+				break;
+			case 'T':
+				args.retune = true;
+				break;
+			case 'z':
+				args.compress = true;
+				break;
+			case 'M':
+				args.tree = true;
+				break;
+			case 'D':
+				args.direct = true;
+				break;
+			case 'R':
+				if (!parse_range(optarg, args)) {
+					fprintf(stderr, "invalid range: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'r':
+				if (!parse_rate(optarg, args)) {
+					fprintf(stderr, "invalid rate: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'L':
+				args.share = atof(optarg) / 100;
+				if (args.share <= 0 || args.share > 1) {
+					fprintf(stderr, "invalid share: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'l':
+				args.lowpriority = true;
+				break;
+			case 'S':
+				args.socket = optarg;
+				break;
+			case 'K':
+				args.keydir = optarg;
+				break;
+			case 'P':
+				args.perf = true;
+				break;
+			case 'n':
+				if (!parse_size(optarg, args.count)) {
+					fprintf(stderr, "invalid byte count: %s\n", optarg);
+					return false;
+				}
+				args.streamed = true;
+				break;
+			case 'H':
+				AESBufferArena::useHugePages(true);
+				break;
 			case 'i':
-				fprintf(stderr, "not yet implemented\n");
-				return false;
+				inpath = optarg;
+				break;
 			case 'o':
-				fprintf(stderr, "not yet implemented\n");
-				return false;
+				outpath = optarg;
+				break;
 			default:
 				fprintf(stderr, "unknown arg: %c\n", c);
 				return false;
@@ -100,17 +372,54 @@ bool parse_args (int argc, char *argv[], args_type& args)
 		return false;
 	}
 
+	if (backend == "auto") {
+		args.backend = AESEngine::AES_BACKEND_AUTO;
+	} else if (backend == "table") {
+		args.backend = AESEngine::AES_BACKEND_TABLE;
+	} else if (backend == "vperm") {
+		args.backend = AESEngine::AES_BACKEND_VPERM;
+	} else {
+		fprintf(stderr, "unknown backend: %s\n", backend.c_str());
+		return false;
+	}
+	if (!AESEngine::backendAvailable(args.backend)) {
+		fprintf(stderr, "backend not supported on this CPU: %s\n", backend.c_str());
+		return false;
+	}
+
 	for (int k = optind; k < argc; ++k) {
 		if (k == optind) {
 			args.opmode = argv[k][0];
+		} else if (args.opmode == 'f' && (k - optind) % 2 == 1) {
+			args.fankeys.push_back(AESEngine::loadKey(argv[k], args.mode));
+		} else if (args.opmode == 'f') {
+			args.fanouts.push_back(argv[k]);
 		} else if (k == optind + 1) {
 			keyfilename = argv[k];
+		} else if (k == optind + 2 && args.opmode == 'r') {
+			newkeyfilename = argv[k];
 		} else {
 			fprintf(stderr, "passed unnamed arg %s\n", argv[k]);
 		}
 	}
 
-	return true;
+	if (!keyfilename.empty()) {
+		args.key = AESEngine::loadKey(keyfilename.c_str(), args.mode);
+		args.keyfile = keyfilename;
+	}
+	if (!mackeyfilename.empty()) {
+		args.mackey = AESEngine::loadKey(mackeyfilename.c_str(), args.mode);
+	}
+	if (!newkeyfilename.empty()) {
+		args.newkey = AESEngine::loadKey(newkeyfilename.c_str(), args.mode);
+	}
+
+	if (args.opmode == 'f' && outpath != NULL) {
+		fprintf(stderr, "f takes an output after each KEYFILE rather than -o\n");
+		return false;
+	}
+
+	return open_files(args, inpath, outpath);
 }
 
 
@@ -189,13 +498,829 @@ int runtests ()
 			return 1;
 	cout << "PASS" << endl;
 
+	cout << "\ttesting cmac ... ";
+	vector<uint8_t> msg(1000);
+	for (unsigned int k = 0; k < msg.size(); ++k)
+		msg[k] = (uint8_t)(0xff & rand());
+	uint8_t whole[AES_BLOCK_SIZE];
+	uint8_t pieces[AES_BLOCK_SIZE];
+	engine.cmacInit();
+	engine.cmacUpdate(&msg[0], msg.size());
+	engine.cmacFinal(whole);
+	engine.cmacInit();
+	for (size_t off = 0; off < msg.size(); ) {
+		size_t n = min((size_t)(rand() % 40), msg.size() - off);
+		engine.cmacUpdate(&msg[off], n);
+		off += n;
+	}
+	engine.cmacFinal(pieces);
+	if (!AESEngine::cmacVerify(whole, pieces))
+		return 1;
+	msg[500] ^= 1;
+	engine.cmacUpdate(&msg[0], msg.size());
+	engine.cmacFinal(pieces);
+	if (AESEngine::cmacVerify(whole, pieces))
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting arena ... ";
+	AESBufferArena arena(AES_CHUNK_SIZE, 4 * AES_CHUNK_SIZE);
+	vector<uint8_t *> leased;
+	uint8_t *buf;
+	while ((buf = arena.acquire()) != NULL) {
+		if (((uintptr_t)buf % 64) != 0 || !arena.owns(buf))
+			return 1;
+		leased.push_back(buf);
+	}
+	if (leased.size() != 4)
+		return 1;
+	arena.release(leased[2]);
+	if (arena.acquire() != leased[2] || arena.acquire() != NULL)
+		return 1;
+	for (unsigned int k = 0; k < leased.size(); ++k)
+		arena.release(leased[k]);
+	vector<thread> churn;
+	for (int t = 0; t < 4; ++t) {
+		churn.push_back(thread([&arena] {
+			for (int k = 0; k < 10000; ++k) {
+				uint8_t *b = arena.acquire();
+				if (b != NULL) {
+					b[0] = (uint8_t)k;
+					arena.release(b);
+				}
+			}
+		}));
+	}
+	for (unsigned int t = 0; t < churn.size(); ++t)
+		churn[t].join();
+	leased.clear();
+	while ((buf = arena.acquire()) != NULL)
+		leased.push_back(buf);
+	sort(leased.begin(), leased.end());
+	if (leased.size() != 4 || unique(leased.begin(), leased.end()) != leased.end())
+		return 1;
+	AESBuffer local(5000, true);
+	if (((uintptr_t)local.get() % AES_DIRECT_ALIGN) != 0 || local.get()[4999] != 0
+			|| AESBufferArena::shared(5000)->owns(local.get()))
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting stream ... ";
+	for (int trial = 0; trial < 16; ++trial) {
+		size_t len = rand() % 200;
+		vector<uint8_t> plain(len);
+		for (unsigned int k = 0; k < len; ++k)
+			plain[k] = (uint8_t)(0xff & rand());
+		vector<uint8_t> cipher(len + 2 * AES_BLOCK_SIZE);
+		vector<uint8_t> output(len + 2 * AES_BLOCK_SIZE);
+
+		AESEngine enc(AESEngine::AESMode::AES_128_CBC, key);
+		AESStream encstream(enc, AESStream::ENCRYPT);
+		size_t clen = 0;
+		for (size_t off = 0; off < len; ) {
+			size_t n = min((size_t)(rand() % 40), len - off);
+			clen += encstream.update(&plain[off], n, &cipher[clen]);
+			off += n;
+		}
+		clen += encstream.final(&cipher[clen]);
+		if (clen != (len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE)
+			return 1;
+
+		AESEngine dec(AESEngine::AESMode::AES_128_CBC, key);
+		AESStream decstream(dec, AESStream::DECRYPT);
+		size_t plen = 0;
+		for (size_t off = 0; off < clen; ) {
+			size_t n = min((size_t)(rand() % 40), clen - off);
+			plen += decstream.update(&cipher[off], n, &output[plen]);
+			off += n;
+		}
+		plen += decstream.final(&output[plen]);
+		if (plen != len || !equal(plain.begin(), plain.end(), output.begin()))
+			return 1;
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting header ... ";
+	uint8_t head[AES_HEADER_SIZE];
+	AESHeader(AES_HEADER_ZLIB, 12345).write(head);
+	AESHeader header;
+	if (!header.read(head) || header.flags != AES_HEADER_ZLIB || header.chunk != 12345)
+		return 1;
+	head[0] ^= 1;
+	if (header.read(head))
+		return 1;
+	uint8_t rest[4] = { 'r', 'e', 's', 't' };
+	FILE *tail = fmemopen(rest, sizeof(rest), "r");
+	FILE *joined = unreadStream(head, AES_HEADER_SIZE, tail);
+	uint8_t joint[AES_HEADER_SIZE + sizeof(rest) + 1];
+	size_t got = readChunk(joint, sizeof(joint), joined);
+	fclose(joined);
+	fclose(tail);
+	if (got != AES_HEADER_SIZE + sizeof(rest) || memcmp(joint, head, AES_HEADER_SIZE) != 0
+			|| memcmp(joint + AES_HEADER_SIZE, rest, sizeof(rest)) != 0)
+		return 1;
+	AESEngine zero(AESEngine::AESMode::AES_128_ECB, vector<uint8_t>(16, 0));
+	FILE *oversized = fmemopen(rest, sizeof(rest), "r");
+	bool refused = false;
+	try {
+		AESCompressor(1).decryptFile(zero, AESHeader(AES_HEADER_ZLIB, 2 * AES_COMPRESS_CHUNK), oversized, NULL);
+	} catch (CorruptAESStream& e) {
+		refused = true;
+	}
+	fclose(oversized);
+	if (!refused)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting profile ... ";
+	char profilename[] = "/tmp/aes-profile-XXXXXX";
+	int fd = mkstemp(profilename);
+	if (fd < 0)
+		return 1;
+	close(fd);
+	AESProfile saved;
+	saved.backend = AESEngine::AES_BACKEND_TABLE;
+	saved.threads = 3;
+	saved.chunk = 4096;
+	AESProfile loaded;
+	bool roundtrip = saved.save(profilename) && loaded.load(profilename);
+	FILE *stale = fopen(profilename, "w");
+	fprintf(stale, "version 0\nbackend table\n");
+	fclose(stale);
+	AESProfile rejected;
+	bool reloaded = rejected.load(profilename);
+	unlink(profilename);
+	if (!roundtrip || reloaded || loaded.backend != saved.backend
+			|| loaded.threads != saved.threads || loaded.chunk != saved.chunk)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting keystream ... ";
+	block = random_block();
+	AESKeystream cache(engine, &block[0], 4096);
+	set<vector<uint8_t>> counters;
+	for (int k = 0; k < 200; ++k) {
+		while (k % 50 == 0 && cache.available() < 2048)
+			this_thread::yield();
+		vector<uint8_t> message(k == 199 ? 8000 : rand() % 300);
+		for (size_t j = 0; j < message.size(); ++j)
+			message[j] = rand();
+		vector<uint8_t> sealed(message.size());
+		vector<uint8_t> counter(AES_BLOCK_SIZE);
+		cache.encrypt(message.data(), message.size(), sealed.data(), &counter[0]);
+		AESKeystream::transform(engine, &counter[0], sealed.data(), sealed.size(), sealed.data());
+		if (sealed != message || (!message.empty() && !counters.insert(counter).second))
+			return 1;
+	}
+	if (cache.cacheHits() == 0 || cache.cacheMisses() == 0)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting rekey ... ";
+	static const AESEngine::AESMode PAIRS[][2] = {
+		{ AESEngine::AES_128_ECB, AESEngine::AES_256_ECB },
+		{ AESEngine::AES_128_ECB, AESEngine::AES_192_CBC },
+		{ AESEngine::AES_256_CBC, AESEngine::AES_128_ECB },
+		{ AESEngine::AES_192_CBC, AESEngine::AES_192_CBC }
+	};
+	for (unsigned int p = 0; p < sizeof(PAIRS) / sizeof(PAIRS[0]); ++p) {
+		for (unsigned int nthreads = 1; nthreads <= 3; nthreads += 2) {
+			vector<uint8_t> data(AES_BLOCK_SIZE * (1 + rand() % 500));
+			for (size_t j = 0; j < data.size(); ++j)
+				data[j] = rand();
+			vector<uint8_t> oldkey = AESEngine::generateKey(PAIRS[p][0]);
+			vector<uint8_t> newkey = AESEngine::generateKey(PAIRS[p][1]);
+			vector<uint8_t> rekeyed = data, expected = data;
+			AESEngine oldenc(PAIRS[p][0], oldkey), olddec(PAIRS[p][0], oldkey);
+			AESEngine newenc(PAIRS[p][1], newkey), target(PAIRS[p][1], newkey);
+			for (size_t off = 0; off < data.size(); off += AES_BLOCK_SIZE) {
+				oldenc.encryptBlock(&rekeyed[off]);
+				newenc.encryptBlock(&expected[off]);
+			}
+			AESParallel parallel(olddec, nthreads, 256);
+			parallel.rekey(target, &rekeyed[0], rekeyed.size());
+			if (rekeyed != expected)
+				return 1;
+		}
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting tree ... ";
+	for (unsigned int t = 0; t < 12; ++t) {
+		AESEngine::AESMode treemode = (t & 1) ? AESEngine::AES_128_CBC : AESEngine::AES_256_ECB;
+		AESEngine cipher(treemode, AESEngine::generateKey(treemode));
+		AESEngine treemac(treemode, AESEngine::generateKey(treemode));
+		size_t chunk = (t & 2) ? 64 : 256;
+		vector<uint8_t> data(t < 2 ? 0 : rand() % 5000);
+		for (size_t j = 0; j < data.size(); ++j)
+			data[j] = rand();
+
+		AESTree tree(cipher, treemac, (t & 4) ? 3 : 1, chunk);
+		FILE *plain = fmemopen(data.empty() ? NULL : &data[0], data.size(), "r");
+		FILE *sealed = tmpfile();
+		FILE *opened = tmpfile();
+		tree.encryptFile(plain, sealed);
+		fclose(plain);
+
+		uint64_t offset = data.empty() ? 0 : rand() % data.size();
+		uint64_t len = rand() % 1000;
+		tree.decryptFile(sealed, 0, opened);
+		tree.readRange(sealed, 0, opened, offset, len);
+		vector<uint8_t> expected(data);
+		expected.insert(expected.end(), data.begin() + offset,
+			data.begin() + min(data.size(), (size_t)(offset + len)));
+		vector<uint8_t> output(expected.size() + 1);
+		rewind(opened);
+		bool same = (readChunk(&output[0], output.size(), opened) == expected.size()
+			&& equal(expected.begin(), expected.end(), output.begin()));
+		fclose(opened);
+
+		// any flipped bit, in a chunk or the tree, is caught
+		fseeko(sealed, 0, SEEK_END);
+		long pos = AES_HEADER_SIZE + rand() % (ftello(sealed) - AES_HEADER_SIZE);
+		uint8_t byte;
+		fseeko(sealed, pos, SEEK_SET);
+		same = same && fread(&byte, 1, 1, sealed) == 1;
+		byte ^= 1 << (rand() % 8);
+		fseeko(sealed, pos, SEEK_SET);
+		fwrite(&byte, 1, 1, sealed);
+		bool caught = false;
+		try {
+			tree.verifyFile(sealed, 0);
+		} catch (CorruptAESTree&) {
+			caught = true;
+		}
+		fclose(sealed);
+		if (!same || !caught)
+			return 1;
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting drbg ... ";
+	vector<uint8_t> seed(AES_DRBG_SEED_SIZE, 0x42);
+	vector<uint8_t> first(100000), second(100000);
+	AESRandom same1(&seed[0]), same2(&seed[0]);
+	same1.generate(&first[0], first.size());
+	same2.generate(&second[0], second.size());
+	if (first != second)
+		return 1;
+	same2.reseed();
+	same1.generate(&first[0], 64);
+	same2.generate(&second[0], 64);
+	if (equal(first.begin(), first.begin() + 64, second.begin()))
+		return 1;
+	// a forked child must not repeat what its parent is about to produce
+	uint8_t parent[AES_BLOCK_SIZE], child[AES_BLOCK_SIZE];
+	AESRandom::fill(parent, sizeof(parent));
+	int fds[2];
+	if (pipe(fds) != 0)
+		return 1;
+	pid_t pid = fork();
+	if (pid == 0) {
+		AESRandom::fill(child, sizeof(child));
+		_exit(write(fds[1], child, sizeof(child)) == sizeof(child) ? 0 : 1);
+	}
+	close(fds[1]);
+	AESRandom::fill(parent, sizeof(parent));
+	ssize_t heard = read(fds[0], child, sizeof(child));
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	if (heard != sizeof(child) || memcmp(parent, child, sizeof(child)) == 0)
+		return 1;
+	cout << "PASS" << endl;
+
+	cout << "\ttesting direct ... ";
+	for (unsigned int t = 0; t < 6; ++t) {
+		static const size_t SIZES[] = { 0, 100, 4096, 4097, 12272, 70000 };
+		vector<uint8_t> data(SIZES[t]);
+		for (size_t j = 0; j < data.size(); ++j)
+			data[j] = rand();
+		AESEngine::AESMode directmode = (t & 1) ? AESEngine::AES_256_CBC : AESEngine::AES_128_ECB;
+		vector<uint8_t> directkey = AESEngine::generateKey(directmode);
+		AESEngine buffered(directmode, directkey), sender(directmode, directkey), receiver(directmode, directkey);
+		FILE *plain = tmpfile(), *sealed = tmpfile(), *opened = tmpfile();
+		if (!data.empty())
+			fwrite(&data[0], 1, data.size(), plain);
+		rewind(plain);
+		{
+			AESParallel forward(sender, 1 + t % 3, 1000), backward(receiver, 1 + t % 3, 1000);
+			AESDirectFile in(fileno(plain), false), out(fileno(sealed), true);
+			forward.encryptFile(in, out);
+			rewind(sealed);
+			AESDirectFile back(fileno(sealed), false), result(fileno(opened), true);
+			backward.decryptFile(back, result);
+		}
+		FILE *reference = tmpfile();
+		rewind(plain);
+		rewind(sealed);
+		rewind(opened);
+		buffered.encryptFile(plain, reference);
+		rewind(reference);
+		vector<uint8_t> expected(data.size() + 2 * AES_BLOCK_SIZE), ciphertext(expected.size());
+		vector<uint8_t> output(data.size() + 1);
+		size_t sealedlen = readChunk(&expected[0], expected.size(), reference);
+		bool same = (readChunk(&ciphertext[0], ciphertext.size(), sealed) == sealedlen
+			&& expected == ciphertext
+			&& readChunk(&output[0], output.size(), opened) == data.size()
+			&& equal(data.begin(), data.end(), output.begin()));
+		fclose(plain);
+		fclose(sealed);
+		fclose(opened);
+		fclose(reference);
+		if (!same)
+			return 1;
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting fanout ... ";
+	for (unsigned int t = 0; t < 8; ++t) {
+		static const AESEngine::AESMode FANMODES[] = {
+			AESEngine::AES_128_ECB, AESEngine::AES_256_CBC, AESEngine::AES_192_ECB,
+			AESEngine::AES_128_CBC, AESEngine::AES_192_CBC
+		};
+		vector<uint8_t> data(t < 2 ? t * 15 : rand() % 100000);
+		for (size_t j = 0; j < data.size(); ++j)
+			data[j] = rand();
+		vector<unique_ptr<AESEngine>> senders, references;
+		vector<AESEngine *> recipients;
+		vector<FILE *> fanned;
+		size_t nkeys = 1 + t % 5;
+		for (size_t k = 0; k < nkeys; ++k) {
+			vector<uint8_t> fankey = AESEngine::generateKey(FANMODES[k]);
+			senders.push_back(unique_ptr<AESEngine>(new AESEngine(FANMODES[k], fankey)));
+			references.push_back(unique_ptr<AESEngine>(new AESEngine(FANMODES[k], fankey)));
+			recipients.push_back(senders.back().get());
+			fanned.push_back(tmpfile());
+		}
+		FILE *plain = fmemopen(data.empty() ? NULL : &data[0], data.size(), "r");
+		AESFanout fanout(recipients, 1 + t % 4, 4096 + t * 16);
+		fanout.encryptFile(plain, fanned);
+
+		bool same = true;
+		for (size_t k = 0; k < nkeys; ++k) {
+			rewind(plain);
+			FILE *reference = tmpfile();
+			references[k]->encryptFile(plain, reference);
+			vector<uint8_t> expected(data.size() + 2 * AES_BLOCK_SIZE), output(expected.size());
+			rewind(reference);
+			rewind(fanned[k]);
+			size_t len = readChunk(&expected[0], expected.size(), reference);
+			same = same && readChunk(&output[0], output.size(), fanned[k]) == len && expected == output;
+			fclose(reference);
+			fclose(fanned[k]);
+		}
+		fclose(plain);
+		if (!same)
+			return 1;
+	}
+	cout << "PASS" << endl;
+
+	cout << "\ttesting throttle ... ";
+	vector<uint8_t> paced(2 << 20);
+	for (size_t j = 0; j < paced.size(); ++j)
+		paced[j] = rand();
+	vector<uint8_t> unpaced(paced.size() + AES_BLOCK_SIZE + 1);
+	AESThrottle throttle(8 << 20);
+	chrono::steady_clock::time_point began = chrono::steady_clock::now();
+	{
+		AESEngine sender(AESEngine::AES_128_CBC, key), receiver(AESEngine::AES_128_CBC, key);
+		AESParallel forward(sender, 3, 4096), backward(receiver, 3, 4096);
+		forward.setThrottle(&throttle);
+		backward.setThrottle(&throttle);
+		FILE *plain = fmemopen(&paced[0], paced.size(), "r");
+		FILE *sealed = tmpfile();
+		FILE *opened = fmemopen(&unpaced[0], unpaced.size(), "w");
+		forward.encryptFile(plain, sealed);
+		rewind(sealed);
+		backward.decryptFile(sealed, opened);
+		fclose(plain);
+		fclose(sealed);
+		fclose(opened);
+	}
+	// both ways at 8 MiB/s: half a second, give or take the bucket
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - began).count();
+	AESThrottle::Stats stats = throttle.stats();
+	if (!equal(paced.begin(), paced.end(), unpaced.begin()) || elapsed < 0.4
+			|| stats.bytes != 2 * paced.size() + AES_BLOCK_SIZE
+			|| stats.workers < 1 || stats.workers > 3)
+		return 1;
+	// the CPU the tests above spent is not this throttle's to pay back
+	AESThrottle fresh(0, 0.5);
+	began = chrono::steady_clock::now();
+	fresh.pace(AES_BLOCK_SIZE);
+	if (chrono::duration<double>(chrono::steady_clock::now() - began).count() > 0.2)
+		return 1;
+	cout << "PASS" << endl;
+
 	return 0;
 }
 
 
+bool write_tag (const char *filename, const uint8_t *tag)
+{
+	FILE *tf = fopen(filename, "wb");
+	if (tf == NULL) {
+		fprintf(stderr, "unable to open tag file: %s\n", filename);
+		return false;
+	}
+	size_t count = fwrite(tag, 1, AES_BLOCK_SIZE, tf);
+	fclose(tf);
+	return count == AES_BLOCK_SIZE;
+}
+
+
+bool read_tag (const char *filename, uint8_t *tag)
+{
+	FILE *tf = fopen(filename, "rb");
+	if (tf == NULL) {
+		fprintf(stderr, "unable to open tag file: %s\n", filename);
+		return false;
+	}
+	size_t count = fread(tag, 1, AES_BLOCK_SIZE, tf);
+	fclose(tf);
+	if (count != AES_BLOCK_SIZE) {
+		fprintf(stderr, "tag file too short: %s\n", filename);
+		return false;
+	}
+	return true;
+}
+
+
+void report_direct (args_type& args, AESDirectFile& in, AESDirectFile& out)
+{
+	if (args.verbose) {
+		fprintf(stderr, "input %s, output %s\n",
+			in.bypassing() ? "read with O_DIRECT" : "dropped from the page cache",
+			out.bypassing() ? "written with O_DIRECT" : "dropped from the page cache");
+	}
+}
+
+
+void encrypt_file (args_type& args, AESEngine& engine, AESEngine *mac)
+{
+	if (args.tree) {
+		AESTree tree(engine, *mac, args.threads, args.chunkset ? args.chunk : AES_TREE_CHUNK);
+		tree.encryptFile(args.infile, args.outfile);
+	} else if (args.compress) {
+		AESCompressor compressor(args.threads);
+		compressor.encryptFile(engine, args.infile, args.outfile, mac);
+	} else if (args.direct) {
+		AESParallel parallel(engine, args.threads, args.chunk);
+		parallel.setThrottle(args.throttle);
+		AESDirectFile in(fileno(args.infile), false), out(fileno(args.outfile), true);
+		report_direct(args, in, out);
+		parallel.encryptFile(in, out, mac);
+	} else if (args.threads != 1 || args.chunk != AES_CHUNK_SIZE || args.throttle != NULL) {
+		AESParallel parallel(engine, args.threads, args.chunk);
+		parallel.setThrottle(args.throttle);
+		parallel.encryptFile(args.infile, args.outfile, mac);
+	} else {
+		engine.encryptFile(args.infile, args.outfile, mac);
+	}
+}
+
+
+/*
+**  Tree-format input is read with random access, so it has to be a file;
+**  its chunks carry their own MACs, under the key given with -a (v falls
+**  back to KEYFILE, as it does for tags). v checks it without decrypting.
+*/
+
+bool decrypt_tree (args_type& args, AESEngine& engine, AESEngine& mac, const AESHeader& header, bool tagged)
+{
+	if (tagged || (args.opmode == 'd' && args.mackey.empty())) {
+		fprintf(stderr, "tree-format input requires a MAC key given with -a, and no -t\n");
+		return false;
+	}
+	off_t base = ftello(args.infile) - AES_HEADER_SIZE;
+	if (base < 0) {
+		fprintf(stderr, "tree-format input must be read from a file\n");
+		return false;
+	}
+
+	AESTree tree(engine, mac, args.threads, header.chunk);
+	if (args.opmode == 'v')
+		tree.verifyFile(args.infile, base);
+	else if (args.ranged)
+		tree.readRange(args.infile, base, args.outfile, args.offset, args.length);
+	else
+		tree.decryptFile(args.infile, base, args.outfile);
+	return true;
+}
+
+
+bool verify_tree (args_type& args, AESEngine& engine, AESEngine& mac)
+{
+	uint8_t peek[AES_HEADER_SIZE];
+	size_t count = readChunk(peek, AES_HEADER_SIZE, args.infile);
+	AESHeader header;
+	if (count != AES_HEADER_SIZE || !header.read(peek) || header.flags != AES_HEADER_TREE) {
+		fprintf(stderr, "v requires a tag file given with -t, unless the input is tree-format\n");
+		return false;
+	}
+	return decrypt_tree(args, engine, mac, header, false);
+}
+
+
+bool decrypt_file (args_type& args, AESEngine& engine, AESEngine& mac, bool tagged)
+{
+	// a header only precedes output that went through an extra stage
+	uint8_t peek[AES_HEADER_SIZE];
+	size_t count = readChunk(peek, AES_HEADER_SIZE, args.infile);
+	AESHeader header;
+	bool headed = (count == AES_HEADER_SIZE && header.read(peek));
+	if (headed && header.flags == AES_HEADER_TREE)
+		return decrypt_tree(args, engine, mac, header, tagged);
+	if (args.ranged) {
+		fprintf(stderr, "-R requires tree-format input\n");
+		return false;
+	}
+	if (headed) {
+		AESCompressor compressor(args.threads);
+		compressor.decryptFile(engine, header, args.infile, args.outfile, tagged ? &mac : NULL);
+		return true;
+	}
+	if (args.direct) {
+		// stdio read ahead for the peek, so the descriptor goes back to
+		// where the ciphertext begins
+		off_t at = ftello(args.infile);
+		if (at >= 0)
+			lseek(fileno(args.infile), at - count, SEEK_SET);
+		AESParallel parallel(engine, args.threads, args.chunk);
+		parallel.setThrottle(args.throttle);
+		AESDirectFile in(fileno(args.infile), false), out(fileno(args.outfile), true);
+		report_direct(args, in, out);
+		parallel.decryptFile(in, out, tagged ? &mac : NULL);
+		return true;
+	}
+
+	FILE *infile = unreadStream(peek, count, args.infile);
+	if (infile == NULL)
+		throw bad_alloc();
+	try {
+		if (args.threads != 1 || args.chunk != AES_CHUNK_SIZE || args.throttle != NULL) {
+			AESParallel parallel(engine, args.threads, args.chunk);
+			parallel.setThrottle(args.throttle);
+			parallel.decryptFile(infile, args.outfile, tagged ? &mac : NULL);
+		} else {
+			engine.decryptFile(infile, args.outfile, tagged ? &mac : NULL);
+		}
+	} catch (...) {
+		fclose(infile);
+		throw;
+	}
+	fclose(infile);
+	return true;
+}
+
+
+/*
+**  With -t and -a, the key is proven by the plaintext's tag in a pass of
+**  its own, before anything is written: a wrong key would otherwise only
+**  show when the last block's padding fails, and that passes by chance
+**  once in 256 times. The input has to be seekable. The pass is paced
+**  by -r and -L and, with -D, reads around the page cache too.
+*/
+
+bool check_tag (args_type& args, AESEngine& engine, const AESHeader *header, off_t start)
+{
+	uint8_t expected[AES_BLOCK_SIZE];
+	uint8_t tag[AES_BLOCK_SIZE];
+	if (args.mackey.empty()) {
+		fprintf(stderr, "-t requires a MAC key given with -a\n");
+		return false;
+	}
+	if (!read_tag(args.tagfile, expected))
+		return false;
+	if (fseeko(args.infile, start, SEEK_SET) != 0) {
+		fprintf(stderr, "r checks the tag in a pass of its own, so its input must be a file\n");
+		return false;
+	}
+
+	FILE *sink = fopen("/dev/null", "wb");
+	if (sink == NULL)
+		throw bad_alloc();
+	AESEngine copy(engine);
+	AESEngine mac(args.mode, args.mackey, args.backend);
+	mac.cmacInit();
+	try {
+		if (header != NULL) {
+			AESCompressor compressor(args.threads);
+			compressor.decryptFile(copy, *header, args.infile, sink, &mac);
+		} else if (args.direct) {
+			// the pass keeps out of the page cache like the one after it
+			if (lseek(fileno(args.infile), start, SEEK_SET) != start)
+				throw AESDirectException("unable to seek the input");
+			AESParallel parallel(copy, args.threads, args.chunk);
+			parallel.setThrottle(args.throttle);
+			AESDirectFile in(fileno(args.infile), false), out(fileno(sink), true);
+			parallel.decryptFile(in, out, &mac);
+		} else {
+			AESParallel parallel(copy, args.threads, args.chunk);
+			parallel.setThrottle(args.throttle);
+			parallel.decryptFile(args.infile, sink, &mac);
+		}
+	} catch (...) {
+		fclose(sink);
+		throw;
+	}
+	fclose(sink);
+	mac.cmacFinal(tag);
+	if (!AESEngine::cmacVerify(tag, expected)) {
+		fprintf(stderr, "tag mismatch: the key is wrong or the input is damaged\n");
+		return false;
+	}
+	return fseeko(args.infile, start, SEEK_SET) == 0;
+}
+
+
+/*
+**  d checks a tag before it writes any plaintext whenever the input can
+**  be read twice. A pipe cannot, so there the tag is only known once the
+**  output is written, and that output must be discarded on a mismatch.
+**  Tree-format input is left to decrypt_file, which refuses -t.
+*/
+
+bool verify_first (args_type& args, AESEngine& engine, bool& verified)
+{
+	verified = false;
+	off_t origin = ftello(args.infile);
+	if (origin < 0 || fseeko(args.infile, origin, SEEK_SET) != 0)
+		return true;
+
+	uint8_t peek[AES_HEADER_SIZE];
+	size_t count = readChunk(peek, AES_HEADER_SIZE, args.infile);
+	AESHeader header;
+	bool headed = (count == AES_HEADER_SIZE && header.read(peek));
+	if (!(headed && header.flags == AES_HEADER_TREE)) {
+		if (!check_tag(args, engine, headed ? &header : NULL, origin + (headed ? AES_HEADER_SIZE : 0)))
+			return false;
+		verified = true;
+	}
+	return fseeko(args.infile, origin, SEEK_SET) == 0;
+}
+
+
+/*
+**  Decrypts under KEYFILE and encrypts under the second key file in one
+**  pass. A header passes through unchanged: what follows it is ordinary
+**  ciphertext of the framed data. Over its own input, the output goes to
+**  a temporary file in the same directory, which replaces the input only
+**  once it is complete and on disk; a failure or a crash before then
+**  leaves the input as it was.
+*/
+
+int rekey_file (args_type& args, AESEngine& engine)
+{
+	if (args.newkey.empty()) {
+		fprintf(stderr, "r requires the new key file after the old one\n");
+		return EXIT_FAILURE;
+	}
+	AESEngine target(args.mode, args.newkey, args.backend);
+
+	uint8_t peek[AES_HEADER_SIZE];
+	size_t count = readChunk(peek, AES_HEADER_SIZE, args.infile);
+	AESHeader header;
+	size_t start = (count == AES_HEADER_SIZE && header.read(peek)) ? AES_HEADER_SIZE : 0;
+	if (start != 0 && header.flags == AES_HEADER_TREE) {
+		fprintf(stderr, "tree-format files cannot be rekeyed: their MACs cover the ciphertext\n");
+		return EXIT_FAILURE;
+	}
+	if (args.tagfile != NULL && !check_tag(args, engine, start != 0 ? &header : NULL, start))
+		return EXIT_FAILURE;
+
+	FILE *outfile = args.outfile;
+	string temppath;
+	if (args.inplace) {
+		temppath = args.outpath + ".rekey.XXXXXX";
+		int fd = mkstemp(&temppath[0]);
+		struct stat st;
+		if (fd >= 0 && fstat(fileno(args.infile), &st) == 0)
+			fchmod(fd, st.st_mode & 07777);
+		outfile = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+		if (outfile == NULL) {
+			fprintf(stderr, "unable to create a file next to %s\n", args.outpath.c_str());
+			if (fd >= 0) {
+				close(fd);
+				unlink(temppath.c_str());
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	// check_tag leaves the input just past the header; otherwise what was
+	// peeked goes back in front of it
+	fwrite(peek, 1, start, outfile);
+	FILE *infile = args.infile;
+	try {
+		if (args.tagfile == NULL)
+			infile = unreadStream(peek + start, count - start, args.infile);
+		if (infile == NULL)
+			throw bad_alloc();
+		AESParallel parallel(engine, args.threads, args.chunk);
+		parallel.setThrottle(args.throttle);
+		parallel.rekeyFile(target, infile, outfile);
+	} catch (...) {
+		if (infile != NULL && infile != args.infile)
+			fclose(infile);
+		if (args.inplace) {
+			fclose(outfile);
+			unlink(temppath.c_str());
+		}
+		throw;
+	}
+	if (infile != args.infile)
+		fclose(infile);
+
+	if (args.inplace) {
+		bool ok = (fflush(outfile) == 0 && fsync(fileno(outfile)) == 0);
+		ok = (fclose(outfile) == 0) && ok;
+		if (!ok || rename(temppath.c_str(), args.outpath.c_str()) != 0) {
+			fprintf(stderr, "unable to replace %s; it is unchanged\n", args.outpath.c_str());
+			unlink(temppath.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+
+/*
+**  Reads the input once and writes it encrypted under each KEYFILE to the
+**  OUTPUT after it. Every output is what e would write under its key.
+*/
+
+bool fan_out (args_type& args, AESEngine *mac)
+{
+	if (args.fankeys.empty() || args.fankeys.size() != args.fanouts.size()) {
+		fprintf(stderr, "f requires a KEYFILE OUTPUT pair for each recipient\n");
+		return false;
+	}
+	if (args.compress || args.tree || args.perf || args.ranged || args.throttle != NULL) {
+		fprintf(stderr, "-z, -M, -P, -R, -r and -L are not available with f\n");
+		return false;
+	}
+
+	// as in open_files, no output may be the input, which is checked before
+	// anything is truncated; nor may two outputs be the same file
+	struct stat in, out;
+	bool known = (fstat(fileno(args.infile), &in) == 0);
+	for (size_t k = 0; k < args.fanouts.size() && known; ++k) {
+		if (stat(args.fanouts[k], &out) == 0 && out.st_dev == in.st_dev && out.st_ino == in.st_ino) {
+			fprintf(stderr, "f cannot write over its input: %s\n", args.fanouts[k]);
+			return false;
+		}
+	}
+
+	vector<unique_ptr<AESEngine>> engines;
+	vector<AESEngine *> recipients;
+	vector<FILE *> outfiles;
+	vector<pair<dev_t, ino_t>> seen;
+	bool ok = true;
+	for (size_t k = 0; k < args.fankeys.size() && ok; ++k) {
+		engines.push_back(unique_ptr<AESEngine>(new AESEngine(args.mode, args.fankeys[k], args.backend)));
+		recipients.push_back(engines.back().get());
+		FILE *outfile = fopen(args.fanouts[k], "wb");
+		if (outfile == NULL) {
+			fprintf(stderr, "unable to open output file: %s\n", args.fanouts[k]);
+			ok = false;
+			break;
+		}
+		outfiles.push_back(outfile);
+		if (fstat(fileno(outfile), &out) == 0) {
+			pair<dev_t, ino_t> id = make_pair(out.st_dev, out.st_ino);
+			if (S_ISREG(out.st_mode) && find(seen.begin(), seen.end(), id) != seen.end()) {
+				fprintf(stderr, "f was given the same output twice: %s\n", args.fanouts[k]);
+				ok = false;
+			}
+			seen.push_back(id);
+		}
+	}
+
+	if (ok) {
+		try {
+			AESFanout fanout(recipients, args.threads, args.chunk);
+			fanout.encryptFile(args.infile, outfiles, mac);
+		} catch (...) {
+			for (size_t k = 0; k < outfiles.size(); ++k)
+				fclose(outfiles[k]);
+			throw;
+		}
+	}
+	for (size_t k = 0; k < outfiles.size(); ++k) {
+		if (fclose(outfiles[k]) != 0) {
+			fprintf(stderr, "unable to write output file: %s\n", args.fanouts[k]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+
 void print_help ()
 {
-	printf("USAGE: aes MODE [OPTIONS] [-i inputfile] [-o outputfile]\n");
+	printf("USAGE: aes MODE [OPTIONS] [-i inputfile] [-o outputfile] [KEYFILE [NEWKEYFILE]]\n");
+	printf("       aes f [OPTIONS] [-i inputfile] KEYFILE OUTPUT [KEYFILE OUTPUT ...]\n");
 	printf("\n");
 	printf("MODE\n");
 	printf("\n");
@@ -203,7 +1328,27 @@ void print_help ()
 	printf("\n");
 	printf("\td    decryption\n");
 	printf("\n");
-	printf("\tg    generates a key (sized according to the -s option), writes it to output\n");
+	printf("\tg    generates a key (sized according to the -s option), writes it to output;\n");
+	printf("\t     with -n, writes that many random bytes instead\n");
+	printf("\n");
+	printf("\tr    re-encrypts ciphertext under KEYFILE to NEWKEYFILE in one pass;\n");
+	printf("\t     -i and -o may name the same file, which is then replaced once the\n");
+	printf("\t     new ciphertext is complete; with -t and -a, the tag is checked\n");
+	printf("\t     under the old key before anything is written\n");
+	printf("\n");
+	printf("\tf    encrypts the input once for several keys: each KEYFILE's output\n");
+	printf("\t     goes to the OUTPUT after it, as e would write it under that key\n");
+	printf("\n");
+	printf("\ta    computes the AES-CMAC tag of the input, writes it to output\n");
+	printf("\n");
+	printf("\tv    verifies the input against the AES-CMAC tag given with -t; without\n");
+	printf("\t     it, checks tree-format ciphertext (see -M) without decrypting it\n");
+	printf("\n");
+	printf("\ts    serves encryption and decryption on the socket given with -S,\n");
+	printf("\t     until interrupted\n");
+	printf("\n");
+	printf("\tb    benchmarks the backends, thread counts and chunk sizes, and saves\n");
+	printf("\t     the fastest as this host's tuning profile\n");
 	printf("\n");
 	printf("\th    shows this help information\n");
 	printf("\n");
@@ -218,34 +1363,360 @@ void print_help ()
 	printf("\t\tThe AES block cipher mode. ECB or CBC.\n");
 	printf("\t\tThe default value is ECB.\n");
 	printf("\n");
+	printf("\t-t TAGFILE\n");
+	printf("\t\tThe AES-CMAC tag of the plaintext. Written during encryption,\n");
+	printf("\t\tchecked by the v mode, and by d and r before they write\n");
+	printf("\t\tanything. Decrypting from a pipe, d can only check it at the\n");
+	printf("\t\tend; on a mismatch it fails and the output must be discarded.\n");
+	printf("\n");
+	printf("\t-a KEYFILE\n");
+	printf("\t\tThe key used for the tag. Required with -t for e and d,\n");
+	printf("\t\tsince the cipher key must not double as the MAC key.\n");
+	printf("\t\tThe a and v modes use KEYFILE when it is not given.\n");
+	printf("\n");
+	printf("\t-j THREADS\n");
+	printf("\t\tThe number of worker threads, pinned to cores across NUMA nodes.\n");
+	printf("\t\t0 uses every available core, and at most 1024 may be given.\n");
+	printf("\t\tThe default comes from the tuning profile. CBC encryption is\n");
+	printf("\t\tserial and ignores this option.\n");
+	printf("\n");
+	printf("\t-c CHUNK\n");
+	printf("\t\tThe number of bytes each worker handles at a time.\n");
+	printf("\t\tThe default comes from the tuning profile.\n");
+	printf("\n");
+	printf("\t-b BACKEND\n");
+	printf("\t\tThe cipher implementation: table (lookup tables), vperm\n");
+	printf("\t\t(SSSE3 vector permute, constant time) or auto, which picks\n");
+	printf("\t\tvperm when the CPU supports it. The default comes from the\n");
+	printf("\t\ttuning profile.\n");
+	printf("\n");
+	printf("\t-T\n");
+	printf("\t\tTunes again rather than loading the cached tuning profile.\n");
+	printf("\t\tThe profile is kept in $AES_PROFILE when set, otherwise under\n");
+	printf("\t\t~/.cache/aes-rijndael, and written on first use. Options given\n");
+	printf("\t\ton the command line take precedence over it.\n");
+	printf("\n");
+	printf("\t-z\n");
+	printf("\t\tCompresses the input (zlib, in parallel over chunks) before\n");
+	printf("\t\tencrypting it. Decryption recognises such output by its header\n");
+	printf("\t\tand decompresses it without being asked.\n");
+	printf("\n");
+	printf("\t-M\n");
+	printf("\t\tWrites the tree format: chunks of -c bytes (64 KiB by default)\n");
+	printf("\t\tencrypted independently, each MACed under the key given with\n");
+	printf("\t\t-a, with a MAC tree over them in a trailer. Decryption\n");
+	printf("\t\trecognises it by its header and, reading from a file, checks\n");
+	printf("\t\tand decrypts the chunks in parallel, each before any of its\n");
+	printf("\t\tplaintext is written.\n");
+	printf("\n");
+	printf("\t-D\n");
+	printf("\t\tKeeps e and d out of the page cache, for one-shot bulk files\n");
+	printf("\t\tgiven with -i and -o: they are read and written with O_DIRECT\n");
+	printf("\t\tin aligned batches, or, where the file system refuses it,\n");
+	printf("\t\tdropped from the cache as soon as each batch is done. d then\n");
+	printf("\t\tneeds its input to be a regular file.\n");
+	printf("\n");
+	printf("\t-R OFFSET:LENGTH\n");
+	printf("\t\tWith d on tree-format input, writes only LENGTH bytes of\n");
+	printf("\t\tplaintext from OFFSET, reading just the chunks that hold them\n");
+	printf("\t\tand their path up the tree.\n");
+	printf("\n");
+	printf("\t-r RATE\n");
+	printf("\t\tCaps e, d and r at RATE bytes of input per second; K, M or G\n");
+	printf("\t\tafter the number multiply it by 1024 once, twice or three times.\n");
+	printf("\n");
+	printf("\t-L PERCENT\n");
+	printf("\t\tRuns e, d and r as fast as they can without using more than\n");
+	printf("\t\tPERCENT of the box's CPU time. With -r or -L, the number of\n");
+	printf("\t\tworkers also follows the load: only as many take work as\n");
+	printf("\t\tthere are cores other processes leave idle. With -v, the\n");
+	printf("\t\trate is reported on stderr every second.\n");
+	printf("\n");
+	printf("\t-l\n");
+	printf("\t\tRuns at the lowest priority: nice 19, and the idle I/O\n");
+	printf("\t\tscheduling class, for this thread and every worker.\n");
+	printf("\n");
+	printf("\t-S SOCKET\n");
+	printf("\t\tThe Unix domain socket of an aes daemon (the s mode). With e\n");
+	printf("\t\tand d, the work is sent to that daemon rather than done here;\n");
+	printf("\t\tKEYFILE is then read by the daemon, which keeps its schedule.\n");
+	printf("\n");
+	printf("\t-K DIR\n");
+	printf("\t\tWith s, the directory key files must be in; requests naming\n");
+	printf("\t\tany other file are refused. The default is the directory the\n");
+	printf("\t\tdaemon is started in.\n");
+	printf("\n");
+	printf("\t-n BYTES\n");
+	printf("\t\tMakes g stream BYTES of output from the CTR_DRBG random\n");
+	printf("\t\tgenerator, or an endless stream if BYTES is 0; K, M or G after\n");
+	printf("\t\tthe number multiply it by 1024 once, twice or three times.\n");
+	printf("\n");
+	printf("\t-P\n");
+	printf("\t\tProfiles e and d with the hardware performance counters, and\n");
+	printf("\t\treports cycles, instructions, L1D misses and branch misses per\n");
+	printf("\t\tbyte for each stage on stderr: key expansion, the cipher work,\n");
+	printf("\t\treading and writing. The run is the same as without -P, other\n");
+	printf("\t\toptions included. With b, adds the counters for each backend's\n");
+	printf("\t\tblock rounds.\n");
+	printf("\n");
+	printf("\t-H\n");
+	printf("\t\tBacks the I/O buffers with 2 MiB huge pages: transparent ones\n");
+	printf("\t\tfor the shared buffer pools, and MAP_HUGETLB, when pages are\n");
+	printf("\t\treserved, for the worker buffers, which are mapped at their size.\n");
+	printf("\n");
 	printf("\t-v\n");
 	printf("\t\tSets verbose mode\n");
 	printf("\n");
 }
 
 
-int main (int argc, char *argv[])
+/*
+**  Streams count random bytes to out, or until it is closed if count
+**  is 0.
+*/
+
+bool write_random (FILE *out, uint64_t count)
 {
-	args_type args;
-	if (!parse_args(argc, argv, args)) {
+	AESRandom random;
+	AESBuffer buffer(AES_CHUNK_SIZE);
+	uint8_t *buf = buffer.get();
+	bool forever = (count == 0);
+	bool ok = true;
+	while (ok && (forever || count > 0)) {
+		size_t n = (forever || count > AES_CHUNK_SIZE) ? AES_CHUNK_SIZE : (size_t)count;
+		random.generate(buf, n);
+		ok = (fwrite(buf, 1, n, out) == n);
+		if (!forever)
+			count -= n;
+	}
+	memset(buf, 0, AES_CHUNK_SIZE);
+	// an endless stream ends when the reader goes away
+	return forever || (ok && fflush(out) == 0);
+}
+
+
+void apply_profile (args_type& args)
+{
+	if (args.threadsset && args.chunkset && args.backendset && !args.retune)
+		return;
+
+	AESProfile profile = AESProfile::current(args.retune);
+	if (!args.threadsset)
+		args.threads = profile.threads;
+	if (!args.chunkset)
+		args.chunk = profile.chunk;
+	if (!args.backendset)
+		args.backend = profile.backend;
+	if (args.verbose) {
+		fprintf(stderr, "tuning profile: ");
+		profile.print(stderr);
+	}
+}
+
+
+int run_client (args_type& args)
+{
+	if (args.tagfile != NULL || args.compress || args.tree || args.ranged) {
+		fprintf(stderr, "-t, -z, -M and -R are not available with -S\n");
 		return EXIT_FAILURE;
 	}
 
-	AESEngine engine(args.mode, args.key);
+	// the daemon opens the key file itself, so it gets an absolute path
+	string keyfile;
+	if (!args.keyfile.empty()) {
+		char *real = realpath(args.keyfile.c_str(), NULL);
+		if (real == NULL) {
+			fprintf(stderr, "unable to open key file: %s\n", args.keyfile.c_str());
+			return EXIT_FAILURE;
+		}
+		keyfile = real;
+		free(real);
+	}
+
+	vector<uint8_t> payload;
+	AESBuffer buffer(AES_CHUNK_SIZE);
+	size_t count;
+	while ((count = readChunk(buffer.get(), AES_CHUNK_SIZE, args.infile)) > 0)
+		payload.insert(payload.end(), buffer.get(), buffer.get() + count);
+
+	AESClient client(args.socket);
+	vector<uint8_t> output = client.request(
+		args.opmode == 'e' ? AES_DAEMON_ENCRYPT : AES_DAEMON_DECRYPT,
+		args.mode, keyfile, NULL, payload);
+	if (!output.empty())
+		fwrite(&output[0], 1, output.size(), args.outfile);
+	fill(payload.begin(), payload.end(), 0);
+	fill(output.begin(), output.end(), 0);
+	return EXIT_SUCCESS;
+}
+
+
+int run (args_type& args)
+{
+	if (args.lowpriority && !AESThrottle::lowerPriority() && args.verbose) {
+		fprintf(stderr, "unable to lower the priority fully\n");
+	}
+	bool remote = (args.socket != NULL && (args.opmode == 'e' || args.opmode == 'd'));
+	if (remote) {
+		return run_client(args);
+	}
+	if (args.opmode == 'e' || args.opmode == 'd' || args.opmode == 'a' || args.opmode == 'v'
+			|| args.opmode == 's' || args.opmode == 'r' || args.opmode == 'f') {
+		apply_profile(args);
+	}
+	if (args.opmode == 's') {
+		if (args.socket == NULL) {
+			fprintf(stderr, "s requires a socket path given with -S\n");
+			return EXIT_FAILURE;
+		}
+		AESDaemon daemon(args.socket, args.keydir, args.threads, args.backend);
+		daemon.run();
+		return EXIT_SUCCESS;
+	}
+	if (args.direct && ((args.opmode != 'e' && args.opmode != 'd')
+			|| args.compress || args.tree || args.perf || args.socket != NULL)) {
+		fprintf(stderr, "-D is only available with e and d, and not with -z, -M, -P or -S\n");
+		return EXIT_FAILURE;
+	}
+	bool throttled = (args.rate != 0 || args.share != 0);
+	if (throttled && (args.compress || args.tree || args.socket != NULL)) {
+		fprintf(stderr, "-r and -L are not available with -z, -M or -S\n");
+		return EXIT_FAILURE;
+	}
+
+	// opened first, so the counters follow the workers started later
+	unique_ptr<AESProfiler> profiler;
+	if (args.perf && (args.opmode == 'e' || args.opmode == 'd')) {
+		profiler.reset(new AESProfiler());
+		profiler->begin();
+	}
+	AESEngine engine(args.mode, args.key, args.backend);
+	if (profiler)
+		profiler->end(AESProfiler::KEY_EXPANSION);
+
+	if ((args.opmode == 'e' || args.opmode == 'd' || args.opmode == 'f' || args.opmode == 'r')
+			&& args.tagfile != NULL && args.mackey.empty()) {
+		fprintf(stderr, "-t requires a MAC key given with -a\n");
+		return EXIT_FAILURE;
+	}
+	if (args.tree && (args.tagfile != NULL || args.compress)) {
+		fprintf(stderr, "-M takes neither -t nor -z: its chunks carry their own MACs\n");
+		return EXIT_FAILURE;
+	}
+	if (args.tree && args.mackey.empty()) {
+		fprintf(stderr, "-M requires a MAC key given with -a\n");
+		return EXIT_FAILURE;
+	}
+	if (args.ranged && args.opmode != 'd') {
+		fprintf(stderr, "-R is only available with d\n");
+		return EXIT_FAILURE;
+	}
+	AESEngine mac(args.mode, args.mackey.empty() ? args.key : args.mackey, args.backend);
+	uint8_t tag[AES_BLOCK_SIZE];
+	uint8_t expected[AES_BLOCK_SIZE];
+
+	unique_ptr<AESThrottle> throttle;
+	if (throttled) {
+		throttle.reset(new AESThrottle(args.rate, args.share, args.verbose ? stderr : NULL));
+		args.throttle = throttle.get();
+	}
 
 	if (args.opmode == 'e') {
-		engine.encryptFile(stdin, stdout);
+		mac.cmacInit();
+		auto work = [&] { encrypt_file(args, engine, (args.tagfile != NULL || args.tree) ? &mac : NULL); };
+		if (profiler) {
+			profiler->run(args.infile, args.outfile, work);
+			profiler->report(stderr);
+		} else {
+			work();
+		}
+		if (args.tagfile != NULL) {
+			mac.cmacFinal(tag);
+			if (!write_tag(args.tagfile, tag))
+				return EXIT_FAILURE;
+		}
 	} else if (args.opmode == 'd') {
-		engine.decryptFile(stdin, stdout);
+		if (args.tagfile != NULL && !read_tag(args.tagfile, expected))
+			return EXIT_FAILURE;
+		bool verified = false;
+		if (args.tagfile != NULL && !verify_first(args, engine, verified))
+			return EXIT_FAILURE;
+		const bool tagged = (args.tagfile != NULL && !verified);
+		mac.cmacInit();
+		bool ok = false;
+		auto work = [&] { ok = decrypt_file(args, engine, mac, tagged); };
+		if (profiler) {
+			profiler->run(args.infile, args.outfile, work);
+			profiler->report(stderr);
+		} else {
+			work();
+		}
+		if (!ok)
+			return EXIT_FAILURE;
+		if (tagged) {
+			mac.cmacFinal(tag);
+			if (!AESEngine::cmacVerify(tag, expected)) {
+				fprintf(stderr, "tag mismatch: discard the output, it is not authentic\n");
+				return EXIT_FAILURE;
+			}
+		}
+	} else if (args.opmode == 'f') {
+		mac.cmacInit();
+		if (!fan_out(args, (args.tagfile != NULL) ? &mac : NULL))
+			return EXIT_FAILURE;
+		if (args.tagfile != NULL) {
+			mac.cmacFinal(tag);
+			if (!write_tag(args.tagfile, tag))
+				return EXIT_FAILURE;
+		}
+	} else if (args.opmode == 'a') {
+		mac.cmacFile(args.infile, tag);
+		fwrite(tag, 1, AES_BLOCK_SIZE, args.outfile);
+	} else if (args.opmode == 'v' && args.tagfile == NULL) {
+		if (!verify_tree(args, engine, mac))
+			return EXIT_FAILURE;
+	} else if (args.opmode == 'v') {
+		if (!read_tag(args.tagfile, expected))
+			return EXIT_FAILURE;
+		mac.cmacFile(args.infile, tag);
+		if (!AESEngine::cmacVerify(tag, expected)) {
+			fprintf(stderr, "tag mismatch\n");
+			return EXIT_FAILURE;
+		}
+	} else if (args.opmode == 'r') {
+		int ret = rekey_file(args, engine);
+		if (ret != EXIT_SUCCESS)
+			return ret;
 	} else if (args.opmode == 'g') {
+		if (args.streamed)
+			return write_random(args.outfile, args.count) ? EXIT_SUCCESS : EXIT_FAILURE;
 		vector<uint8_t> key = engine.generateKey();
-		for (unsigned int k = 0; k < key.size(); ++k) {
-			printf("%c", (char)key[k]);
+		fwrite(&key[0], 1, key.size(), args.outfile);
+	} else if (args.opmode == 'b') {
+		AESProfile profile = AESProfile::tune(stdout);
+		printf("selected: ");
+		profile.print(stdout);
+		string filename = AESProfile::path();
+		if (!filename.empty() && profile.save(filename)) {
+			printf("saved to %s\n", filename.c_str());
+		} else {
+			fprintf(stderr, "unable to save tuning profile\n");
+			return EXIT_FAILURE;
+		}
+		if (args.perf) {
+			printf("\n");
+			AESProfiler::benchmark(stdout);
 		}
 	} else if (args.opmode == 'h' || args.opmode == '-') {
 		print_help();
 	} else if (args.opmode == 't') {
 		int ret = runtests();
+		if (ret == 0)
+			ret = runkats();
+		if (ret == 0)
+			ret = runfuzz(64);
+		if (ret == 0)
+			ret = runasync();
 		if (ret != 0) {
 			cout << "FAIL" << endl;
 			return ret;
@@ -255,5 +1726,35 @@ int main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (throttle && args.verbose)
+		throttle->print(stderr);
 	return EXIT_SUCCESS;
 }
+
+
+int main (int argc, char *argv[])
+{
+	args_type args;
+	try {
+		if (!parse_args(argc, argv, args))
+			return EXIT_FAILURE;
+	} catch (exception& e) {
+		fprintf(stderr, "aes: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	int ret;
+	try {
+		ret = run(args);
+	} catch (exception& e) {
+		fprintf(stderr, "aes: %s\n", e.what());
+		ret = EXIT_FAILURE;
+	}
+	if (args.infile != stdin)
+		fclose(args.infile);
+	if (args.outfile != stdout && fclose(args.outfile) != 0) {
+		fprintf(stderr, "aes: unable to write output file\n");
+		ret = EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -0,0 +1,568 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <functional>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "aes.h"
+#include "parallel.h"
+
+using namespace std;
+
+
+static size_t alignUp (size_t n)
+{
+	return (n + AES_DIRECT_ALIGN - 1) / AES_DIRECT_ALIGN * AES_DIRECT_ALIGN;
+}
+
+
+/*
+**  Topology
+*/
+
+static vector<int> parseList (const char *list)
+{
+	vector<int> cpus;
+	const char *p = list;
+	while (*p != '\0' && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p)
+			break;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long c = first; c <= last; ++c)
+			cpus.push_back((int)c);
+		if (*p == ',')
+			++p;
+	}
+	return cpus;
+}
+
+
+static vector<int> cpuNodes ()
+{
+	vector<int> nodes;
+	char line[4096];
+	FILE *online = fopen("/sys/devices/system/node/online", "r");
+	if (online == NULL)
+		return nodes;
+	vector<int> ids;
+	if (fgets(line, sizeof(line), online) != NULL)
+		ids = parseList(line);
+	fclose(online);
+
+	for (unsigned int n = 0; n < ids.size(); ++n) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[n]);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fgets(line, sizeof(line), f) != NULL) {
+			vector<int> cpus = parseList(line);
+			for (unsigned int k = 0; k < cpus.size(); ++k) {
+				if ((int)nodes.size() <= cpus[k])
+					nodes.resize(cpus[k] + 1, 0);
+				nodes[cpus[k]] = ids[n];
+			}
+		}
+		fclose(f);
+	}
+	return nodes;
+}
+
+
+int AESParallel::nodeOf (int cpu)
+{
+	static const vector<int> nodes = cpuNodes();
+	if (cpu < 0 || cpu >= (int)nodes.size())
+		return 0;
+	return nodes[cpu];
+}
+
+
+vector<int> AESParallel::cpus ()
+{
+	// the usable cpus, ordered so that consecutive workers alternate
+	// between nodes and the load is spread over every socket
+	vector<vector<int>> bynode;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int c = 0; c < CPU_SETSIZE; ++c) {
+			if (CPU_ISSET(c, &set)) {
+				int node = nodeOf(c);
+				if ((int)bynode.size() <= node)
+					bynode.resize(node + 1);
+				bynode[node].push_back(c);
+			}
+		}
+	}
+
+	vector<int> ordered;
+	for (size_t k = 0; ; ++k) {
+		bool any = false;
+		for (unsigned int n = 0; n < bynode.size(); ++n) {
+			if (k < bynode[n].size()) {
+				ordered.push_back(bynode[n][k]);
+				any = true;
+			}
+		}
+		if (!any)
+			break;
+	}
+	if (ordered.empty())
+		ordered.push_back(0);
+	return ordered;
+}
+
+
+//                                 m    "
+//    mmm    mmm   m mm    mmm   mm#mm  mmm     m mm    mmm
+//   #   "  #"  #  #"  "  #   "    #      #     #"  #  #   "
+//    """m  #""""  #      "#  "    #      #     #   #   """m
+//   "mmm"  "#mm"  #      "mmm"    "mm  mm#mm   #   #  "mmm"
+//
+
+
+AESParallel::AESParallel (AESEngine& e, unsigned int nthreads, size_t s)
+	: engine(e),
+	  slice(max((size_t)AES_BLOCK_SIZE, s - (s % AES_BLOCK_SIZE))),
+	  buffer(NULL),
+	  capacity(0),
+	  generation(0),
+	  pending(0),
+	  decrypting(false),
+	  target(NULL),
+	  throttle(NULL),
+	  stopping(false)
+{
+	vector<int> ordered = cpus();
+	if (nthreads == 0)
+		nthreads = ordered.size();
+
+	// room for a batch rounded up for O_DIRECT, and then padded
+	capacity = nthreads * slice;
+	storage.reset(new AESBuffer(alignUp(capacity) + AES_BLOCK_SIZE, true));
+	buffer = storage->get();
+
+	int maxnode = 0;
+	for (unsigned int k = 0; k < nthreads; ++k) {
+		void *mem = NULL;
+		if (posix_memalign(&mem, AES_CACHE_LINE, sizeof(Worker)) != 0)
+			throw bad_alloc();
+		Worker *w = new (mem) Worker();
+		w->cpu = ordered[k % ordered.size()];
+		w->node = nodeOf(w->cpu);
+		w->replica = NULL;
+		w->begin = buffer + k * slice;
+		w->end = w->begin + slice;
+		maxnode = max(maxnode, w->node);
+		workers.push_back(w);
+	}
+	replicas = vector<AESEngine *>(maxnode + 1, (AESEngine *)NULL);
+
+	unique_lock<mutex> lk(lock);
+	pending = workers.size();
+	for (unsigned int k = 0; k < workers.size(); ++k) {
+		workers[k]->handle = thread(&AESParallel::run, this, workers[k]);
+	}
+	done.wait(lk, [this] { return pending == 0; });
+}
+
+
+AESParallel::~AESParallel ()
+{
+	{
+		lock_guard<mutex> lk(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (unsigned int k = 0; k < workers.size(); ++k) {
+		workers[k]->handle.join();
+		fill(workers[k]->chain, workers[k]->chain + AES_BLOCK_SIZE, 0);
+		workers[k]->~Worker();
+		free(workers[k]);
+	}
+	for (unsigned int n = 0; n < replicas.size(); ++n) {
+		delete replicas[n];
+	}
+}
+
+
+void AESParallel::run (Worker *w)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	{
+		// the copy is made from the pinned thread, so the schedule is
+		// allocated and first touched on this worker's node
+		lock_guard<mutex> lk(lock);
+		if (replicas[w->node] == NULL)
+			replicas[w->node] = new AESEngine(engine);
+		w->replica = replicas[w->node];
+	}
+	memset(w->begin, 0, w->end - w->begin);
+
+	unique_lock<mutex> lk(lock);
+	if (--pending == 0)
+		done.notify_all();
+	unsigned long seen = 0;
+	for (;;) {
+		wake.wait(lk, [this, seen] { return stopping || generation != seen; });
+		if (stopping)
+			return;
+		seen = generation;
+		lk.unlock();
+		work(w);
+		lk.lock();
+		if (--pending == 0)
+			done.notify_all();
+	}
+}
+
+
+void AESParallel::work (Worker *w)
+{
+	AESEngine *r = w->replica;
+	AESEngine *t = target;
+	if (!decrypting) {
+		for (uint8_t *block = w->begin; block < w->end; block += AES_BLOCK_SIZE)
+			r->cipherBlock(block);
+	} else if (engine.isModeECB()) {
+		for (uint8_t *block = w->begin; block < w->end; block += AES_BLOCK_SIZE) {
+			r->invCipherBlock(block);
+			if (t != NULL)
+				t->cipherBlock(block);
+		}
+	} else {
+		uint8_t ciphertext[AES_BLOCK_SIZE];
+		for (uint8_t *block = w->begin; block < w->end; block += AES_BLOCK_SIZE) {
+			memcpy(ciphertext, block, AES_BLOCK_SIZE);
+			r->invCipherBlock(block);
+			AESEngine::decryptCBC(block, w->chain);
+			memcpy(w->chain, ciphertext, AES_BLOCK_SIZE);
+			if (t != NULL)
+				t->cipherBlock(block);
+		}
+	}
+}
+
+
+void AESParallel::dispatch (uint8_t *data, size_t len, bool decrypt)
+{
+	// the shared buffer keeps its fixed slices so each worker stays on
+	// the pages it first touched; other buffers are split evenly
+	size_t nblocks = len / AES_BLOCK_SIZE;
+	size_t per = slice;
+	if (data != buffer) {
+		per = (nblocks + workers.size() - 1) / workers.size() * AES_BLOCK_SIZE;
+	}
+
+	uint8_t *end = data + nblocks * AES_BLOCK_SIZE;
+	uint8_t last[AES_BLOCK_SIZE];
+	if (decrypt && engine.isModeCBC()) {
+		memcpy(last, end - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	}
+	for (unsigned int k = 0; k < workers.size(); ++k) {
+		Worker *w = workers[k];
+		w->begin = min(data + k * per, end);
+		w->end = (k + 1 == workers.size()) ? end : min(w->begin + per, end);
+		if (decrypt && engine.isModeCBC()) {
+			if (k == 0)
+				engine.getIV(w->chain);
+			else if (w->begin < w->end)
+				memcpy(w->chain, w->begin - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		}
+	}
+
+	{
+		unique_lock<mutex> lk(lock);
+		decrypting = decrypt;
+		pending = workers.size();
+		++generation;
+		wake.notify_all();
+		done.wait(lk, [this] { return pending == 0; });
+	}
+
+	if (decrypt && engine.isModeCBC()) {
+		engine.setIV(last);
+	}
+}
+
+
+void AESParallel::encrypt (uint8_t *data, size_t len)
+{
+	len -= len % AES_BLOCK_SIZE;
+	if (engine.isModeCBC() || workers.size() == 1 || len <= AES_BLOCK_SIZE) {
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE)
+			engine.encryptBlock(data + off);
+		return;
+	}
+	dispatch(data, len, false);
+}
+
+
+void AESParallel::decrypt (uint8_t *data, size_t len)
+{
+	len -= len % AES_BLOCK_SIZE;
+	if (workers.size() == 1 || len <= AES_BLOCK_SIZE) {
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE)
+			engine.decryptBlock(data + off);
+		return;
+	}
+	dispatch(data, len, true);
+}
+
+
+void AESParallel::rekey (AESEngine& to, uint8_t *data, size_t len)
+{
+	len -= len % AES_BLOCK_SIZE;
+	if (workers.size() == 1 || len <= AES_BLOCK_SIZE) {
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE) {
+			engine.decryptBlock(data + off);
+			to.encryptBlock(data + off);
+		}
+		return;
+	}
+	target = to.isModeECB() ? &to : NULL;
+	dispatch(data, len, true);
+	target = NULL;
+	if (to.isModeCBC()) {
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE)
+			to.encryptBlock(data + off);
+	}
+}
+
+
+void AESParallel::encryptFile (FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	size_t count = 0;
+	size_t want = 0;
+	do {
+		want = batch();
+		count = readChunk(buffer, want, infile);
+		if (mac != NULL)
+			mac->cmacUpdate(buffer, count);
+
+		size_t nbytes = count;
+		if (count < want) {
+			size_t whole = count - (count % AES_BLOCK_SIZE);
+			nbytes = whole + AESEngine::pad(buffer + whole, count - whole);
+		}
+		encrypt(buffer, nbytes);
+		fwrite(buffer, 1, nbytes, outfile);
+		if (throttle != NULL)
+			throttle->pace(count);
+	} while (count == want);
+}
+
+
+void AESParallel::decryptFile (FILE *infile, FILE *outfile, AESEngine *mac)
+{
+	// as in AESStream, the last block is held back for the padding
+	size_t held = 0;
+	size_t count = 0;
+	bool last = false;
+	do {
+		size_t want = batch();
+		count = readChunk(buffer + held, want, infile);
+		if ((count % AES_BLOCK_SIZE) != 0) {
+			throw IllegalAESBlockSize();
+		}
+
+		size_t total = held + count;
+		last = (count < want);
+		size_t nbytes = last ? total : total - AES_BLOCK_SIZE;
+		decrypt(buffer, nbytes);
+		if (last && nbytes > 0) {
+			nbytes = nbytes - AES_BLOCK_SIZE + AESEngine::unpad(buffer + nbytes - AES_BLOCK_SIZE);
+		}
+
+		if (mac != NULL)
+			mac->cmacUpdate(buffer, nbytes);
+		fwrite(buffer, 1, nbytes, outfile);
+		if (throttle != NULL)
+			throttle->pace(count);
+
+		if (!last) {
+			memmove(buffer, buffer + total - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+			held = AES_BLOCK_SIZE;
+		}
+	} while (!last);
+}
+
+
+/*
+**  Both keys pad the same plaintext the same way, so the ciphertext keeps
+**  its length and the padding is never removed; the last block is only
+**  checked, which catches a wrong old key. Output never runs ahead of
+**  input, so out may be the same file as in, opened separately.
+*/
+
+void AESParallel::rekeyFile (AESEngine& to, FILE *infile, FILE *outfile)
+{
+	size_t held = 0;
+	size_t count = 0;
+	bool last = false;
+	do {
+		size_t want = batch();
+		count = readChunk(buffer + held, want, infile);
+		if ((count % AES_BLOCK_SIZE) != 0) {
+			throw IllegalAESBlockSize();
+		}
+
+		size_t total = held + count;
+		last = (count < want);
+		size_t nbytes = (total > 0) ? total - AES_BLOCK_SIZE : 0;
+		rekey(to, buffer, nbytes);
+		if (last && total > 0) {
+			uint8_t *block = buffer + nbytes;
+			engine.decryptBlock(block);
+			AESEngine::unpad(block);
+			to.encryptBlock(block);
+			nbytes = total;
+		}
+		fwrite(buffer, 1, nbytes, outfile);
+		if (throttle != NULL)
+			throttle->pace(count);
+
+		if (!last) {
+			memmove(buffer, buffer + nbytes, AES_BLOCK_SIZE);
+			held = AES_BLOCK_SIZE;
+		}
+	} while (!last);
+}
+
+
+/*
+**  The same loops over files that bypass the page cache: each batch is
+**  rounded up to a whole number of AES_DIRECT_ALIGN bytes, so every read
+**  and write but the last stays aligned. The input's length, known up
+**  front, tells decryption which batch holds the padding, so no block has
+**  to be held back, which would misalign the next read.
+*/
+
+void AESParallel::encryptFile (AESDirectFile& in, AESDirectFile& out, AESEngine *mac)
+{
+	size_t count = 0;
+	size_t want = 0;
+	do {
+		want = alignUp(batch());
+		count = in.read(buffer, want);
+		if (mac != NULL)
+			mac->cmacUpdate(buffer, count);
+
+		size_t nbytes = count;
+		if (count < want) {
+			size_t whole = count - (count % AES_BLOCK_SIZE);
+			nbytes = whole + AESEngine::pad(buffer + whole, count - whole);
+		}
+		encrypt(buffer, nbytes);
+		out.write(buffer, nbytes);
+		if (throttle != NULL)
+			throttle->pace(count);
+	} while (count == want);
+	out.finish();
+}
+
+
+void AESParallel::decryptFile (AESDirectFile& in, AESDirectFile& out, AESEngine *mac)
+{
+	off_t left = in.length();
+	if (left < 0)
+		throw AESDirectException("direct decryption needs a regular input file");
+	if ((left % AES_BLOCK_SIZE) != 0)
+		throw IllegalAESBlockSize();
+
+	bool last = false;
+	do {
+		size_t want = alignUp(batch());
+		size_t count = in.read(buffer, want);
+		if ((count % AES_BLOCK_SIZE) != 0) {
+			throw IllegalAESBlockSize();
+		}
+
+		left -= count;
+		last = (count < want || left <= 0);
+		size_t nbytes = count;
+		decrypt(buffer, nbytes);
+		if (last && nbytes > 0) {
+			nbytes = nbytes - AES_BLOCK_SIZE + AESEngine::unpad(buffer + nbytes - AES_BLOCK_SIZE);
+		}
+
+		if (mac != NULL)
+			mac->cmacUpdate(buffer, nbytes);
+		out.write(buffer, nbytes);
+		if (throttle != NULL)
+			throttle->pace(count);
+	} while (!last);
+	out.finish();
+}
+
+
+size_t AESParallel::threads ()
+{
+	return workers.size();
+}
+
+
+void AESParallel::setThrottle (AESThrottle *t)
+{
+	throttle = t;
+}
+
+
+/*
+**  How much the file loops read at a time: a slice for each worker the
+**  throttle lets in. The rest find their slices empty and go back to
+**  sleep, and each worker keeps the same slice whatever the count.
+*/
+
+size_t AESParallel::batch ()
+{
+	if (throttle == NULL)
+		return capacity;
+	return throttle->workers(workers.size()) * slice;
+}
+
+
+/*
+**  Runs body(0) .. body(n - 1) over up to nthreads threads, the calling
+**  thread included. The stages that use it hand out a few hundred
+**  kilobytes per thread at a time, so starting the helpers per batch
+**  costs little next to the work.
+*/
+
+void parallelFor (size_t n, unsigned int nthreads, const function<void (size_t)>& body)
+{
+	atomic<size_t> next(0);
+	auto loop = [&next, n, &body] {
+		size_t k;
+		while ((k = next.fetch_add(1)) < n)
+			body(k);
+	};
+	vector<thread> helpers;
+	for (unsigned int t = 1; t < nthreads && t < n; ++t)
+		helpers.push_back(thread(loop));
+	loop();
+	for (unsigned int t = 0; t < helpers.size(); ++t)
+		helpers[t].join();
+}
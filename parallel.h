@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+#include "arena.h"
+#include "throttle.h"
+#include "direct.h"
+
+using namespace std;
+
+
+#define AES_CACHE_LINE 64
+
+// the most workers -j may ask for
+#define AES_MAX_THREADS 1024
+
+
+/*
+**  Multi-threaded ECB encryption and ECB/CBC decryption over an engine.
+**
+**  Workers are pinned to cores, spread across NUMA nodes, and the first
+**  worker on each node makes that node's copy of the engine (and so of
+**  its key schedule). The I/O buffer is mapped fresh rather than leased
+**  from the arena, whose recycled pages stay wherever they were first
+**  touched, and split into one slice per worker; each slice is first
+**  touched by the worker that processes it, so it lands on its node.
+**  CBC encryption is inherently serial and runs on the calling thread.
+**
+**  rekey() turns ciphertext under this engine into ciphertext under
+**  another without the plaintext leaving the worker: each block is
+**  decrypted and, when the new engine is ECB, encrypted again straight
+**  away. A CBC target is encrypted afterwards on the calling thread.
+**
+**  With a throttle, the file functions read only as many slices as it
+**  has workers to spare and let it pace them after every batch.
+**
+**  The overloads on AESDirectFile do the same over files that bypass the
+**  page cache; the buffer, being mapped, is page aligned.
+*/
+
+class AESParallel
+{
+private:
+
+	struct alignas(AES_CACHE_LINE) Worker {
+		thread handle;
+		int cpu;
+		int node;
+		AESEngine *replica;
+		uint8_t chain[AES_BLOCK_SIZE];
+		uint8_t *begin;
+		uint8_t *end;
+	};
+
+	AESEngine& engine;
+
+	const size_t slice;
+
+	vector<Worker *> workers;
+	vector<AESEngine *> replicas;
+
+	unique_ptr<AESBuffer> storage;
+	uint8_t *buffer;
+	size_t capacity;
+
+	mutex lock;
+	condition_variable wake;
+	condition_variable done;
+	unsigned long generation;
+	unsigned int pending;
+	bool decrypting;
+	AESEngine *target;
+	AESThrottle *throttle;
+	bool stopping;
+
+	void run (Worker *w);
+	void work (Worker *w);
+	void dispatch (uint8_t *data, size_t len, bool decrypt);
+	size_t batch ();
+
+public:
+
+	AESParallel (AESEngine& e, unsigned int nthreads = 0, size_t s = AES_CHUNK_SIZE);
+	~AESParallel ();
+
+	void encrypt (uint8_t *data, size_t len);
+	void decrypt (uint8_t *data, size_t len);
+
+	void rekey (AESEngine& to, uint8_t *data, size_t len);
+
+	void encryptFile (FILE *in, FILE *out, AESEngine *mac = NULL);
+	void decryptFile (FILE *in, FILE *out, AESEngine *mac = NULL);
+	void rekeyFile (AESEngine& to, FILE *in, FILE *out);
+
+	void encryptFile (AESDirectFile& in, AESDirectFile& out, AESEngine *mac = NULL);
+	void decryptFile (AESDirectFile& in, AESDirectFile& out, AESEngine *mac = NULL);
+
+	size_t threads ();
+	void setThrottle (AESThrottle *t);
+
+	static vector<int> cpus ();
+	static int nodeOf (int cpu);
+};
+
+
+void parallelFor (size_t n, unsigned int nthreads, const function<void (size_t)>& body);
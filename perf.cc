@@ -0,0 +1,379 @@
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <new>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aes.h"
+#include "arena.h"
+#include "perf.h"
+
+using namespace std;
+
+
+static const uint32_t TYPES[] = {
+	PERF_TYPE_HARDWARE,
+	PERF_TYPE_HARDWARE,
+	PERF_TYPE_HW_CACHE,
+	PERF_TYPE_HARDWARE
+};
+
+static const uint64_t CONFIGS[] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const char *STAGE_NAMES[] = {
+	"key expansion",
+	"cipher",
+	"read",
+	"write"
+};
+
+static const char *COUNTER_NAMES[] = {
+	"cycles/B",
+	"instr/B",
+	"L1D-miss/B",
+	"br-miss/B"
+};
+
+
+static uint64_t now ()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static int openCounter (uint32_t type, uint64_t config, int group, bool kernel)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = (group < 0);
+	attr.exclude_kernel = !kernel;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.inherit = 1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+	// a kernel that cannot inherit a group still counts this thread
+	if (fd < 0 && errno == EINVAL) {
+		attr.inherit = 0;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+
+
+AESProfiler::AESProfiler ()
+	: leader(-1), nopen(0), kernel(true), started(0), bytes(0)
+{
+	for (int c = 0; c < COUNTERS; ++c) {
+		fds[c] = -1;
+		slots[c] = -1;
+	}
+	reset();
+
+	// kernel time too when allowed, so read and write show their
+	// system call cost; user space only when perf_event_paranoid says so
+	int error = 0;
+	for (int attempt = 0; attempt < 2 && leader < 0; ++attempt) {
+		kernel = (attempt == 0);
+		for (int c = 0; c < COUNTERS; ++c) {
+			int fd = openCounter(TYPES[c], CONFIGS[c], leader, kernel);
+			if (fd < 0) {
+				if (error == 0)
+					error = errno;
+				continue;
+			}
+			if (leader < 0)
+				leader = fd;
+			fds[c] = fd;
+			slots[c] = nopen++;
+		}
+		if (leader < 0 && error != EACCES && error != EPERM)
+			break;
+	}
+
+	if (leader >= 0) {
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return;
+	}
+
+	reason = (error == ENOENT || error == EOPNOTSUPP)
+		? "no hardware counters on this CPU" : strerror(error);
+	FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+	int paranoid;
+	if (f != NULL) {
+		if (fscanf(f, "%d", &paranoid) == 1)
+			reason += " (perf_event_paranoid is " + to_string(paranoid) + ")";
+		fclose(f);
+	}
+}
+
+
+AESProfiler::~AESProfiler ()
+{
+	for (int c = 0; c < COUNTERS; ++c) {
+		if (fds[c] >= 0)
+			close(fds[c]);
+	}
+}
+
+
+bool AESProfiler::available ()
+{
+	return leader >= 0;
+}
+
+
+bool AESProfiler::available (Counter c)
+{
+	return fds[c] >= 0;
+}
+
+
+void AESProfiler::reset ()
+{
+	memset(totals, 0, sizeof(totals));
+	memset(nanos, 0, sizeof(nanos));
+	memset(start, 0, sizeof(start));
+	bytes = 0;
+}
+
+
+void AESProfiler::sample (uint64_t *values)
+{
+	uint64_t group[1 + COUNTERS];
+	memset(group, 0, sizeof(group));
+	if (leader >= 0 && read(leader, group, sizeof(group)) < (ssize_t)sizeof(uint64_t))
+		memset(group, 0, sizeof(group));
+	for (int c = 0; c < COUNTERS; ++c)
+		values[c] = (slots[c] >= 0) ? group[1 + slots[c]] : 0;
+}
+
+
+void AESProfiler::begin ()
+{
+	started = now();
+	sample(start);
+}
+
+
+void AESProfiler::end (Stage s)
+{
+	uint64_t values[COUNTERS];
+	sample(values);
+	nanos[s] += now() - started;
+	for (int c = 0; c < COUNTERS; ++c)
+		totals[s][c] += values[c] - start[c];
+}
+
+
+/*
+**  Instrumented pipeline
+*/
+
+unique_ptr<AESEngine> AESProfiler::expandKey (AESEngine::AESMode m, const vector<uint8_t>& k,
+	AESEngine::Backend b)
+{
+	begin();
+	unique_ptr<AESEngine> engine(new AESEngine(m, k, b));
+	end(KEY_EXPANSION);
+	return engine;
+}
+
+
+/*
+**  The watched streams are unbuffered, so each read and write the work
+**  makes reaches the real stream as it would have, and is timed alone.
+*/
+
+struct Watched {
+	AESProfiler *profiler;
+	FILE *stream;
+	size_t *bytes;
+};
+
+
+static ssize_t watchedRead (void *cookie, char *buf, size_t size)
+{
+	Watched *w = (Watched *)cookie;
+	w->profiler->end(AESProfiler::CIPHER);
+	w->profiler->begin();
+	size_t n = fread(buf, 1, size, w->stream);
+	w->profiler->end(AESProfiler::READ);
+	w->profiler->begin();
+	*w->bytes += n;
+	return (n == 0 && ferror(w->stream)) ? -1 : n;
+}
+
+
+static ssize_t watchedWrite (void *cookie, const char *buf, size_t size)
+{
+	Watched *w = (Watched *)cookie;
+	w->profiler->end(AESProfiler::CIPHER);
+	w->profiler->begin();
+	size_t n = fwrite(buf, 1, size, w->stream);
+	bool flushed = (fflush(w->stream) == 0);
+	w->profiler->end(AESProfiler::WRITE);
+	w->profiler->begin();
+	return (n < size || !flushed) ? -1 : n;
+}
+
+
+static int watchedSeek (void *cookie, off64_t *pos, int whence)
+{
+	Watched *w = (Watched *)cookie;
+	if (fseeko(w->stream, *pos, whence) != 0)
+		return -1;
+	*pos = ftello(w->stream);
+	return 0;
+}
+
+
+static int watchedClose (void *cookie)
+{
+	delete (Watched *)cookie;
+	return 0;
+}
+
+
+static FILE *watch (AESProfiler *profiler, FILE *stream, size_t *bytes, const char *mode)
+{
+	cookie_io_functions_t io;
+	memset(&io, 0, sizeof(io));
+	io.read = watchedRead;
+	io.write = watchedWrite;
+	io.seek = watchedSeek;
+	io.close = watchedClose;
+	Watched *w = new Watched;
+	w->profiler = profiler;
+	w->stream = stream;
+	w->bytes = bytes;
+	FILE *f = fopencookie(w, mode, io);
+	if (f == NULL) {
+		delete w;
+		throw bad_alloc();
+	}
+	setvbuf(f, NULL, _IONBF, 0);
+	return f;
+}
+
+
+void AESProfiler::run (FILE *&infile, FILE *&outfile, const function<void ()>& work)
+{
+	FILE *in = infile;
+	FILE *out = outfile;
+	size_t written = 0;
+	FILE *watchedin = watch(this, in, &bytes, "r");
+	FILE *watchedout = NULL;
+	try {
+		watchedout = watch(this, out, &written, "w");
+		infile = watchedin;
+		outfile = watchedout;
+		begin();
+		work();
+		end(CIPHER);
+	} catch (...) {
+		if (watchedout != NULL)
+			fclose(watchedout);
+		fclose(watchedin);
+		infile = in;
+		outfile = out;
+		throw;
+	}
+	fclose(watchedout);
+	fclose(watchedin);
+	infile = in;
+	outfile = out;
+}
+
+
+/*
+**  Reporting
+*/
+
+void AESProfiler::report (FILE *f, const char *title)
+{
+	if (title != NULL)
+		fprintf(f, "%s\n", title);
+	if (!available())
+		fprintf(f, "hardware counters unavailable: %s\n", reason.c_str());
+	else if (!kernel)
+		fprintf(f, "counting user space only (perf_event_paranoid)\n");
+
+	fprintf(f, "%-14s %10s", "stage", "ms");
+	for (int c = 0; c < COUNTERS; ++c)
+		fprintf(f, " %10s", COUNTER_NAMES[c]);
+	fprintf(f, "\n");
+
+	// every stage is per byte of input, key expansion included, so the
+	// rows add up to the total
+	double perbyte = 1.0 / (bytes > 0 ? bytes : 1);
+	uint64_t sum[COUNTERS] = { 0 };
+	uint64_t sumnanos = 0;
+	for (int s = 0; s <= STAGES; ++s) {
+		const uint64_t *values = (s < STAGES) ? totals[s] : sum;
+		uint64_t ns = (s < STAGES) ? nanos[s] : sumnanos;
+		fprintf(f, "%-14s %10.3f", s < STAGES ? STAGE_NAMES[s] : "total", ns / 1e6);
+		for (int c = 0; c < COUNTERS; ++c) {
+			if (available((Counter)c))
+				fprintf(f, " %10.3f", values[c] * perbyte);
+			else
+				fprintf(f, " %10s", "-");
+			if (s < STAGES)
+				sum[c] += values[c];
+		}
+		if (s < STAGES)
+			sumnanos += ns;
+		fprintf(f, "\n");
+	}
+	fprintf(f, "%zu bytes\n", bytes);
+}
+
+
+void AESProfiler::benchmark (FILE *f)
+{
+	static const AESEngine::Backend BACKENDS[] = {
+		AESEngine::AES_BACKEND_TABLE,
+		AESEngine::AES_BACKEND_VPERM
+	};
+	const size_t len = 1024 * 1024;
+	AESBuffer buffer(len);
+	uint8_t *data = buffer.get();
+	memset(data, 0, len);
+	vector<uint8_t> key(16, 0x5a);
+
+	for (unsigned int b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++b) {
+		if (!AESEngine::backendAvailable(BACKENDS[b]))
+			continue;
+		AESProfiler profiler;
+		unique_ptr<AESEngine> engine = profiler.expandKey(AESEngine::AES_128_ECB, key, BACKENDS[b]);
+		profiler.begin();
+		for (size_t off = 0; off < len; off += AES_BLOCK_SIZE)
+			engine->cipherBlock(data + off);
+		profiler.end(CIPHER);
+		profiler.bytes = len;
+
+		string title = string("backend ") + AESEngine::backendName(BACKENDS[b]);
+		profiler.report(f, title.c_str());
+		fprintf(f, "\n");
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+
+using namespace std;
+
+
+/*
+**  Per-stage hardware counters for the calling thread, read through
+**  perf_event_open: cycles, instructions, L1D read misses and branch
+**  misses. Kernel time is included when perf_event_paranoid allows it
+**  and left out otherwise. Counters the CPU (or hypervisor) does not
+**  have are reported as missing; the wall time of each stage is always
+**  there, so a run still says where the time went.
+**
+**  run() profiles the real pipeline: it points the two streams at ones
+**  that charge every read and write to READ and WRITE, and everything else
+**  the work does (rounds, padding, MAC, compression, handing batches to
+**  the workers) to CIPHER. Threads started after the profiler, such as
+**  AESParallel's workers, are counted with it where the kernel allows.
+*/
+
+class AESProfiler
+{
+public:
+
+	enum Stage {
+		KEY_EXPANSION,
+		CIPHER,
+		READ,
+		WRITE,
+		STAGES
+	};
+
+	enum Counter {
+		CYCLES,
+		INSTRUCTIONS,
+		L1D_MISSES,
+		BRANCH_MISSES,
+		COUNTERS
+	};
+
+private:
+
+	int leader;
+	int fds[COUNTERS];
+	int slots[COUNTERS];
+	unsigned int nopen;
+	bool kernel;
+	string reason;
+
+	uint64_t start[COUNTERS];
+	uint64_t started;
+	uint64_t totals[STAGES][COUNTERS];
+	uint64_t nanos[STAGES];
+	size_t bytes;
+
+	void sample (uint64_t *values);
+
+public:
+
+	AESProfiler ();
+	~AESProfiler ();
+
+	AESProfiler (const AESProfiler&) = delete;
+	AESProfiler& operator= (const AESProfiler&) = delete;
+
+	bool available ();
+	bool available (Counter c);
+
+	void begin ();
+	void end (Stage s);
+	void reset ();
+
+	unique_ptr<AESEngine> expandKey (AESEngine::AESMode m, const vector<uint8_t>& k,
+		AESEngine::Backend b = AESEngine::AES_BACKEND_AUTO);
+	void run (FILE *&infile, FILE *&outfile, const function<void ()>& work);
+
+	void report (FILE *f, const char *title = NULL);
+
+	static void benchmark (FILE *f);
+};
@@ -3,6 +3,10 @@
 
 echo -n "Running acceptance tests ... "
 
+# keep the tuning profile out of the home directory
+export AES_PROFILE="$PWD/profile.txt"
+rm -f profile.txt
+
 
 echo "Hello World!" | md5sum > original.md5
 echo "Hello World!" | ./aes e | ./aes d | md5sum > verify.md5
@@ -53,6 +57,229 @@ if [ -n "$(diff original.md5 verify.md5)" ]; then
 	exit 1
 fi
 
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -j 4 | ./aes d -j 3 | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -m cbc -s 192 | ./aes d -m cbc -s 192 -j 4 | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -m cbc -b table | ./aes d -m cbc -b vperm | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+./aes g > key.bin
+./aes g > mackey.bin
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -m cbc -t tag.bin -a mackey.bin key.bin > encrypted.bin
+./aes d -m cbc -t tag.bin -a mackey.bin key.bin < encrypted.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+echo "other" | ./aes e -m cbc -t wrongtag.bin -a mackey.bin key.bin > /dev/null
+if ./aes d -m cbc -t wrongtag.bin -a mackey.bin key.bin < encrypted.bin > decrypted.bin 2> /dev/null \
+		|| [ -s decrypted.bin ] \
+		|| cat encrypted.bin | ./aes d -m cbc -t wrongtag.bin -a mackey.bin key.bin > /dev/null 2>&1 \
+		|| ! cat encrypted.bin | ./aes d -m cbc -t tag.bin -a mackey.bin key.bin | cmp -s - aes.cc; then
+	echo "FAIL"
+	exit 1
+fi
+rm -f wrongtag.bin decrypted.bin
+if ! ./aes v -t tag.bin mackey.bin < aes.cc; then
+	echo "FAIL"
+	exit 1
+fi
+if echo "tampered" | ./aes v -t tag.bin mackey.bin 2> /dev/null; then
+	echo "FAIL"
+	exit 1
+fi
+head -c 8 key.bin > truncated.bin
+if echo "hello" | ./aes e nonexistent.key > /dev/null 2>&1 || echo "hello" | ./aes e truncated.bin > /dev/null 2>&1 \
+		|| echo "hello" | ./aes e -t tag.bin -a nonexistent.key key.bin > /dev/null 2>&1; then
+	echo "FAIL"
+	exit 1
+fi
+
+cat aes.cc | md5sum > original.md5
+cat aes.cc aes.cc aes.cc | ./aes e -z -j 3 > encrypted.bin
+cat encrypted.bin | ./aes d -j 2 | head -c $(wc -c < aes.cc) | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ] || [ $(wc -c < encrypted.bin) -ge $(wc -c < aes.cc) ]; then
+	echo "FAIL"
+	exit 1
+fi
+cat aes.cc | ./aes e -z -m cbc -s 256 | ./aes d -m cbc -s 256 | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+./aes s -S "$PWD/aes.sock" -j 2 &
+daemon=$!
+for i in $(seq 50); do
+	[ -S aes.sock ] && break
+	sleep 0.1
+done
+cat aes.cc | ./aes e -m cbc key.bin | md5sum > original.md5
+cat aes.cc | ./aes e -m cbc -S aes.sock key.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	kill $daemon
+	echo "FAIL"
+	exit 1
+fi
+for i in $(seq 20); do cat aes.cc; done | md5sum > original.md5
+for i in $(seq 20); do cat aes.cc; done | ./aes e -S aes.sock key.bin | ./aes d -S aes.sock key.bin | md5sum > verify.md5
+outside=$(mktemp)
+./aes g > "$outside"
+./aes g > truncated.bin
+echo "hello" | ./aes e -S aes.sock truncated.bin > /dev/null
+./aes g -n 32 > truncated.bin
+if echo "hello" | ./aes e -S aes.sock "$outside" > /dev/null 2>&1 \
+		|| [ "$(echo "hello" | ./aes e -S aes.sock truncated.bin | md5sum)" != "$(echo "hello" | ./aes e truncated.bin | md5sum)" ]; then
+	rm -f "$outside"
+	kill $daemon
+	echo "FAIL"
+	exit 1
+fi
+rm -f "$outside"
+kill $daemon
+wait $daemon
+if [ -n "$(diff original.md5 verify.md5)" ] || [ -e aes.sock ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+if [ -n "$(nm -D --defined-only libaes.so | awk '{ print $3 }' | grep -v '^aes_' | grep -v '^LIBAES_')" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+if [ ! -s profile.txt ]; then
+	echo "FAIL"
+	exit 1
+fi
+./aes b > /dev/null
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -T -c 4096 | ./aes d -j 2 | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+cat aes.cc | md5sum > original.md5
+cat aes.cc | ./aes e -P -z -j 2 -m cbc key.bin 2> perf.txt | ./aes d -m cbc key.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ] || ! grep -q "^total" perf.txt; then
+	echo "FAIL"
+	exit 1
+fi
+
+./aes g > newkey.bin
+cat aes.cc | md5sum > original.md5
+cat aes.cc aes.cc | ./aes e -m cbc key.bin > encrypted.bin
+./aes r -m cbc -j 3 -c 4096 -i encrypted.bin -o encrypted.bin key.bin newkey.bin
+./aes d -m cbc -i encrypted.bin newkey.bin | head -c $(wc -c < aes.cc) | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ]; then
+	echo "FAIL"
+	exit 1
+fi
+cat aes.cc | ./aes e -m cbc -t tag.bin -a mackey.bin key.bin > encrypted.bin
+cp encrypted.bin truncated.bin
+if ./aes r -m cbc -i encrypted.bin -o encrypted.bin key.bin nonexistent.key 2> /dev/null \
+		|| ./aes r -m cbc -t tag.bin -a mackey.bin -i encrypted.bin -o encrypted.bin newkey.bin key.bin 2> /dev/null \
+		|| ! cmp -s encrypted.bin truncated.bin \
+		|| ! ./aes r -m cbc -t tag.bin -a mackey.bin -i encrypted.bin -o encrypted.bin key.bin newkey.bin \
+		|| ! ./aes d -m cbc -t tag.bin -a mackey.bin newkey.bin < encrypted.bin | cmp -s - aes.cc; then
+	echo "FAIL"
+	exit 1
+fi
+head -c 100 aes.cc > truncated.bin
+if ./aes r -i truncated.bin -o truncated.bin key.bin newkey.bin 2> /dev/null || ! cmp -s truncated.bin <(head -c 100 aes.cc); then
+	echo "FAIL"
+	exit 1
+fi
+
+cat aes.cc aes.cc | ./aes e -m cbc -M -c 4096 -j 3 -a mackey.bin key.bin > encrypted.bin
+cat aes.cc | md5sum > original.md5
+./aes d -m cbc -a mackey.bin -R $(wc -c < aes.cc):$(wc -c < aes.cc) key.bin < encrypted.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ] || ! ./aes v -m cbc -a mackey.bin key.bin < encrypted.bin; then
+	echo "FAIL"
+	exit 1
+fi
+printf "\\$(printf %o $(( $(od -An -tu1 -j 5000 -N 1 encrypted.bin) ^ 1 )))" | dd of=encrypted.bin bs=1 seek=5000 conv=notrunc 2> /dev/null
+if ./aes d -m cbc -a mackey.bin -j 2 key.bin < encrypted.bin > /dev/null 2>&1; then
+	echo "FAIL"
+	exit 1
+fi
+
+head -c 1000003 /dev/urandom > truncated.bin
+./aes e -D -m cbc -j 2 -i truncated.bin -o encrypted.bin key.bin
+./aes d -D -m cbc -i encrypted.bin key.bin | cmp -s - truncated.bin
+if [ $? -ne 0 ] || ! ./aes e -m cbc key.bin < truncated.bin | cmp -s - encrypted.bin; then
+	echo "FAIL"
+	exit 1
+fi
+./aes e -D -m cbc -t direct.tag -a mackey.bin -i truncated.bin -o encrypted.bin key.bin
+./aes d -D -m cbc -t direct.tag -a mackey.bin -i encrypted.bin key.bin | cmp -s - truncated.bin
+if [ $? -ne 0 ] || ./aes d -D -m cbc -t direct.tag -a key.bin -i encrypted.bin -o verify.md5 key.bin 2> /dev/null \
+		|| [ -s verify.md5 ]; then
+	echo "FAIL"
+	exit 1
+fi
+rm -f direct.tag
+for skip in 6 4096; do
+	{ head -c $skip aes.cc; ./aes e -D -m cbc -j 2 key.bin < truncated.bin; printf "tail"; } > encrypted.bin
+	if ! { head -c $skip aes.cc; ./aes e -m cbc key.bin < truncated.bin; printf "tail"; } | cmp -s - encrypted.bin; then
+		echo "FAIL"
+		exit 1
+	fi
+	head -c -4 encrypted.bin > verify.md5
+	{ dd bs=$skip count=1 of=/dev/null 2> /dev/null; ./aes d -D -m cbc key.bin; } < verify.md5 | cmp -s - truncated.bin
+	if [ $? -ne 0 ]; then
+		echo "FAIL"
+		exit 1
+	fi
+done
+
+cat aes.cc aes.cc | ./aes f -m cbc -j 3 -c 4096 key.bin encrypted.bin newkey.bin truncated.bin
+cat aes.cc aes.cc | md5sum > original.md5
+./aes d -m cbc key.bin < encrypted.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ] || ! cat aes.cc aes.cc | ./aes e -m cbc newkey.bin | cmp -s - truncated.bin; then
+	echo "FAIL"
+	exit 1
+fi
+
+cp key.bin truncated.bin
+if ./aes f -i truncated.bin key.bin truncated.bin 2> /dev/null || ./aes f -i aes.cc key.bin encrypted.bin nonexistent.key verify.md5 2> /dev/null \
+		|| ! cmp -s key.bin truncated.bin; then
+	echo "FAIL"
+	exit 1
+fi
+
+started=$(date +%s%N)
+head -c 1000000 /dev/urandom | tee encrypted.bin | md5sum > original.md5
+./aes e -m cbc -r 2M -L 50 -l -j 2 key.bin < encrypted.bin | ./aes d -m cbc -j 2 key.bin | md5sum > verify.md5
+if [ -n "$(diff original.md5 verify.md5)" ] || [ $(( $(date +%s%N) - started )) -lt 400000000 ]; then
+	echo "FAIL"
+	exit 1
+fi
+
+if [ $(./aes g -n 1000000 | wc -c) -ne 1000000 ] || [ $(./aes g -n 0 | head -c 300000 | wc -c) -ne 300000 ] \
+		|| [ $(./aes g -n 1M | wc -c) -ne 1048576 ] || ./aes g -n foo > /dev/null 2>&1 || ./aes g -n 1Q > /dev/null 2>&1 \
+		|| echo "hello" | ./aes e -j -1 key.bin > /dev/null 2>&1 || echo "hello" | ./aes e -j abc key.bin > /dev/null 2>&1; then
+	echo "FAIL"
+	exit 1
+fi
+
 echo "PASS"
 
-rm original.md5 verify.md5
+rm original.md5 verify.md5 key.bin newkey.bin mackey.bin tag.bin encrypted.bin truncated.bin profile.txt perf.txt
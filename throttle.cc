@@ -0,0 +1,212 @@
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "throttle.h"
+
+using namespace std;
+
+
+// from linux/ioprio.h, which not every libc installs
+#define AES_IOPRIO_WHO_PROCESS 1
+#define AES_IOPRIO_CLASS_IDLE 3
+#define AES_IOPRIO_CLASS_SHIFT 13
+
+#define AES_THROTTLE_NICE 19
+
+
+static double secondsBetween (chrono::steady_clock::time_point a, chrono::steady_clock::time_point b)
+{
+	return chrono::duration<double>(b - a).count();
+}
+
+
+AESThrottle::AESThrottle (uint64_t bytesPerSecond, double fraction, FILE *r)
+	: rate((double)bytesPerSecond),
+	  share(fraction),
+	  report(r),
+	  box(max(1L, sysconf(_SC_NPROCESSORS_ONLN))),
+	  startCPU(processCPU()),
+	  tokens(0),
+	  bytes(0),
+	  throttled(0),
+	  boxBusy(0),
+	  boxTotal(0),
+	  ownCPU(startCPU),
+	  active(0),
+	  limit(0),
+	  windowBytes(0),
+	  windowRate(0)
+{
+	start = last = sampled = windowStart = printed = Clock::now();
+	readBoxTimes(boxBusy, boxTotal);
+}
+
+
+/*
+**  The cores the job may use: what the other processes leave idle, and
+**  no more than its share. At least one, so it always makes progress.
+*/
+
+void AESThrottle::resample (Clock::time_point now)
+{
+	double wall = secondsBetween(sampled, now);
+	double cpu = processCPU();
+	uint64_t busy, total;
+	double budget = box;
+	if (readBoxTimes(busy, total) && total > boxTotal) {
+		double used = box * (double)(busy - boxBusy) / (double)(total - boxTotal);
+		double own = (wall > 0) ? (cpu - ownCPU) / wall : 0;
+		budget = box - max(0.0, used - own);
+		boxBusy = busy;
+		boxTotal = total;
+	}
+	if (share > 0)
+		budget = min(budget, share * box);
+	active = max(1U, (unsigned int)floor(budget + 0.5));
+	ownCPU = cpu;
+	sampled = now;
+}
+
+
+unsigned int AESThrottle::workers (unsigned int max)
+{
+	lock_guard<mutex> hold(lock);
+	Clock::time_point now = Clock::now();
+	if (active == 0 || secondsBetween(sampled, now) >= AES_THROTTLE_INTERVAL)
+		resample(now);
+	limit = min(active, max);
+	return limit;
+}
+
+
+void AESThrottle::pace (size_t n)
+{
+	double sleep = 0;
+	{
+		lock_guard<mutex> hold(lock);
+		Clock::time_point now = Clock::now();
+		bytes += n;
+		windowBytes += n;
+
+		if (rate > 0) {
+			tokens = min(rate, tokens + rate * secondsBetween(last, now));
+			tokens -= n;
+			if (tokens < 0)
+				sleep = -tokens / rate;
+		}
+		if (share > 0) {
+			// ahead of the share by this many CPU seconds
+			double excess = (processCPU() - startCPU) - share * box * secondsBetween(start, now);
+			if (excess > 0)
+				sleep = max(sleep, excess / (share * box));
+		}
+		throttled += sleep;
+		last = now;
+	}
+
+	if (sleep > 0)
+		this_thread::sleep_for(chrono::duration<double>(sleep));
+
+	unique_lock<mutex> hold(lock);
+	Clock::time_point now = Clock::now();
+	// the tokens slept for have been earned
+	last = now;
+	if (rate > 0 && tokens < 0)
+		tokens = 0;
+
+	double window = secondsBetween(windowStart, now);
+	if (window >= 1) {
+		windowRate = windowBytes / window;
+		windowStart = now;
+		windowBytes = 0;
+	}
+	if (report != NULL && secondsBetween(printed, now) >= 1) {
+		printed = now;
+		hold.unlock();
+		print(report);
+	}
+}
+
+
+AESThrottle::Stats AESThrottle::stats ()
+{
+	lock_guard<mutex> hold(lock);
+	Stats s;
+	s.bytes = bytes;
+	s.seconds = secondsBetween(start, Clock::now());
+	s.average = (s.seconds > 0) ? bytes / s.seconds : 0;
+	s.rate = (windowRate > 0) ? windowRate : s.average;
+	s.throttled = throttled;
+	s.workers = limit;
+	return s;
+}
+
+
+void AESThrottle::print (FILE *out)
+{
+	Stats s = stats();
+	fprintf(out, "aes: %.1f MiB in %.1f s, %.1f MiB/s now, %.1f MiB/s average, "
+		"%.0f%% throttled, %u workers\n",
+		s.bytes / 1048576.0, s.seconds, s.rate / 1048576.0, s.average / 1048576.0,
+		(s.seconds > 0) ? 100 * s.throttled / s.seconds : 0.0, s.workers);
+	fflush(out);
+}
+
+
+double AESThrottle::processCPU ()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+**  The first line of /proc/stat adds up every cpu: busy is all but the
+**  idle and iowait ticks.
+*/
+
+bool AESThrottle::readBoxTimes (uint64_t& busy, uint64_t& total)
+{
+	FILE *f = fopen("/proc/stat", "r");
+	if (f == NULL)
+		return false;
+	unsigned long long t[8] = { 0 };
+	int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&t[0], &t[1], &t[2], &t[3], &t[4], &t[5], &t[6], &t[7]);
+	fclose(f);
+	if (n < 5)
+		return false;
+	total = 0;
+	for (int k = 0; k < 8; ++k)
+		total += t[k];
+	busy = total - t[3] - t[4];
+	return true;
+}
+
+
+/*
+**  The lowest CPU and I/O priority for the calling thread. Both are per
+**  thread on Linux and inherited by threads it starts afterwards, so
+**  calling this before the workers start covers every one of them.
+*/
+
+bool AESThrottle::lowerPriority ()
+{
+	bool ok = (setpriority(PRIO_PROCESS, 0, AES_THROTTLE_NICE) == 0);
+	int ioprio = AES_IOPRIO_CLASS_IDLE << AES_IOPRIO_CLASS_SHIFT;
+	ok = (syscall(SYS_ioprio_set, AES_IOPRIO_WHO_PROCESS, 0, ioprio) == 0) && ok;
+	return ok;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+
+#define AES_THROTTLE_INTERVAL 0.25
+
+
+/*
+**  Paces a long job so it shares the box instead of taking all of it.
+**
+**  rate caps the bytes per second with a token bucket that holds at most
+**  one second's worth and starts empty. share caps the CPU time, as a
+**  fraction of every core on the box: the CPU time the process spends
+**  from construction on is measured against the wall clock, and any
+**  excess is slept off. Either is off when 0. pace() is called by the
+**  I/O loop after each batch and does the sleeping; workers() says how
+**  many of the job's workers should take the next batch, from the share
+**  and from how much of the box the other processes are using, sampled
+**  every AES_THROTTLE_INTERVAL seconds.
+**
+**  With a report stream, pace() writes the live rate to it once a second.
+*/
+
+class AESThrottle
+{
+public:
+	struct Stats {
+		uint64_t bytes;
+		double seconds;
+		double rate;
+		double average;
+		double throttled;
+		unsigned int workers;
+	};
+
+private:
+
+	typedef chrono::steady_clock Clock;
+
+	const double rate;
+	const double share;
+	FILE *report;
+	const unsigned int box;
+
+	mutex lock;
+	Clock::time_point start;
+	double startCPU;
+	Clock::time_point last;
+	double tokens;
+	uint64_t bytes;
+	double throttled;
+
+	// the last sample of the box and of this process, for workers()
+	Clock::time_point sampled;
+	uint64_t boxBusy;
+	uint64_t boxTotal;
+	double ownCPU;
+	unsigned int active;
+	unsigned int limit;
+
+	// the window the current rate is taken over
+	Clock::time_point windowStart;
+	uint64_t windowBytes;
+	double windowRate;
+	Clock::time_point printed;
+
+	void resample (Clock::time_point now);
+
+public:
+
+	AESThrottle (uint64_t bytesPerSecond = 0, double fraction = 0, FILE *r = NULL);
+
+	void pace (size_t n);
+	unsigned int workers (unsigned int max);
+
+	Stats stats ();
+	void print (FILE *out);
+
+	static double processCPU ();
+	static bool readBoxTimes (uint64_t& busy, uint64_t& total);
+	static bool lowerPriority ();
+};
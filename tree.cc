@@ -0,0 +1,521 @@
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "arena.h"
+#include "parallel.h"
+#include "compress.h"
+#include "tree.h"
+
+using namespace std;
+
+
+static void put64 (uint8_t *p, uint64_t n)
+{
+	for (int k = 7; k >= 0; --k, n >>= 8)
+		p[k] = (uint8_t)n;
+}
+
+
+static uint64_t get64 (const uint8_t *p)
+{
+	uint64_t n = 0;
+	for (int k = 0; k < 8; ++k)
+		n = (n << 8) | p[k];
+	return n;
+}
+
+
+static bool atEnd (FILE *in)
+{
+	int c = getc(in);
+	if (c == EOF)
+		return true;
+	ungetc(c, in);
+	return false;
+}
+
+
+static void readAt (FILE *in, off_t pos, uint8_t *buf, size_t len)
+{
+	if (fseeko(in, pos, SEEK_SET) != 0 || readChunk(buf, len, in) != len)
+		throw CorruptAESTree("truncated tree");
+}
+
+
+/*
+**  The MACs: every chunk's is taken on a copy of the engine, since the
+**  CMAC state lives in it and several chunks are MACed at once.
+*/
+
+static void leafTag (const AESEngine& mac, uint64_t index, const uint8_t *data, size_t len, uint8_t *tag)
+{
+	AESEngine m(mac);
+	uint8_t prefix[9];
+	prefix[0] = 0x00;
+	put64(prefix + 1, index);
+	m.cmacInit();
+	m.cmacUpdate(prefix, sizeof(prefix));
+	m.cmacUpdate(data, len);
+	m.cmacFinal(tag);
+}
+
+
+static void nodeTag (AESEngine& mac, const uint8_t *left, const uint8_t *right, uint8_t *tag)
+{
+	if (right == NULL) {
+		memcpy(tag, left, AES_BLOCK_SIZE);
+		return;
+	}
+	uint8_t prefix = 0x01;
+	mac.cmacInit();
+	mac.cmacUpdate(&prefix, 1);
+	mac.cmacUpdate(left, AES_BLOCK_SIZE);
+	mac.cmacUpdate(right, AES_BLOCK_SIZE);
+	mac.cmacFinal(tag);
+}
+
+
+/*
+**  The nodes of a tree being built, as they are made. A level keeps at
+**  most one node, the left one still waiting for its sibling, so memory
+**  does not grow with the file. The stored nodes go out level by level
+**  after the last chunk, so each level's nodes are spilled to a
+**  temporary file of its own until then.
+*/
+
+class NodeStack
+{
+private:
+
+	AESEngine& mac;
+	vector<FILE *> spills;
+	vector<uint64_t> counts;
+	vector<uint8_t> waiting;
+	vector<bool> held;
+
+public:
+
+	NodeStack (AESEngine& m)
+		: mac(m)
+	{}
+
+	~NodeStack ()
+	{
+		for (size_t l = 0; l < spills.size(); ++l)
+			fclose(spills[l]);
+	}
+
+	void push (size_t level, const uint8_t *node)
+	{
+		uint8_t carry[AES_BLOCK_SIZE];
+		memcpy(carry, node, AES_BLOCK_SIZE);
+		for (;; ++level) {
+			if (level == spills.size()) {
+				FILE *f = tmpfile();
+				if (f == NULL)
+					throw bad_alloc();
+				spills.push_back(f);
+				counts.push_back(0);
+				waiting.resize(spills.size() * AES_BLOCK_SIZE);
+				held.push_back(false);
+			}
+			fwrite(carry, 1, AES_BLOCK_SIZE, spills[level]);
+			++counts[level];
+			uint8_t *left = &waiting[level * AES_BLOCK_SIZE];
+			if (!held[level]) {
+				memcpy(left, carry, AES_BLOCK_SIZE);
+				held[level] = true;
+				return;
+			}
+			uint8_t parent[AES_BLOCK_SIZE];
+			nodeTag(mac, left, carry, parent);
+			memcpy(carry, parent, AES_BLOCK_SIZE);
+			held[level] = false;
+		}
+	}
+
+	// a node left without a sibling moves up unchanged, until one level
+	// holds a single node: the top
+	void finish (uint8_t *top, FILE *out)
+	{
+		size_t l = 0;
+		for (; counts[l] > 1; ++l) {
+			if (held[l]) {
+				uint8_t node[AES_BLOCK_SIZE];
+				memcpy(node, &waiting[l * AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+				held[l] = false;
+				push(l + 1, node);
+			}
+		}
+		memcpy(top, &waiting[l * AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+
+		AESBuffer buffer(AES_CHUNK_SIZE);
+		uint8_t *buf = buffer.get();
+		for (size_t k = 0; k <= l; ++k) {
+			if (fflush(spills[k]) != 0 || fseeko(spills[k], 0, SEEK_SET) != 0)
+				throw CorruptAESTree("unable to spill the tree");
+			uint64_t left = counts[k] * AES_BLOCK_SIZE;
+			while (left > 0) {
+				size_t n = readChunk(buf, min((uint64_t)AES_CHUNK_SIZE, left), spills[k]);
+				if (n == 0)
+					throw CorruptAESTree("unable to spill the tree");
+				fwrite(buf, 1, n, out);
+				left -= n;
+			}
+		}
+	}
+};
+
+
+/*
+**  One chunk in or out; iv is NULL under ECB. Only the file's last chunk
+**  is padded, and in and out do not overlap.
+*/
+
+static size_t sealChunk (AESEngine& engine, const uint8_t *iv, const uint8_t *in, size_t len,
+	bool last, uint8_t *out)
+{
+	size_t size = last ? len - (len % AES_BLOCK_SIZE) + AES_BLOCK_SIZE : len;
+	memcpy(out, in, len);
+	if (last)
+		AESEngine::pad(out + len - (len % AES_BLOCK_SIZE), len % AES_BLOCK_SIZE);
+
+	if (iv == NULL) {
+		engine.cipherBlocks(out, size / AES_BLOCK_SIZE);
+		return size;
+	}
+	uint8_t chain[AES_BLOCK_SIZE];
+	memcpy(chain, iv, AES_BLOCK_SIZE);
+	for (size_t off = 0; off < size; off += AES_BLOCK_SIZE) {
+		AESEngine::encryptCBC(out + off, chain);
+		engine.cipherBlock(out + off);
+		memcpy(chain, out + off, AES_BLOCK_SIZE);
+	}
+	return size;
+}
+
+
+static size_t openChunk (AESEngine& engine, uint8_t *iv, uint8_t *in, size_t size,
+	bool last, uint8_t *out)
+{
+	memcpy(out, in, size);
+	engine.invCipherBlocks(out, size / AES_BLOCK_SIZE);
+	if (iv != NULL) {
+		AESEngine::decryptCBC(out, iv);
+		for (size_t off = AES_BLOCK_SIZE; off < size; off += AES_BLOCK_SIZE)
+			AESEngine::decryptCBC(out + off, in + off - AES_BLOCK_SIZE);
+	}
+	if (!last)
+		return size;
+	return size - AES_BLOCK_SIZE + AESEngine::unpad(out + size - AES_BLOCK_SIZE);
+}
+
+
+//
+//    mmmmmmm
+//       #     m mm   mmm    mmm
+//       #     #"  " #"  #  #"  #
+//       #     #     #""""  #""""
+//       #     #     "#mm"  "#mm"
+//
+
+
+AESTree::AESTree (AESEngine& e, AESEngine& m, unsigned int n, size_t c)
+	: engine(e), mac(m), nthreads(n == 0 ? AESParallel::cpus().size() : n), chunk(c)
+{
+	if (chunk == 0 || (chunk % AES_BLOCK_SIZE) != 0 || chunk > AES_TREE_MAX_CHUNK)
+		throw CorruptAESTree("unsupported tree chunk size");
+}
+
+
+vector<uint64_t> AESTree::widths (uint64_t count)
+{
+	vector<uint64_t> w(1, count);
+	while (w.back() > 1)
+		w.push_back((w.back() + 1) / 2);
+	return w;
+}
+
+
+void AESTree::chunkIV (uint64_t index, uint8_t *iv)
+{
+	memset(iv, 0, AES_BLOCK_SIZE);
+	put64(iv + 8, index);
+	engine.cipherBlock(iv);
+}
+
+
+void AESTree::rootTag (uint64_t length, uint64_t count, const uint8_t *top, uint8_t *tag)
+{
+	uint8_t prefix[21];
+	prefix[0] = 0x02;
+	put64(prefix + 1, length);
+	put64(prefix + 9, count);
+	prefix[17] = (uint8_t)(chunk >> 24);
+	prefix[18] = (uint8_t)(chunk >> 16);
+	prefix[19] = (uint8_t)(chunk >> 8);
+	prefix[20] = (uint8_t)chunk;
+	mac.cmacInit();
+	mac.cmacUpdate(prefix, sizeof(prefix));
+	mac.cmacUpdate(top, AES_BLOCK_SIZE);
+	mac.cmacFinal(tag);
+}
+
+
+void AESTree::encryptFile (FILE *infile, FILE *outfile)
+{
+	uint8_t head[AES_HEADER_SIZE];
+	AESHeader(AES_HEADER_TREE, chunk).write(head);
+	fwrite(head, 1, AES_HEADER_SIZE, outfile);
+
+	const size_t batch = nthreads * chunk;
+	const size_t stride = chunk + AES_BLOCK_SIZE;
+	AESBuffer inbuffer(batch);
+	AESBuffer outbuffer(nthreads * stride);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+	vector<size_t> sizes(nthreads);
+	vector<uint8_t> leaves(nthreads * AES_BLOCK_SIZE);
+	NodeStack stack(mac);
+	const bool cbc = engine.isModeCBC();
+
+	uint64_t index = 0;
+	uint64_t length = 0;
+	bool last = false;
+	while (!last) {
+		// the last chunk is padded, so the end has to be seen before it
+		size_t count = readChunk(inbuf, batch, infile);
+		last = (count < batch || atEnd(infile));
+		size_t n = last ? max((size_t)1, (count + chunk - 1) / chunk) : nthreads;
+
+		parallelFor(n, nthreads, [&](size_t k) {
+			uint8_t iv[AES_BLOCK_SIZE];
+			if (cbc)
+				chunkIV(index + k, iv);
+			sizes[k] = sealChunk(engine, cbc ? iv : NULL, inbuf + k * chunk,
+				min(chunk, count - k * chunk), last && k == n - 1, outbuf + k * stride);
+			leafTag(mac, index + k, outbuf + k * stride, sizes[k], &leaves[k * AES_BLOCK_SIZE]);
+		});
+		for (size_t k = 0; k < n; ++k) {
+			fwrite(outbuf + k * stride, 1, sizes[k], outfile);
+			stack.push(0, &leaves[k * AES_BLOCK_SIZE]);
+		}
+
+		index += n;
+		length += count;
+	}
+	memset(inbuf, 0, batch);
+
+	uint8_t top[AES_BLOCK_SIZE];
+	stack.finish(top, outfile);
+
+	uint8_t footer[AES_TREE_FOOTER];
+	put64(footer, length);
+	put64(footer + 8, index);
+	rootTag(length, index, top, footer + 16);
+	fwrite(footer, 1, AES_TREE_FOOTER, outfile);
+}
+
+
+/*
+**  The footer is taken at its word only as far as the layout goes: the
+**  sizes it implies have to add up to the file's, and its length and
+**  count are covered by the root, which checkPath() verifies.
+*/
+
+void AESTree::readTrailer (FILE *in, off_t base, Trailer& t)
+{
+	if (fseeko(in, 0, SEEK_END) != 0)
+		throw CorruptAESTree("the tree format needs a seekable input");
+	off_t end = ftello(in);
+	if (end < base + AES_HEADER_SIZE + 2 * AES_BLOCK_SIZE + AES_TREE_FOOTER)
+		throw CorruptAESTree("truncated tree");
+
+	uint8_t footer[AES_TREE_FOOTER];
+	readAt(in, end - AES_TREE_FOOTER, footer, AES_TREE_FOOTER);
+	t.length = get64(footer);
+	t.count = get64(footer + 8);
+	memcpy(t.root, footer + 16, AES_BLOCK_SIZE);
+
+	// every chunk is at least a block, which bounds the rest
+	uint64_t avail = end - base - AES_HEADER_SIZE - AES_TREE_FOOTER;
+	uint64_t expected = (t.length == 0) ? 1 : t.length / chunk + ((t.length % chunk) != 0);
+	if (t.count != expected || t.count > avail / AES_BLOCK_SIZE || t.count - 1 > avail / chunk)
+		throw CorruptAESTree("truncated tree");
+	uint64_t tail = t.length - (t.count - 1) * chunk;
+	t.last = tail - (tail % AES_BLOCK_SIZE) + AES_BLOCK_SIZE;
+	t.widths = widths(t.count);
+
+	uint64_t nodes = 0;
+	for (size_t l = 0; l < t.widths.size(); ++l)
+		nodes += t.widths[l];
+	uint64_t ciphertext = (t.count - 1) * chunk + t.last;
+	if (ciphertext > avail || nodes * AES_BLOCK_SIZE != avail - ciphertext)
+		throw CorruptAESTree("truncated tree");
+	t.chunks = base + AES_HEADER_SIZE;
+	t.nodes = t.chunks + ciphertext;
+}
+
+
+void AESTree::readNodes (FILE *in, const Trailer& t, size_t level, uint64_t first, uint64_t n, uint8_t *out)
+{
+	uint64_t start = 0;
+	for (size_t l = 0; l < level; ++l)
+		start += t.widths[l];
+	readAt(in, t.nodes + (start + first) * AES_BLOCK_SIZE, out, n * AES_BLOCK_SIZE);
+}
+
+
+/*
+**  Reads the leaves of chunks first .. last and climbs to the root,
+**  reading a stored sibling only where the range does not supply one.
+**  The leaves are then known to be the ones the root was made over. The
+**  stored nodes the climb passes through must match the ones it makes,
+**  so reading a whole file checks every byte of it.
+*/
+
+void AESTree::checkPath (FILE *in, const Trailer& t, uint64_t first, uint64_t last, vector<uint8_t>& leaves)
+{
+	uint64_t lo = first;
+	uint64_t hi = last;
+	leaves.resize((hi - lo + 1) * AES_BLOCK_SIZE);
+	readNodes(in, t, 0, lo, hi - lo + 1, &leaves[0]);
+
+	vector<uint8_t> level(leaves);
+	vector<uint8_t> span;
+	vector<uint8_t> next;
+	vector<uint8_t> stored;
+	for (size_t l = 0; t.widths[l] > 1; ++l) {
+		uint64_t slo = lo & ~(uint64_t)1;
+		uint64_t shi = min(hi | 1, t.widths[l] - 1);
+		span.resize((shi - slo + 1) * AES_BLOCK_SIZE);
+		if (slo < lo)
+			readNodes(in, t, l, slo, 1, &span[0]);
+		memcpy(&span[(lo - slo) * AES_BLOCK_SIZE], &level[0], level.size());
+		if (shi > hi)
+			readNodes(in, t, l, shi, 1, &span[(shi - slo) * AES_BLOCK_SIZE]);
+
+		next.resize((shi / 2 - slo / 2 + 1) * AES_BLOCK_SIZE);
+		for (uint64_t j = slo / 2; j <= shi / 2; ++j) {
+			uint64_t left = 2 * j - slo;
+			const uint8_t *right = (2 * j + 1 <= shi) ? &span[(left + 1) * AES_BLOCK_SIZE] : NULL;
+			nodeTag(mac, &span[left * AES_BLOCK_SIZE], right, &next[(j - slo / 2) * AES_BLOCK_SIZE]);
+		}
+		level.swap(next);
+		lo = slo / 2;
+		hi = shi / 2;
+
+		stored.resize(level.size());
+		readNodes(in, t, l + 1, lo, hi - lo + 1, &stored[0]);
+		if (!equal(stored.begin(), stored.end(), level.begin()))
+			throw CorruptAESTree();
+	}
+
+	uint8_t tag[AES_BLOCK_SIZE];
+	rootTag(t.length, t.count, &level[0], tag);
+	if (!AESEngine::cmacVerify(tag, t.root))
+		throw CorruptAESTree();
+}
+
+
+/*
+**  Checks the chunks holding plaintext bytes from .. to - 1 against their
+**  leaves, a batch at a time, and writes those bytes when out is given.
+**  Each batch's leaves are proven against the root before its chunks are
+**  read, so memory stays bounded by the batch however long the range,
+**  and a batch is written only once every chunk in it has passed.
+*/
+
+void AESTree::process (FILE *in, const Trailer& t, uint64_t from, uint64_t to, FILE *out)
+{
+	uint64_t first = from / chunk;
+	uint64_t last = (to == 0) ? 0 : (to - 1) / chunk;
+	vector<uint8_t> leaves;
+
+	const size_t stride = chunk + AES_BLOCK_SIZE;
+	AESBuffer inbuffer(nthreads * chunk + AES_BLOCK_SIZE);
+	AESBuffer outbuffer(out != NULL ? nthreads * stride : AES_BLOCK_SIZE);
+	uint8_t *inbuf = inbuffer.get();
+	uint8_t *outbuf = outbuffer.get();
+	vector<size_t> lengths(nthreads);
+	const bool cbc = engine.isModeCBC();
+
+	for (uint64_t index = first; index <= last; index += nthreads) {
+		size_t n = (size_t)min((uint64_t)nthreads, last - index + 1);
+		size_t size = (n - 1) * chunk + ((index + n == t.count) ? t.last : chunk);
+		checkPath(in, t, index, index + n - 1, leaves);
+		readAt(in, t.chunks + index * chunk, inbuf, size);
+
+		atomic<bool> forged(false);
+		atomic<bool> padding(false);
+		parallelFor(n, nthreads, [&](size_t k) {
+			uint64_t i = index + k;
+			uint8_t *data = inbuf + k * chunk;
+			size_t len = (k == n - 1) ? size - k * chunk : chunk;
+			uint8_t tag[AES_BLOCK_SIZE];
+			leafTag(mac, i, data, len, tag);
+			if (!AESEngine::cmacVerify(tag, &leaves[k * AES_BLOCK_SIZE])) {
+				forged = true;
+				return;
+			}
+			if (out == NULL)
+				return;
+			uint8_t iv[AES_BLOCK_SIZE];
+			if (cbc)
+				chunkIV(i, iv);
+			try {
+				lengths[k] = openChunk(engine, cbc ? iv : NULL, data, len, i == t.count - 1,
+					outbuf + k * stride);
+			} catch (IllegalAESPadding&) {
+				padding = true;
+			}
+		});
+		if (forged)
+			throw CorruptAESTree();
+		if (padding)
+			throw IllegalAESPadding();
+		if (out == NULL)
+			continue;
+
+		for (size_t k = 0; k < n; ++k) {
+			uint64_t i = index + k;
+			size_t begin = (i == first) ? from - i * chunk : 0;
+			size_t end = (i == last) ? to - i * chunk : lengths[k];
+			fwrite(outbuf + k * stride + begin, 1, end - begin, out);
+		}
+		memset(outbuf, 0, n * stride);
+	}
+}
+
+
+void AESTree::decryptFile (FILE *in, off_t base, FILE *out)
+{
+	Trailer t;
+	readTrailer(in, base, t);
+	process(in, t, 0, t.length, out);
+}
+
+
+void AESTree::readRange (FILE *in, off_t base, FILE *out, uint64_t offset, uint64_t len)
+{
+	Trailer t;
+	readTrailer(in, base, t);
+	uint64_t to = (len > t.length - min(offset, t.length)) ? t.length : offset + len;
+	if (offset >= to)
+		return;
+	process(in, t, offset, to, out);
+}
+
+
+void AESTree::verifyFile (FILE *in, off_t base)
+{
+	Trailer t;
+	readTrailer(in, base, t);
+	process(in, t, 0, t.length, NULL);
+}
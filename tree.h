@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <exception>
+
+#include <cstdio>
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_TREE_CHUNK (64 * 1024)
+#define AES_TREE_MAX_CHUNK (64 * 1024 * 1024)
+#define AES_TREE_FOOTER 32
+
+
+/*
+**  Authenticated chunks under a MAC tree. After the header (flag
+**  AES_HEADER_TREE, chunk = plaintext bytes per chunk) the file is
+**
+**      chunk[0] .. chunk[n - 1]  nodes  length[8] count[8] root[16]
+**
+**  Every chunk is encrypted on its own, so it can be read on its own:
+**  under CBC its IV is the encrypted chunk index. Only the last one is
+**  padded. Each leaf is the CMAC of 0x00, the index and the chunk's
+**  ciphertext; each node above is the CMAC of 0x01 and its two children,
+**  and a node left without a sibling moves up unchanged. The nodes are
+**  stored level by level from the leaves up, and root is the CMAC of 0x02,
+**  length, count, chunk and the top node, all under the MAC key.
+**
+**  Chunks are checked against the tree before any of their plaintext is
+**  written, and are MACed and decrypted a batch at a time across the
+**  threads. A range read touches the chunks it covers, their leaves and
+**  the siblings on their way to the root, and nothing else, so the input
+**  must be a seekable file; base is where its header starts. Either way
+**  only a batch and a path to the root are held at once: encryption
+**  spills the nodes to temporary files until the last chunk is out.
+*/
+
+class AESTree
+{
+private:
+
+	struct Trailer {
+		uint64_t length;
+		uint64_t count;
+		uint8_t root[AES_BLOCK_SIZE];
+		uint64_t last;
+		off_t chunks;
+		off_t nodes;
+		vector<uint64_t> widths;
+	};
+
+	AESEngine& engine;
+	AESEngine& mac;
+	const unsigned int nthreads;
+	const size_t chunk;
+
+	void readTrailer (FILE *in, off_t base, Trailer& t);
+	void readNodes (FILE *in, const Trailer& t, size_t level, uint64_t first, uint64_t n, uint8_t *out);
+	void checkPath (FILE *in, const Trailer& t, uint64_t first, uint64_t last, vector<uint8_t>& leaves);
+	void process (FILE *in, const Trailer& t, uint64_t from, uint64_t to, FILE *out);
+
+	void rootTag (uint64_t length, uint64_t count, const uint8_t *top, uint8_t *tag);
+	void chunkIV (uint64_t index, uint8_t *iv);
+
+public:
+
+	AESTree (AESEngine& e, AESEngine& m, unsigned int n = 1, size_t c = AES_TREE_CHUNK);
+
+	void encryptFile (FILE *in, FILE *out);
+	void decryptFile (FILE *in, off_t base, FILE *out);
+	void readRange (FILE *in, off_t base, FILE *out, uint64_t offset, uint64_t len);
+	void verifyFile (FILE *in, off_t base);
+
+	static vector<uint64_t> widths (uint64_t count);
+};
+
+
+class CorruptAESTree : public exception
+{
+private:
+
+	const char *msg;
+
+public:
+
+	CorruptAESTree (const char *m = "tree authentication failed")
+		: msg(m)
+	{}
+
+	virtual const char* what() const throw()
+	{
+		return msg;
+	}
+};
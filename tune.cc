@@ -0,0 +1,243 @@
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aes.h"
+#include "arena.h"
+#include "parallel.h"
+#include "tune.h"
+
+using namespace std;
+
+
+// how long each candidate is run for, in seconds
+#define AES_TUNE_TRIAL 0.01
+
+
+static const AESEngine::Backend BACKENDS[] = {
+	AESEngine::AES_BACKEND_TABLE,
+	AESEngine::AES_BACKEND_VPERM
+};
+
+static const size_t CHUNKS[] = {
+	16 * 1024,
+	64 * 1024,
+	256 * 1024,
+	1024 * 1024
+};
+
+
+AESProfile::AESProfile ()
+	: backend(AESEngine::AES_BACKEND_AUTO), chunk(AES_CHUNK_SIZE), threads(1), rate(0)
+{
+}
+
+
+static AESEngine::Backend backendByName (const char *name)
+{
+	for (unsigned int b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++b) {
+		if (strcmp(name, AESEngine::backendName(BACKENDS[b])) == 0)
+			return BACKENDS[b];
+	}
+	return AESEngine::AES_BACKEND_AUTO;
+}
+
+
+bool AESProfile::load (const string& filename)
+{
+	FILE *f = fopen(filename.c_str(), "r");
+	if (f == NULL)
+		return false;
+
+	AESProfile p;
+	int version = 0;
+	size_t cpus = 0;
+	char line[256];
+	char name[64];
+	char value[64];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%63s %63s", name, value) != 2)
+			continue;
+		if (strcmp(name, "version") == 0)
+			version = atoi(value);
+		else if (strcmp(name, "cpus") == 0)
+			cpus = strtoul(value, NULL, 10);
+		else if (strcmp(name, "backend") == 0)
+			p.backend = backendByName(value);
+		else if (strcmp(name, "chunk") == 0)
+			p.chunk = strtoul(value, NULL, 10);
+		else if (strcmp(name, "threads") == 0)
+			p.threads = strtoul(value, NULL, 10);
+		else if (strcmp(name, "rate") == 0)
+			p.rate = atof(value);
+	}
+	fclose(f);
+
+	// a stale profile is as good as none: the host it describes changed
+	if (version != AES_PROFILE_VERSION || cpus != AESParallel::cpus().size())
+		return false;
+	if (p.backend == AESEngine::AES_BACKEND_AUTO || !AESEngine::backendAvailable(p.backend))
+		return false;
+	if (p.chunk < AES_BLOCK_SIZE || p.threads == 0)
+		return false;
+
+	*this = p;
+	return true;
+}
+
+
+bool AESProfile::save (const string& filename) const
+{
+	// written to the side and renamed, so that concurrent first runs
+	// never see half a profile
+	string temp = filename + "." + to_string(getpid());
+	FILE *f = fopen(temp.c_str(), "w");
+	if (f == NULL)
+		return false;
+	fprintf(f, "# aes-rijndael tuning profile\n");
+	fprintf(f, "version %d\n", AES_PROFILE_VERSION);
+	fprintf(f, "cpus %zu\n", AESParallel::cpus().size());
+	fprintf(f, "backend %s\n", AESEngine::backendName(backend));
+	fprintf(f, "chunk %zu\n", chunk);
+	fprintf(f, "threads %u\n", threads);
+	fprintf(f, "rate %.1f\n", rate);
+	bool ok = (fclose(f) == 0);
+	if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+		unlink(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+void AESProfile::print (FILE *f) const
+{
+	fprintf(f, "backend %s, %u thread%s, %zu byte chunks (%.1f MB/s)\n",
+		AESEngine::backendName(backend), threads, threads == 1 ? "" : "s",
+		chunk, rate / 1e6);
+}
+
+
+string AESProfile::path ()
+{
+	const char *env = getenv("AES_PROFILE");
+	if (env != NULL && *env != '\0')
+		return env;
+
+	string dir;
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (cache != NULL && *cache != '\0') {
+		dir = cache;
+	} else if (home != NULL && *home != '\0') {
+		dir = string(home) + "/.cache";
+		mkdir(dir.c_str(), 0700);
+	} else {
+		return "";
+	}
+	dir += "/aes-rijndael";
+	mkdir(dir.c_str(), 0700);
+
+	char host[256] = "localhost";
+	gethostname(host, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	return dir + "/" + host + ".profile";
+}
+
+
+/*
+**  Benchmarking
+*/
+
+// bytes per second over repeated passes, for at least one trial period
+static double measure (const function<void ()>& pass, size_t bytes)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	size_t total = 0;
+	double elapsed = 0;
+	do {
+		pass();
+		total += bytes;
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	} while (elapsed < AES_TUNE_TRIAL);
+	return total / elapsed;
+}
+
+
+AESProfile AESProfile::tune (FILE *report)
+{
+	AESProfile best;
+	vector<uint8_t> key(16, 0x5a);
+
+	AESBuffer scratch(AES_CHUNK_SIZE);
+	memset(scratch.get(), 0, AES_CHUNK_SIZE);
+	for (unsigned int b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++b) {
+		if (!AESEngine::backendAvailable(BACKENDS[b]))
+			continue;
+		AESEngine engine(AESEngine::AES_128_ECB, key, BACKENDS[b]);
+		uint8_t *data = scratch.get();
+		double rate = measure([&engine, data] {
+			for (size_t off = 0; off < AES_CHUNK_SIZE; off += AES_BLOCK_SIZE)
+				engine.cipherBlock(data + off);
+		}, AES_CHUNK_SIZE);
+		if (report != NULL)
+			fprintf(report, "backend %-8s %10.1f MB/s\n", AESEngine::backendName(BACKENDS[b]), rate / 1e6);
+		if (rate > best.rate) {
+			best.backend = BACKENDS[b];
+			best.rate = rate;
+		}
+	}
+
+	// worker counts double up to every usable core
+	size_t ncpus = AESParallel::cpus().size();
+	vector<unsigned int> counts;
+	for (unsigned int n = 1; n < ncpus; n *= 2)
+		counts.push_back(n);
+	counts.push_back(ncpus);
+
+	AESEngine engine(AESEngine::AES_128_ECB, key, best.backend);
+	best.rate = 0;
+	for (unsigned int t = 0; t < counts.size(); ++t) {
+		for (unsigned int c = 0; c < sizeof(CHUNKS) / sizeof(CHUNKS[0]); ++c) {
+			AESParallel parallel(engine, counts[t], CHUNKS[c]);
+			size_t len = counts[t] * CHUNKS[c];
+			AESBuffer buffer(len);
+			uint8_t *data = buffer.get();
+			memset(data, 0, len);
+			double rate = measure([&parallel, data, len] {
+				parallel.encrypt(data, len);
+			}, len);
+			if (report != NULL)
+				fprintf(report, "threads %-3u chunk %-8zu %10.1f MB/s\n", counts[t], CHUNKS[c], rate / 1e6);
+			if (rate > best.rate) {
+				best.threads = counts[t];
+				best.chunk = CHUNKS[c];
+				best.rate = rate;
+			}
+		}
+	}
+	return best;
+}
+
+
+AESProfile AESProfile::current (bool retune)
+{
+	AESProfile profile;
+	string filename = path();
+	if (!retune && !filename.empty() && profile.load(filename))
+		return profile;
+
+	profile = tune();
+	if (!filename.empty())
+		profile.save(filename);
+	return profile;
+}
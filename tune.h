@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+
+#include <cstdio>
+#include <cstdint>
+
+#include "aes.h"
+
+using namespace std;
+
+
+#define AES_PROFILE_VERSION 1
+
+
+/*
+**  The tunables picked for this host: cipher backend, worker count and
+**  per-worker chunk size. tune() microbenchmarks the candidates (ECB
+**  over an in-memory buffer, a few milliseconds each); current() loads
+**  the cached profile and only tunes, then saves, when there is none or
+**  it was written for another CPU count or by another version.
+**
+**  The profile lives in $AES_PROFILE when set, otherwise in
+**  $XDG_CACHE_HOME/aes-rijndael/HOSTNAME.profile (~/.cache by default).
+*/
+
+class AESProfile
+{
+public:
+
+	AESEngine::Backend backend;
+	size_t chunk;
+	unsigned int threads;
+	double rate;
+
+	AESProfile ();
+
+	bool load (const string& filename);
+	bool save (const string& filename) const;
+	void print (FILE *f) const;
+
+	static string path ();
+	static AESProfile tune (FILE *report = NULL);
+	static AESProfile current (bool retune = false);
+};
@@ -0,0 +1,428 @@
+#include <cstdint>
+#include <cstring>
+
+#include "vperm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define AES_VPERM 1
+#define VPERM_TARGET __attribute__((target("ssse3")))
+#endif
+
+
+/*
+**  Tower field GF((2^4)^2)
+**
+**  GF(16) is GF(2)[z]/(z^4 + z + 1). A byte is represented as i.t + k
+**  with i, k in GF(16) and t^2 = a.t + a; for that polynomial the
+**  inverse of i.t + k can be had from single-nibble lookups only:
+**
+**      j  = i + k
+**      io = 1/(1/i + a/k) + j
+**      jo = 1/(1/j + a/k) + i
+**
+**  io and jo are each one nibble, and the inverse (in any basis, with or
+**  without the affine step of SubBytes) is a linear function of 1/io and
+**  1/jo, so it takes one more lookup per nibble. Division by zero gives
+**  0x80, which makes the next pshufb return zero, and that carries every
+**  degenerate case through correctly.
+**
+**  The tables are derived here rather than hard-coded: the basis change
+**  from the AES field is found by searching the tower field for a root of
+**  the AES polynomial.
+*/
+
+struct VpermTables {
+	uint8_t encLo[16];
+	uint8_t encHi[16];
+	uint8_t decLo[16];
+	uint8_t decHi[16];
+	uint8_t inv[16];
+	uint8_t ak[16];
+	uint8_t encF[16];
+	uint8_t encG[16];
+	uint8_t decF[16];
+	uint8_t decG[16];
+};
+
+
+static uint8_t gf16mul (uint8_t x, uint8_t y)
+{
+	uint8_t r = 0;
+	for (int b = 0; b < 4; ++b) {
+		if ((y >> b) & 1)
+			r ^= x << b;
+	}
+	for (int b = 7; b >= 4; --b) {
+		if ((r >> b) & 1)
+			r ^= 0x13 << (b - 4);
+	}
+	return r;
+}
+
+
+static uint8_t gf16inv (uint8_t x)
+{
+	for (uint8_t y = 1; y < 16; ++y) {
+		if (gf16mul(x, y) == 1)
+			return y;
+	}
+	return 0;
+}
+
+
+static uint8_t towermul (uint8_t x, uint8_t y, uint8_t a)
+{
+	uint8_t ii = gf16mul(x >> 4, y >> 4);
+	uint8_t hi = gf16mul(ii, a) ^ gf16mul(x >> 4, y & 15) ^ gf16mul(x & 15, y >> 4);
+	uint8_t lo = gf16mul(ii, a) ^ gf16mul(x & 15, y & 15);
+	return (uint8_t)((hi << 4) | lo);
+}
+
+
+// the linear part of the SubBytes affine transform
+static uint8_t affine (uint8_t x)
+{
+	uint8_t r = 0;
+	for (int b = 0; b < 8; ++b) {
+		int bit = (x >> b) ^ (x >> ((b + 4) % 8)) ^ (x >> ((b + 5) % 8))
+			^ (x >> ((b + 6) % 8)) ^ (x >> ((b + 7) % 8));
+		r |= (bit & 1) << b;
+	}
+	return r;
+}
+
+
+static VpermTables buildTables ()
+{
+	VpermTables t;
+
+	// t^2 + a.t + a must be irreducible over GF(16)
+	uint8_t a = 1;
+	for (a = 1; a < 16; ++a) {
+		bool root = false;
+		for (uint8_t u = 0; u < 16; ++u)
+			root |= (gf16mul(u, u) ^ gf16mul(a, u) ^ a) == 0;
+		if (!root)
+			break;
+	}
+
+	// g is a root of x^8 + x^4 + x^3 + x + 1, the image of x = 0x02
+	uint8_t powers[9];
+	uint8_t g;
+	for (g = 2; g != 0; ++g) {
+		powers[0] = 1;
+		for (int n = 1; n <= 8; ++n)
+			powers[n] = towermul(powers[n - 1], g, a);
+		if ((powers[8] ^ powers[4] ^ powers[3] ^ powers[1] ^ powers[0]) == 0)
+			break;
+	}
+
+	uint8_t psi[256];
+	uint8_t psiinv[256];
+	uint8_t affinv[256];
+	for (int x = 0; x < 256; ++x) {
+		uint8_t r = 0;
+		for (int n = 0; n < 8; ++n) {
+			if ((x >> n) & 1)
+				r ^= powers[n];
+		}
+		psi[x] = r;
+	}
+	for (int x = 0; x < 256; ++x) {
+		psiinv[psi[x]] = (uint8_t)x;
+		affinv[affine((uint8_t)x)] = (uint8_t)x;
+	}
+
+	uint8_t ia = gf16inv(a);
+	uint8_t ia2 = gf16mul(ia, ia);
+	uint8_t c1 = ia ^ ia2;
+	uint8_t decconst = psi[affinv[0x63]];
+	for (int n = 0; n < 16; ++n) {
+		t.encLo[n] = psi[n];
+		t.encHi[n] = psi[n << 4];
+		t.decLo[n] = psi[affinv[n]] ^ decconst;
+		t.decHi[n] = psi[affinv[n << 4]];
+		t.inv[n] = (n == 0) ? 0x80 : gf16inv(n);
+		t.ak[n] = (n == 0) ? 0x80 : gf16mul(a, gf16inv(n));
+
+		uint8_t yl = gf16inv(n);
+		uint8_t lo = psiinv[(gf16mul(yl, c1) << 4) | yl];
+		uint8_t hi = psiinv[gf16mul(yl, ia2) << 4];
+		t.encF[n] = affine(lo);
+		t.encG[n] = affine(hi);
+		t.decF[n] = lo;
+		t.decG[n] = hi;
+	}
+	return t;
+}
+
+
+static const VpermTables TABLES = buildTables();
+
+
+#ifdef AES_VPERM
+
+
+/*
+**  Round functions
+*/
+
+struct VpermState {
+	__m128i mask;
+	__m128i lo;
+	__m128i hi;
+	__m128i inv;
+	__m128i ak;
+	__m128i f;
+	__m128i g;
+	__m128i c;
+};
+
+
+VPERM_TARGET
+static inline __m128i load (const uint8_t *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+
+VPERM_TARGET
+static inline __m128i subBytes (__m128i s, const VpermState& v)
+{
+	__m128i rep = _mm_xor_si128(
+		_mm_shuffle_epi8(v.lo, _mm_and_si128(s, v.mask)),
+		_mm_shuffle_epi8(v.hi, _mm_and_si128(_mm_srli_epi16(s, 4), v.mask)));
+	__m128i k = _mm_and_si128(rep, v.mask);
+	__m128i i = _mm_and_si128(_mm_srli_epi16(rep, 4), v.mask);
+	__m128i j = _mm_xor_si128(i, k);
+	__m128i ak = _mm_shuffle_epi8(v.ak, k);
+	__m128i iak = _mm_xor_si128(_mm_shuffle_epi8(v.inv, i), ak);
+	__m128i jak = _mm_xor_si128(_mm_shuffle_epi8(v.inv, j), ak);
+	__m128i io = _mm_xor_si128(_mm_shuffle_epi8(v.inv, iak), j);
+	__m128i jo = _mm_xor_si128(_mm_shuffle_epi8(v.inv, jak), i);
+	return _mm_xor_si128(_mm_xor_si128(
+		_mm_shuffle_epi8(v.f, io), _mm_shuffle_epi8(v.g, jo)), v.c);
+}
+
+
+VPERM_TARGET
+static inline __m128i xtime (__m128i s)
+{
+	__m128i carry = _mm_cmplt_epi8(s, _mm_setzero_si128());
+	return _mm_xor_si128(_mm_add_epi8(s, s), _mm_and_si128(carry, _mm_set1_epi8(0x1b)));
+}
+
+
+// bytes are column-major: byte c*4 + r is row r of column c
+VPERM_TARGET
+static inline __m128i rotateColumns (__m128i s, int n)
+{
+	static const uint8_t ROT[3][16] = {
+		{ 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12 },
+		{ 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13 },
+		{ 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14 }
+	};
+	return _mm_shuffle_epi8(s, load(ROT[n - 1]));
+}
+
+
+VPERM_TARGET
+static inline __m128i mixColumns (__m128i s)
+{
+	__m128i r1 = rotateColumns(s, 1);
+	__m128i r2 = rotateColumns(s, 2);
+	__m128i r3 = rotateColumns(s, 3);
+	return _mm_xor_si128(_mm_xor_si128(xtime(_mm_xor_si128(s, r1)), r1), _mm_xor_si128(r2, r3));
+}
+
+
+// InvMixColumns is MixColumns after multiplying by 5, 0, 4, 0 circulant
+VPERM_TARGET
+static inline __m128i invMixColumns (__m128i s)
+{
+	__m128i u = xtime(xtime(_mm_xor_si128(s, rotateColumns(s, 2))));
+	return mixColumns(_mm_xor_si128(s, u));
+}
+
+
+VPERM_TARGET
+static inline void loadState (VpermState& v, bool decrypt)
+{
+	v.mask = _mm_set1_epi8(0x0f);
+	v.lo = load(decrypt ? TABLES.decLo : TABLES.encLo);
+	v.hi = load(decrypt ? TABLES.decHi : TABLES.encHi);
+	v.inv = load(TABLES.inv);
+	v.ak = load(TABLES.ak);
+	v.f = load(decrypt ? TABLES.decF : TABLES.encF);
+	v.g = load(decrypt ? TABLES.decG : TABLES.encG);
+	v.c = _mm_set1_epi8(decrypt ? 0x00 : 0x63);
+}
+
+
+static const uint8_t SHIFT_ROWS[16] = {
+	0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11
+};
+
+static const uint8_t INV_SHIFT_ROWS[16] = {
+	0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3
+};
+
+
+VPERM_TARGET
+void vpermEncryptBlock (uint8_t *block, const uint8_t *roundkeys, int nrounds)
+{
+	VpermState v;
+	loadState(v, false);
+	__m128i sr = load(SHIFT_ROWS);
+
+	__m128i s = _mm_xor_si128(load(block), load(roundkeys));
+	for (int r = 1; r < nrounds; ++r) {
+		s = _mm_shuffle_epi8(subBytes(s, v), sr);
+		s = _mm_xor_si128(mixColumns(s), load(roundkeys + r * 16));
+	}
+	s = _mm_shuffle_epi8(subBytes(s, v), sr);
+	s = _mm_xor_si128(s, load(roundkeys + nrounds * 16));
+	_mm_storeu_si128((__m128i *)block, s);
+}
+
+
+VPERM_TARGET
+void vpermDecryptBlock (uint8_t *block, const uint8_t *roundkeys, int nrounds)
+{
+	VpermState v;
+	loadState(v, true);
+	__m128i isr = load(INV_SHIFT_ROWS);
+
+	__m128i s = _mm_xor_si128(load(block), load(roundkeys + nrounds * 16));
+	for (int r = nrounds - 1; r >= 1; --r) {
+		s = subBytes(_mm_shuffle_epi8(s, isr), v);
+		s = invMixColumns(_mm_xor_si128(s, load(roundkeys + r * 16)));
+	}
+	s = subBytes(_mm_shuffle_epi8(s, isr), v);
+	s = _mm_xor_si128(s, load(roundkeys));
+	_mm_storeu_si128((__m128i *)block, s);
+}
+
+
+/*
+**  Four independent blocks a round at a time: each round is one long
+**  dependency chain, so interleaving them keeps the shuffle units busy.
+*/
+
+VPERM_TARGET
+static inline __m128i encryptRound (__m128i s, const VpermState& v, __m128i sr, __m128i rk)
+{
+	return _mm_xor_si128(mixColumns(_mm_shuffle_epi8(subBytes(s, v), sr)), rk);
+}
+
+
+VPERM_TARGET
+static inline __m128i decryptRound (__m128i s, const VpermState& v, __m128i isr, __m128i rk)
+{
+	return invMixColumns(_mm_xor_si128(subBytes(_mm_shuffle_epi8(s, isr), v), rk));
+}
+
+
+VPERM_TARGET
+void vpermEncryptBlocks (uint8_t *blocks, size_t n, const uint8_t *roundkeys, int nrounds)
+{
+	VpermState v;
+	loadState(v, false);
+	__m128i sr = load(SHIFT_ROWS);
+
+	size_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		uint8_t *p = blocks + k * 16;
+		__m128i rk = load(roundkeys);
+		__m128i s0 = _mm_xor_si128(load(p), rk);
+		__m128i s1 = _mm_xor_si128(load(p + 16), rk);
+		__m128i s2 = _mm_xor_si128(load(p + 32), rk);
+		__m128i s3 = _mm_xor_si128(load(p + 48), rk);
+		for (int r = 1; r < nrounds; ++r) {
+			rk = load(roundkeys + r * 16);
+			s0 = encryptRound(s0, v, sr, rk);
+			s1 = encryptRound(s1, v, sr, rk);
+			s2 = encryptRound(s2, v, sr, rk);
+			s3 = encryptRound(s3, v, sr, rk);
+		}
+		rk = load(roundkeys + nrounds * 16);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(_mm_shuffle_epi8(subBytes(s0, v), sr), rk));
+		_mm_storeu_si128((__m128i *)(p + 16), _mm_xor_si128(_mm_shuffle_epi8(subBytes(s1, v), sr), rk));
+		_mm_storeu_si128((__m128i *)(p + 32), _mm_xor_si128(_mm_shuffle_epi8(subBytes(s2, v), sr), rk));
+		_mm_storeu_si128((__m128i *)(p + 48), _mm_xor_si128(_mm_shuffle_epi8(subBytes(s3, v), sr), rk));
+	}
+	for (; k < n; ++k)
+		vpermEncryptBlock(blocks + k * 16, roundkeys, nrounds);
+}
+
+
+VPERM_TARGET
+void vpermDecryptBlocks (uint8_t *blocks, size_t n, const uint8_t *roundkeys, int nrounds)
+{
+	VpermState v;
+	loadState(v, true);
+	__m128i isr = load(INV_SHIFT_ROWS);
+
+	size_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		uint8_t *p = blocks + k * 16;
+		__m128i rk = load(roundkeys + nrounds * 16);
+		__m128i s0 = _mm_xor_si128(load(p), rk);
+		__m128i s1 = _mm_xor_si128(load(p + 16), rk);
+		__m128i s2 = _mm_xor_si128(load(p + 32), rk);
+		__m128i s3 = _mm_xor_si128(load(p + 48), rk);
+		for (int r = nrounds - 1; r >= 1; --r) {
+			rk = load(roundkeys + r * 16);
+			s0 = decryptRound(s0, v, isr, rk);
+			s1 = decryptRound(s1, v, isr, rk);
+			s2 = decryptRound(s2, v, isr, rk);
+			s3 = decryptRound(s3, v, isr, rk);
+		}
+		rk = load(roundkeys);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(subBytes(_mm_shuffle_epi8(s0, isr), v), rk));
+		_mm_storeu_si128((__m128i *)(p + 16), _mm_xor_si128(subBytes(_mm_shuffle_epi8(s1, isr), v), rk));
+		_mm_storeu_si128((__m128i *)(p + 32), _mm_xor_si128(subBytes(_mm_shuffle_epi8(s2, isr), v), rk));
+		_mm_storeu_si128((__m128i *)(p + 48), _mm_xor_si128(subBytes(_mm_shuffle_epi8(s3, isr), v), rk));
+	}
+	for (; k < n; ++k)
+		vpermDecryptBlock(blocks + k * 16, roundkeys, nrounds);
+}
+
+
+bool vpermAvailable ()
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+
+#else
+
+
+bool vpermAvailable ()
+{
+	return false;
+}
+
+
+void vpermEncryptBlock (uint8_t *, const uint8_t *, int)
+{
+}
+
+
+void vpermDecryptBlock (uint8_t *, const uint8_t *, int)
+{
+}
+
+
+void vpermEncryptBlocks (uint8_t *, size_t, const uint8_t *, int)
+{
+}
+
+
+void vpermDecryptBlocks (uint8_t *, size_t, const uint8_t *, int)
+{
+}
+
+
+#endif
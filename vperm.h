@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+/*
+**  Vector-permute AES (after Hamburg, "Accelerating AES with Vector
+**  Permute Instructions"). The block lives in one XMM register; SubBytes
+**  is computed in GF((2^4)^2) through nibble-indexed pshufb lookups and
+**  MixColumns through byte shuffles within the columns, so there are no
+**  data-dependent memory accesses. Needs SSSE3, checked at run time.
+**
+**  roundkeys is the expanded key laid out contiguously, one 16-byte round
+**  key after another, as in AESEngine's schedule. The Blocks variants
+**  take n consecutive blocks and work on four at a time.
+*/
+
+bool vpermAvailable ();
+
+void vpermEncryptBlock (uint8_t *block, const uint8_t *roundkeys, int nrounds);
+void vpermDecryptBlock (uint8_t *block, const uint8_t *roundkeys, int nrounds);
+
+void vpermEncryptBlocks (uint8_t *blocks, size_t n, const uint8_t *roundkeys, int nrounds);
+void vpermDecryptBlocks (uint8_t *blocks, size_t n, const uint8_t *roundkeys, int nrounds);